@@ -6,185 +6,414 @@
 */
 #include "eeprom.h"
 
-/* 虚拟地址数组(0xFFFF不允许) */
-extern uint16_t virt_addr_var_tab[NumbOfVar];
+#include <string.h>
 
-/* 内部全局变量，用于保存读出的变量 */
-uint8_t data_var[VARIABLE_MAX_SIZE];
+/* 编译期检查，条件不成立时数组长度为负 */
+#define EE_STATIC_ASSERT(name, cond) typedef char ee_assert_##name[(cond) ? 1 : -1]
 
-/*  Page status definitions
-  在FLASH中的样子(低字节在前)：
-  ERASED              FFFF FFFF FFFF FFFF
-  RECEIVE_DATA        FFFF FFFF EEEE EEEE
-  VALID_PAGE          0000 0000 EEEE EEEE
+/* 由变量表 EE_VAR_TABLE 生成的默认实例 */
+#define EE_VAR_CHECK(name, size, def) \
+  EE_STATIC_ASSERT(size_##name, (size) <= EE_LARGE_MAX_SIZE);
+EE_INSTANCE_DEFINE(ee_default_instance, EE_VAR_TABLE, IDX_START,
+                   EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+EE_VAR_TABLE(EE_VAR_CHECK)
+
+/* 实例中下标为 slot 的变量的虚拟地址 */
+#define EE_KEY(inst, slot)                                     \
+  ((uint16_t)((inst)->var_key != (void*)0 ? (inst)->var_key[slot] \
+                                          : (inst)->key_base + 1 + (slot)))
+/* 散列目录：乘法散列取高位，空项 */
+#define EE_DIR_HASH(key) ((uint16_t)(((uint32_t)(key) * 0x9E3779B1u) >> 16))
+#define EE_DIR_EMPTY ((uint16_t)0xFFFF)
+/* 实例第 page 页的起始地址、实例的结束地址 */
+#define EE_INST_PAGE(inst, page) \
+  ((inst)->start + (uint32_t)(page) * PAGE_SIZE)
+#define EE_INST_END(inst) EE_INST_PAGE(inst, (inst)->page_count)
+
+/* EE_CONCURRENT：写入方持锁；修改读取方可见的状态（RAM 索引、写回缓存、异步队列）
+   前后各把版本号加 1，见 EE_InstRead */
+#if EE_CONCURRENT
+#define EE_LOCK() EE_PortLock()
+#define EE_UNLOCK() EE_PortUnlock()
+#define EE_SEQ_BEGIN(inst) ((inst)->seq++, EE_PORT_BARRIER())
+#define EE_SEQ_END(inst) (EE_PORT_BARRIER(), (inst)->seq++)
+#else
+#define EE_LOCK() ((void)0)
+#define EE_UNLOCK() ((void)0)
+#define EE_SEQ_BEGIN(inst) ((void)0)
+#define EE_SEQ_END(inst) ((void)0)
+#endif
+
+/* EE_STATS：计数和计时，不统计时为空；start 为 EE_STAT_START 定义的起始周期。
+   EE_CONCURRENT 时不加锁的读取方也要更新读取次数、查找和读取耗时，计数用原子累加 */
+#if EE_STATS
+#if EE_CONCURRENT
+#define EE_STAT_ADD(inst, field, n) EE_StatsAdd(&(inst)->stats.field, (n))
+#else
+#define EE_STAT_ADD(inst, field, n) ((inst)->stats.field += (n))
+#endif
+#define EE_STAT_START(start) uint32_t start = EE_PortCycles()
+#define EE_STAT_TIME(inst, lat, start) \
+  EE_StatsLatency(&(inst)->stats.lat, EE_PortCycles() - (start))
+#else
+#define EE_STAT_ADD(inst, field, n) ((void)0)
+#define EE_STAT_START(start) ((void)0)
+#define EE_STAT_TIME(inst, lat, start) ((void)0)
+#endif
+
+/* 差分记录的段头用 1 字节记录偏移和字节数 */
+EE_STATIC_ASSERT(delta_offset, VARIABLE_MAX_SIZE <= 0xFF);
+
+/* 虚拟地址不能是 0xFFFF、0xFFFE、0xFFFD（擦除状态、提交字、填充字）；
+   紧凑记录用取反的虚拟地址，取反后也不能落在表中或上述值上 */
+EE_STATIC_ASSERT(var_count,
+                 NumbOfVar > 0 && IDX_BUTT - IDX_START - 1 <= EE_MAX_VAR_COUNT);
+EE_STATIC_ASSERT(var_keys, IDX_START >= 2 && IDX_BUTT <= 0xFFFD);
+EE_STATIC_ASSERT(var_packed_keys,
+                 (uint16_t)~(IDX_BUTT - 1) >= IDX_BUTT ||
+                     (uint16_t)~(IDX_START + 1) <= IDX_START);
+
+/*  记录格式（从页头之后依次追加，扫描时从写指针往前回溯）：
+  [数据，按字对齐][补齐到编程单元][尾字]，尾字总在记录最后 4 字节
+  尾字高 16 位为虚拟地址，低 16 位为 类型(4bit) | 首单元标志(1bit) | 数据长度(11bit)
+  占多个编程单元的记录先写后面的单元（尾字所在单元在其中最后），再写第一个单元：
+  掉电时已写入的部分从空白的第一个单元处断开，不会被误认成完整的短记录；
+  第一个单元不全为 0xFF 时尾字带 EE_REC_HEAD，扫描时第一个单元仍为空白的记录无效。
+  批量写入的记录之后跟一个提交字（单独占一个编程单元，位于单元末尾），
+  高 16 位为 EE_KEY_COMMIT，
+  低 16 位为它所提交的记录总字数；没有被提交字覆盖的批量记录无效。
+  掉电留下的不完整记录之后写一个填充字，高 16 位为 EE_KEY_PAD，
+  低 16 位为连同自身在内要跳过的字数，记录链由此越过这段无法改写的区域。
+  紧凑记录（EE_PACKED_RECORDS）不带长度字段，只占一个编程单元：
+  [0xFF 补齐][数据][取反的虚拟地址]，数据紧靠单元末尾的 2 字节地址，最后两个字节
+  落在尾字低 16 位；数据不足 2 字节时第二字节为 0xFF（1 字节定长变量扫描时也检查）。
+  定长变量的长度由变量表给出，变长变量只在 1~2 字节时使用，第二字节为 0xFF 表示
+  1 字节（第二字节为 0xFF 的 2 字节值写成普通记录）。
+  取反后的地址不在表中，扫描时不会与普通记录的尾字混淆。
+  差分记录（EE_REC_DELTA）格式同普通记录，数据为若干段 [偏移][字节数][新数据]，
+  记录的是与该变量最近一条完整记录（基准）相比改动的字节，读取时在基准上
+  套用最新一条差分即可；回收时合并为完整记录
+  大变量分块存放（EE_REC_CHUNK）：每块格式同普通记录，除最后一块外都是
+  VARIABLE_MAX_SIZE 字节，各块依次相连，最后跟一个提交字覆盖所有块，没有提交字的块无效；
+  第 k 块的数据位于第一块起 k * EE_RECORD_SIZE(VARIABLE_MAX_SIZE) 处，RAM 索引指向第一块
+  索引快照（EE_BOOT_SNAPSHOT）格式同普通记录，虚拟地址为 EE_KEY_INDEX，只出现在
+  页头之后第一条，数据第一个字为 key_base << 16 | var_count，之后每个变量一个字：
+  低 16 位为基准记录尾字的位置，高 16 位为最新差分记录尾字的位置（相对实例起始
+  地址，0 表示没有），内容为启用该页之前的 RAM 索引
  */
-const uint64_t ERASED = ((uint64_t)0xFFFFFFFFFFFFFFFF);
-const uint64_t RECEIVE_DATA = ((uint64_t)0xEEEEEEEEFFFFFFFF);
-const uint64_t VALID_PAGE = ((uint64_t)0xEEEEEEEE00000000);
+#define EE_REC_DATA      ((uint16_t)0x0000) /* 普通记录 */
+#define EE_REC_BATCH     ((uint16_t)0x1000) /* 批量记录，需提交字确认 */
+#define EE_REC_DELTA     ((uint16_t)0x2000) /* 差分记录 */
+#define EE_REC_CHUNK     ((uint16_t)0x3000) /* 大变量的一块，需提交字确认 */
+#define EE_REC_TYPE_MASK ((uint16_t)0xF000)
+#define EE_REC_HEAD      ((uint16_t)0x0800) /* 第一个编程单元不是空白 */
+#define EE_REC_LEN_MASK  ((uint16_t)0x07FF)
+#define EE_KEY_COMMIT    ((uint16_t)0xFFFE)
+#define EE_KEY_PAD       ((uint16_t)0xFFFD)
+#define EE_KEY_INDEX     ((uint16_t)0x0001) /* 表中地址不小于 3，取反后不大于 0xFFFC */
+
+/* 索引快照的数据字节数 */
+#define EE_SNAPSHOT_LEN(inst) ((uint16_t)(4 + 4 * (uint32_t)(inst)->var_count))
+
+/* 下标为 slot 的变量是否为大变量；每块的数据字节数；size 字节的大变量连同提交字
+   占用的字节数 */
+#define EE_LARGE(inst, slot) ((inst)->var_size[slot] > VARIABLE_MAX_SIZE)
+#define EE_CHUNK_SIZE VARIABLE_MAX_SIZE
+#define EE_CHUNKED_SIZE(size)                                            \
+  ((uint32_t)(size) / EE_CHUNK_SIZE * EE_RECORD_SIZE(EE_CHUNK_SIZE) +    \
+   ((size) % EE_CHUNK_SIZE != 0 ? EE_RECORD_SIZE((size) % EE_CHUNK_SIZE) \
+                                : 0) +                                   \
+   EE_PROGRAM_WIDTH)
+
+/* 紧凑记录的数据字段字节数，能写成紧凑记录的最大数据字节数 */
+#define EE_PACKED_FIELD(len) ((len) < 2 ? 2 : (uint32_t)(len))
+#define EE_PACKED_MAX (EE_PROGRAM_WIDTH - 2)
+
+/* EE_ReclaimPages 一次完成回收 */
+#define EE_RECLAIM_ALL ((uint16_t)0xFFFF)
+/* 回收未完成时写入页额外保留的空间：掉电留下的两条不完整记录及其填充字 */
+#define EE_RECLAIM_SLACK \
+  (2 * (EE_RECORD_SIZE(VARIABLE_MAX_SIZE) + EE_PROGRAM_WIDTH))
+
+#if EE_WRITE_BACK
+EE_STATIC_ASSERT(flush_timeout,
+                 (uint64_t)EE_FLUSH_TIMEOUT_MS * EE_CYCLES_PER_MS < 0x80000000u);
+#endif
+
+#if EE_ASYNC_QUEUE
+EE_STATIC_ASSERT(async_queue, (EE_ASYNC_QUEUE & (EE_ASYNC_QUEUE - 1)) == 0);
+#endif
+
+/*  页头（每页前两个编程单元，每个单元只用第一个字，便于分别编程）：
+  第一个字为页序号，启用该页时写入，0xFFFFFFFF 表示未启用；
+  第二个字为 0 表示该页已回收、等待擦除（旧版两页格式的有效页为 EEEE EEEE，
+  序号为 0，可直接沿用）。
+  已启用且未回收的页按序号从旧到新组成环形日志，新记录总是追加在序号最大的页。
+ */
+#define EE_SEQ_ERASED     ((uint32_t)0xFFFFFFFF)
+#define EE_LEGACY_RECEIVE ((uint32_t)0xEEEEEEEE)
+#define EE_PAGE_RETIRED   ((uint32_t)0x00000000)
+#define EE_PAGE_HEADER_SIZE (2 * EE_PROGRAM_WIDTH)
+
+/* 大变量整个值写在一页中：换页后旧值复制到新写入页，新值还要写在同一页，
+   回收未完成时两份值仍要放得下 */
+EE_STATIC_ASSERT(large_size,
+                 2 * EE_CHUNKED_SIZE(EE_LARGE_MAX_SIZE) + EE_RECLAIM_SLACK <=
+                     PAGE_SIZE - EE_PAGE_HEADER_SIZE);
 
-static uint16_t EE_Format(void);
-static uint16_t EE_FindValidPage(uint8_t Operation);
-static uint16_t EE_VerifyPageFullWriteVariable(uint16_t virt_addr, void* data,
+static uint16_t EE_Format(ee_instance_t* inst);
+static uint16_t EE_FindValidPage(ee_instance_t* inst);
+static uint16_t EE_FindOldestPage(ee_instance_t* inst);
+static uint16_t EE_FindFreePage(ee_instance_t* inst, uint16_t valid_page);
+static uint16_t EE_OpenPage(ee_instance_t* inst, uint16_t page, uint32_t seq);
+static uint16_t EE_RetirePage(ee_instance_t* inst, uint16_t page);
+static uint8_t EE_IsLivePage(ee_instance_t* inst, uint16_t page);
+static uint16_t EE_ReclaimPages(ee_instance_t* inst, uint16_t* budget,
+                                uint8_t erase_now);
+static uint32_t EE_ReclaimBytes(ee_instance_t* inst);
+static void EE_ReclaimScan(ee_instance_t* inst, uint16_t page);
+static void EE_ReclaimDrop(ee_instance_t* inst, uint16_t slot);
+static uint16_t EE_PadTail(ee_instance_t* inst, uint16_t page, uint32_t skip);
+static uint16_t EE_VerifyPageFullWriteVariable(ee_instance_t* inst,
+                                               uint16_t virt_addr, void* data,
                                                uint16_t size);
-static uint16_t EE_PageTransfer(uint16_t virt_addr, void* data, uint16_t size);
-static uint16_t EE_FindFirstVirAddr(uint16_t page);
-
-/*!
-     PAGE0     |    PAGE1     |   操作
-  -------------+--------------+----------------------------------
-  ERASED       | ERASED       | 无效状态，擦除两个页并格式化PAGE0
-  ERASED       | RECEIVE_DATA | 擦除PAGE0，将PAGE1标记为VALID_PAGE
-  ERASED       | VALID_PAGE   | 将PAGE1作为有效页使用，擦除PAGE0
-  -------------+--------------+----------------------------------
-  RECEIVE_DATA | ERASED       | 擦除PAGE1，将PAGE0标记为VALID_PAGE
-  RECEIVE_DATA | RECEIVE_DATA | 无效状态，擦除两个页并格式化PAGE0
-  RECEIVE_DATA | VALID_PAGE   |
-  将PAGE1作为有效页使用，将PAGE1变量传输至PAGE0，标记PAGE0为有效，擦除PAGE1
-  -------------+--------------+----------------------------------
-  VALID_PAGE   | ERASED       | 将PAGE0作为有效页使用，擦除PAGE1
-  VALID_PAGE   | RECEIVE_DATA |
-  将PAGE0作为有效页使用，将PAGE0变量传输至PAGE1，标记PAGE1为有效，擦除PAGE0
-  VALID_PAGE   | VALID_PAGE   | 无效状态，擦除两个页并格式化PAGE0
-
-    \brief      EEPROM 初始化
-    \param[in]  none
+static uint16_t EE_PageTransfer(ee_instance_t* inst, uint16_t virt_addr,
+                                void* data, uint16_t size);
+static uint16_t EE_CopyRecord(ee_instance_t* inst, uint16_t slot,
+                              uint16_t dst_page);
+static uint16_t EE_FoldRecord(ee_instance_t* inst, uint16_t slot,
+                              uint32_t write_addr);
+static uint16_t EE_CopyChunks(ee_instance_t* inst, uint16_t slot,
+                              uint32_t write_addr);
+static uint16_t EE_CheckWrite(ee_instance_t* inst, uint16_t virt_addr,
+                              uint16_t size, uint16_t* slot);
+static uint16_t EE_WriteSlot(ee_instance_t* inst, uint16_t slot, void* data,
+                             uint16_t size);
+static uint16_t EE_WriteRecord(ee_instance_t* inst, uint16_t slot, void* data,
+                               uint16_t size);
+#if EE_WRITE_BACK
+static ee_cache_t* EE_CacheFind(ee_instance_t* inst, uint16_t slot);
+static uint16_t EE_CacheWrite(ee_instance_t* inst, uint16_t slot,
+                              const void* data, uint16_t size);
+static uint16_t EE_CacheFlushEntry(ee_instance_t* inst, ee_cache_t* entry);
+static uint16_t EE_CacheFlushExpired(ee_instance_t* inst, uint16_t* budget);
+#endif
+#if EE_SKIP_UNCHANGED
+static uint8_t EE_SkipUnchanged(ee_instance_t* inst, uint16_t slot,
+                                const void* data, uint16_t size);
+static uint8_t EE_RecordEquals(ee_instance_t* inst, uint16_t slot,
+                               const void* data, uint16_t size);
+#endif
+#if EE_ASYNC_QUEUE
+static uint16_t EE_AsyncPrepare(ee_instance_t* inst, ee_async_entry_t* entry);
+static const uint8_t* EE_AsyncFind(ee_instance_t* inst, uint16_t slot,
+                                   uint16_t* len);
+static void EE_AsyncFinish(ee_instance_t* inst, uint16_t status);
+static void EE_AsyncDrain(ee_instance_t* inst);
+#endif
+static uint16_t EE_MakeDelta(ee_instance_t* inst, uint16_t slot,
+                             const void* data, uint16_t size, uint8_t* patch);
+static void EE_ApplyDelta(ee_instance_t* inst, uint16_t slot, uint8_t* data,
+                          uint16_t size);
+static uint32_t EE_PrepareRecord(ee_instance_t* inst, uint16_t slot,
+                                 const void* data, uint16_t size,
+                                 uint32_t* image, uint8_t* packed,
+                                 uint8_t* delta);
+static void EE_IndexRecord(ee_instance_t* inst, uint16_t slot,
+                           uint32_t write_addr, uint32_t rec_size,
+                           uint16_t size, uint8_t packed, uint8_t delta);
+static uint32_t EE_BuildRecord(uint32_t* image, uint16_t virt_addr,
+                               const void* data, uint16_t size, uint16_t type);
+static uint32_t EE_BuildPacked(ee_instance_t* inst, uint32_t* image,
+                               uint16_t slot, const void* data, uint16_t size);
+static uint16_t EE_ProgramRecord(ee_instance_t* inst, uint32_t write_addr,
+                                 const uint32_t* image, uint32_t rec_size);
+static uint16_t EE_AppendRecord(ee_instance_t* inst, uint32_t write_addr,
+                                uint16_t virt_addr, void* data, uint16_t size,
+                                uint16_t type);
+static uint16_t EE_AppendPacked(ee_instance_t* inst, uint32_t write_addr,
+                                uint16_t slot, const void* data, uint16_t size);
+static uint16_t EE_FindSlot(ee_instance_t* inst, uint16_t virt_addr);
+static uint8_t EE_CanPack(ee_instance_t* inst, uint16_t slot, const void* data,
+                          uint16_t size);
+static uint16_t EE_PackedLen(ee_instance_t* inst, uint32_t trailer);
+static uint32_t EE_SlotRecordSize(ee_instance_t* inst, uint16_t slot);
+static uint32_t EE_SlotDataAddr(ee_instance_t* inst, uint16_t slot);
+static void EE_ClearIndex(ee_instance_t* inst);
+static uint32_t EE_IndexPage(ee_instance_t* inst, uint16_t page);
+static uint32_t EE_IndexPages(ee_instance_t* inst);
+static uint8_t EE_LoadSnapshot(ee_instance_t* inst, uint16_t page);
+#if EE_BOOT_SNAPSHOT
+static uint16_t EE_WriteSnapshot(ee_instance_t* inst);
+static uint32_t EE_SnapshotWord(ee_instance_t* inst, uint32_t word,
+                                uint32_t words);
+#endif
+static uint32_t EE_RecordSize(ee_instance_t* inst, uint32_t trailer);
+static uint8_t EE_RemovedKey(ee_instance_t* inst, uint16_t key);
+static uint16_t EE_ChunkedLen(uint32_t span, uint32_t trailer);
+static uint8_t EE_CheckChain(ee_instance_t* inst, uint32_t data_start,
+                             uint32_t end);
+static uint32_t EE_FindChainEnd(ee_instance_t* inst, uint32_t data_start,
+                                uint32_t head, uint8_t strict);
+static uint32_t EE_FindPageHead(ee_instance_t* inst, uint16_t page);
+static uint32_t EE_GetWriteHead(ee_instance_t* inst, uint16_t page);
+static void EE_UpdatePageStatus(ee_instance_t* inst, uint32_t addr,
+                                uint16_t flash_status, uint32_t seq,
+                                uint8_t retired);
+static uint8_t EE_IsBlank(uint32_t addr, uint32_t size);
+static uint16_t EE_CheckInstance(ee_instance_t* inst);
+static uint16_t EE_BuildDirectory(ee_instance_t* inst);
+static uint16_t EE_ReadAllItems(ee_instance_t* inst,
+                                const ee_batch_item_t* items, uint16_t count,
+                                uint16_t* br, uint8_t* missing);
+static uint16_t EE_ReadItems(ee_instance_t* inst, const ee_batch_item_t* items,
+                             uint16_t count, uint16_t* br, uint8_t* missing);
+static uint16_t EE_ReadSlot(ee_instance_t* inst, uint16_t slot, void* data,
+                            uint16_t size, uint16_t* br);
+static void EE_ReadData(ee_instance_t* inst, uint16_t slot, uint16_t pos,
+                        void* data, uint16_t size);
+static void EE_ReadChunks(ee_instance_t* inst, uint32_t addr, uint16_t pos,
+                          void* data, uint16_t size);
+static uint16_t EE_RefSlot(ee_instance_t* inst, uint16_t slot, const void** ptr,
+                           uint16_t* len, uint32_t* gen);
+static uint16_t EE_WriteLocked(ee_instance_t* inst, uint16_t virt_addr,
+                               void* data, uint16_t size);
+#if EE_WRITE_BACK
+static uint16_t EE_FlushLocked(ee_instance_t* inst);
+#endif
+#if EE_ASYNC_QUEUE
+static uint16_t EE_WriteAsyncLocked(ee_instance_t* inst, uint16_t virt_addr,
+                                    const void* data, uint16_t size,
+                                    ee_async_t* req);
+static uint16_t EE_AsyncServiceLocked(ee_instance_t* inst);
+#endif
+static uint16_t EE_FreeSpaceLocked(ee_instance_t* inst);
+static uint16_t EE_ReserveSpace(ee_instance_t* inst, uint32_t total,
+                                uint32_t* write_addr);
+static uint16_t EE_WriteLarge(ee_instance_t* inst, uint16_t slot,
+                              const void* data);
+static uint16_t EE_StreamChunk(ee_stream_t* stream, uint16_t len);
+static uint16_t EE_AppendChunk(ee_instance_t* inst, uint16_t slot,
+                               uint32_t write_addr, const void* data,
+                               uint16_t len);
+static uint16_t EE_CommitChunks(ee_instance_t* inst, uint16_t slot,
+                                uint32_t start, uint32_t write_addr);
+static uint16_t EE_WriteBatchLocked(ee_instance_t* inst,
+                                    const ee_batch_item_t* items,
+                                    uint16_t count);
+static uint16_t EE_MaintenanceLocked(ee_instance_t* inst, uint16_t budget);
+static uint16_t EE_FlashWrite(ee_instance_t* inst, uint32_t addr, void* data,
+                              uint16_t size);
+static uint16_t EE_FlashRead(ee_instance_t* inst, uint32_t addr, void* data,
+                             uint16_t size);
+static uint16_t EE_FlashErase(ee_instance_t* inst, uint32_t addr);
+static uint16_t EE_WriteTrailer(ee_instance_t* inst, uint32_t write_addr,
+                                uint32_t trailer);
+#if EE_STATS
+static void EE_StatsLatency(ee_latency_t* lat, uint32_t cycles);
+#if EE_CONCURRENT
+static void EE_StatsAdd(uint32_t* field, uint32_t n);
+#endif
+#endif
+
+/*!
+  读出各页页头后：
+  - 没有已启用的页：若有旧版格式中已完成传输的接收页则将其启用，否则格式化
+  - 按序号从旧到新扫描已启用的页建立 RAM 索引，新页中的记录覆盖旧页
+  - 写入页尾部有掉电留下的不完整记录：在其后写一个填充字跳过
+  - 没有空闲页说明回收尚未完成（可能被掉电中断），复制过的记录已在写入页中，
+    从头检查最旧页把回收做完，避免多次掉电留下的不完整记录占满保留空间
+  未提交的批量记录在建立索引时忽略
+
+    \brief      初始化一个实例
+    \param[in]  inst: 实例
     \param[out] none
     \retval     状态
       \arg        FLASH_COMPLETE: 成功
+      \arg        INSTANCE_INVALID: 实例配置无效
       \arg        其他: 失败
 */
-uint16_t EE_Init(void) {
-  uint64_t page0_status = 0;
-  uint64_t page1_status = 0;
+uint16_t EE_InstInit(ee_instance_t* inst) {
   uint32_t flash_status = 0;
-  uint16_t x;
-  uint16_t read_status = 0;
-  uint16_t eeprom_status;
-  uint16_t byte_read;
-  uint16_t var_idx;
+  uint32_t header[2], seq, torn;
+  uint16_t valid_page, page;
+  uint16_t budget = EE_RECLAIM_ALL;
 
-  BaseRead(PAGE0_BASE_ADDRESS, &page0_status, sizeof(page0_status));
-  BaseRead(PAGE1_BASE_ADDRESS, &page1_status, sizeof(page1_status));
+  flash_status = EE_CheckInstance(inst);
+  if (flash_status != FLASH_COMPLETE) {
+    return flash_status;
+  }
+  EE_ClearIndex(inst);
+  inst->write_addr = 0;
+  inst->reclaim_slot = 0;
+  memset(inst->reclaim_map, 0, sizeof(inst->reclaim_map));
+  inst->reclaim_seq = EE_SEQ_ERASED;
+#if EE_STATS
+  inst->stats_copies = 0;
+#endif
+#if EE_WRITE_BACK
+  /* 重新初始化相当于复位，缓存中未写入的值丢弃 */
+  memset(inst->cache, 0, sizeof(inst->cache));
+  inst->cache_bypass = 0;
+#endif
+#if EE_ASYNC_QUEUE
+  /* 未完成的异步写入同样丢弃，其 status 保持 EE_ASYNC_PENDING */
+  inst->async_head = inst->async_tail;
+  inst->async_size = 0;
+  inst->async_busy = 0;
+#endif
 
-  if (page0_status == ERASED) {
-    if (page1_status == VALID_PAGE) {
-      /* 将PAGE1作为有效页使用，擦除PAGE0 */
-      flash_status = BaseErase(PAGE0_BASE_ADDRESS);
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
-    } else if (page1_status == RECEIVE_DATA) {
-      /* 擦除PAGE0，将PAGE1标记为VALID_PAGE */
-      flash_status = BaseErase(PAGE0_BASE_ADDRESS);
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
+  for (page = 0; page < inst->page_count; page++) {
+    EE_FlashRead(inst, EE_INST_PAGE(inst, page), &header[0], sizeof(header[0]));
+    EE_FlashRead(inst, EE_INST_PAGE(inst, page) + EE_PROGRAM_WIDTH, &header[1],
+                 sizeof(header[1]));
+    inst->page_seq[page] = header[0];
+    inst->page_retired[page] = header[1] == EE_PAGE_RETIRED;
+  }
 
-      flash_status = EE_Mark(PAGE1_BASE_ADDRESS, VALID_PAGE);
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
+  if (EE_FindValidPage(inst) == NO_VALID_PAGE) {
+    for (page = 0; page < inst->page_count; page++) {
+      EE_FlashRead(inst, EE_INST_PAGE(inst, page) + EE_PROGRAM_WIDTH,
+                   &header[1], sizeof(header[1]));
+      if (header[1] == EE_LEGACY_RECEIVE) {
+        break;
       }
+    }
+    if (page < inst->page_count) {
+      /* 旧版两页格式：页传输已完成、源页已擦除，将接收页标记为有效 */
+      seq = 0;
+      flash_status = EE_FlashWrite(inst, EE_INST_PAGE(inst, page), &seq,
+                                   sizeof(seq));
+      EE_UpdatePageStatus(inst, EE_INST_PAGE(inst, page), flash_status, seq, 0);
     } else {
-      /* 无效状态，擦除两个页并格式化PAGE0 */
-      flash_status = EE_Format();
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
+      /* 无效状态，擦除所有页并启用第 0 页 */
+      flash_status = EE_Format(inst);
     }
-  } else if (page0_status == RECEIVE_DATA) {
-    if (page1_status == VALID_PAGE) {
-      /* 将PAGE1作为有效页使用，将PAGE1变量传输至PAGE0，标记PAGE0为有效，擦除PAGE1
-       */
-      x = EE_FindFirstVirAddr(PAGE0);
-      for (var_idx = 0; var_idx < NumbOfVar; var_idx++) {
-        if (x == virt_addr_var_tab[var_idx]) {
-          continue;
-        }
-        read_status = EE_ReadVariable(virt_addr_var_tab[var_idx], &data_var,
-                                      VARIABLE_MAX_SIZE, &byte_read);
-        if (read_status != 0x1) {
-          eeprom_status = EE_VerifyPageFullWriteVariable(
-              virt_addr_var_tab[var_idx], data_var, byte_read);
-          if (eeprom_status != FLASH_COMPLETE) {
-            return eeprom_status;
-          }
-        }
-      }
-      flash_status = EE_Mark(PAGE0_BASE_ADDRESS, VALID_PAGE);
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
+    if (flash_status != FLASH_COMPLETE) {
+      return flash_status;
+    }
+  }
 
-      flash_status = BaseErase(PAGE1_BASE_ADDRESS);
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
-    } else if (page1_status == ERASED) {
-      /* 擦除PAGE1，将PAGE0标记为VALID_PAGE */
-      flash_status = BaseErase(PAGE1_BASE_ADDRESS);
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
+  /* 由各页重建 RAM 索引 */
+  torn = EE_IndexPages(inst);
 
-      flash_status = EE_Mark(PAGE0_BASE_ADDRESS, VALID_PAGE);
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
-    } else {
-      /* 无效状态，擦除两个页并格式化PAGE0 */
-      flash_status = EE_Format();
+  /* 定位写指针 */
+  inst->write_addr = 0;
+  valid_page = EE_FindValidPage(inst);
+  if (valid_page != NO_VALID_PAGE) {
+    EE_GetWriteHead(inst, valid_page);
+    if (torn != 0) {
+      /* 写入时掉电，写入页尾残留不完整的记录 */
+      flash_status = EE_PadTail(inst, valid_page, torn);
       if (flash_status != FLASH_COMPLETE) {
         return flash_status;
       }
     }
   }
 
-  else if (page0_status == VALID_PAGE) {
-    if (page1_status == VALID_PAGE) {
-      /* 无效状态，擦除两个页并格式化PAGE0 */
-      flash_status = EE_Format();
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
-    } else if (page1_status == ERASED) {
-      /* 将PAGE0作为有效页使用，擦除PAGE1 */
-      flash_status = BaseErase(PAGE1_BASE_ADDRESS);
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
-    } else {
-      /* 将PAGE0作为有效页使用，将PAGE0变量传输至PAGE1，标记PAGE1为有效，擦除PAGE0
-       */
-      x = EE_FindFirstVirAddr(PAGE1);
-      for (var_idx = 0; var_idx < NumbOfVar; var_idx++) {
-        if (x == virt_addr_var_tab[var_idx]) {
-          continue;
-        }
-        read_status = EE_ReadVariable(virt_addr_var_tab[var_idx], &data_var,
-                                      VARIABLE_MAX_SIZE, &byte_read);
-        if (read_status != 0x1) {
-          eeprom_status = EE_VerifyPageFullWriteVariable(
-              virt_addr_var_tab[var_idx], data_var, byte_read);
-          if (eeprom_status != FLASH_COMPLETE) {
-            return eeprom_status;
-          }
-        }
-      }
-      flash_status = EE_Mark(PAGE1_BASE_ADDRESS, VALID_PAGE);
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
-      flash_status = BaseErase(PAGE0_BASE_ADDRESS);
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
-    }
-  } else {
-    /* 无效状态，擦除两个页并格式化PAGE0 */
-    flash_status = EE_Format();
-    if (flash_status != FLASH_COMPLETE) {
-      return flash_status;
-    }
+  flash_status = EE_ReclaimPages(inst, &budget, !EE_ERASE_AHEAD);
+  if (flash_status != FLASH_COMPLETE) {
+    return flash_status;
   }
 
   return 0;
@@ -192,67 +421,303 @@ uint16_t EE_Init(void) {
 
 /*!
     \brief      读取存储的变量
+    \param[in]  inst: 实例
     \param[in]  virt_addr: 虚拟地址
     \param[in]  size: 要读取的大小
     \param[out] data: 接收读出数据的缓冲区
     \param[out] br: 实际读取到的字节数，NULL 时不使用
     \retval       读取状态
       \arg        0: 成功查找到要读取的变量
-      \arg        1: 未查找到要读取的变量
+      \arg        1: 未查找到要读取的变量（声明了默认值的定长变量填入默认值，
+                  否则不改动 data，br 为 0）
       \arg        NO_VALID_PAGE: 未查找到valid页
 */
-uint16_t EE_ReadVariable(uint16_t virt_addr, void* data, uint16_t size,
-                         uint16_t* br) {
-  uint16_t valid_page;
-  uint16_t read_status = 1;
-  uint32_t read_addr, page_start_addr;
-  uint16_t addr_value; /* 16byte，FLASH 中存储的虚拟地址值 */
-  uint16_t store_len;  /* 16byte，FLASH 中存储的虚拟地址对应长度 */
-  uint16_t store_word_len;
+uint16_t EE_InstRead(ee_instance_t* inst, uint16_t virt_addr, void* data,
+                     uint16_t size, uint16_t* br) {
+  ee_batch_item_t item;
 
-  valid_page = EE_FindValidPage(READ_FROM_VALID_PAGE);
-  if (valid_page == NO_VALID_PAGE) {
-    return NO_VALID_PAGE;
-  }
+  item.virt_addr = virt_addr;
+  item.size = size;
+  item.data = data;
+  return EE_InstReadAll(inst, &item, 1, br, (uint8_t*)0);
+}
 
-  page_start_addr =
-      (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(valid_page * PAGE_SIZE));
+/*!
+    \brief      一次读取多个变量：只查找一次写入页，各项通过 RAM 索引定位；
+                EE_CONCURRENT 时所有项读自同一时刻的索引（不会读到一次批量写入的一半）
+    \param[in]  inst: 实例
+    \param[in]  items: 要读取的变量，size 为 data 缓冲区的大小
+    \param[in]  count: 项数
+    \param[out] br: 各项实际读取到的字节数（count 项），NULL 时不使用
+    \param[out] missing: 未查找到的项的位图（(count + 7) / 8 字节），第 i 项对应
+                missing[i / 8] 的第 i % 8 位，NULL 时不使用
+    \retval       读取状态
+      \arg        0: 所有项都查找到
+      \arg        1: 有未查找到的项（声明了默认值的定长变量填入默认值，其余不改动）
+      \arg        NO_VALID_PAGE: 未查找到valid页
+*/
+uint16_t EE_InstReadAll(ee_instance_t* inst, const ee_batch_item_t* items,
+                        uint16_t count, uint16_t* br, uint8_t* missing) {
+  EE_STAT_START(start);
+  uint16_t status = EE_ReadAllItems(inst, items, count, br, missing);
 
-  read_addr = (uint32_t)((EEPROM_START_ADDRESS - 4) +
-                         (uint32_t)((1 + valid_page) * PAGE_SIZE));
+  EE_STAT_TIME(inst, read, start);
+  EE_STAT_ADD(inst, reads, 1);
+  return status;
+}
 
-  /* 从后往前查找 */
-  while (read_addr > (page_start_addr + 8)) {
-    addr_value = *(__IO uint16_t*)(read_addr + 2);
-    store_len = *(__IO uint16_t*)read_addr;
-    if (store_len != 0xFFFF) {
-      store_word_len = store_len / 4;
-      if (store_len % 4 != 0) {
-        store_word_len += 1;
-      }
+/*!
+    \brief      同 EE_InstReadAll，不计入统计
+*/
+static uint16_t EE_ReadAllItems(ee_instance_t* inst,
+                                const ee_batch_item_t* items, uint16_t count,
+                                uint16_t* br, uint8_t* missing) {
+#if EE_CONCURRENT
+  /* 不加锁读取：读取前后版本号相同且为偶数，说明期间索引和页状态没有改变，
+     读到的记录也没有被回收擦除 */
+  uint32_t seq;
+  uint16_t status, retry;
+
+  for (retry = 0; retry < EE_READ_RETRIES; retry++) {
+    seq = inst->seq;
+    EE_PORT_BARRIER();
+    if (seq & 1) {
+      continue;
+    }
+    status = EE_ReadItems(inst, items, count, br, missing);
+    EE_PORT_BARRIER();
+    if (inst->seq == seq) {
+      return status;
+    }
+  }
+  /* 写入方一直在修改（或持锁时被读取方抢占），加锁读取 */
+  EE_LOCK();
+  status = EE_ReadItems(inst, items, count, br, missing);
+  EE_UNLOCK();
+  return status;
+#else
+  return EE_ReadItems(inst, items, count, br, missing);
+#endif
+}
+
+/*!
+    \brief      检查有写入页后逐项读取
+    \param[in]  items: 要读取的变量
+    \param[in]  count: 项数
+    \param[out] br: 各项实际读取到的字节数，NULL 时不使用
+    \param[out] missing: 未查找到的项的位图，NULL 时不使用
+    \retval     同 EE_InstReadAll
+*/
+static uint16_t EE_ReadItems(ee_instance_t* inst, const ee_batch_item_t* items,
+                             uint16_t count, uint16_t* br, uint8_t* missing) {
+  uint16_t i, slot, status = 0;
+
+  /* 在版本号检查的范围内：换页和擦除期间页状态可能暂时没有写入页 */
+  if (EE_FindValidPage(inst) == NO_VALID_PAGE) {
+    return NO_VALID_PAGE;
+  }
+  if (missing != (void*)0) {
+    memset(missing, 0, (count + 7) / 8);
+  }
+  for (i = 0; i < count; i++) {
+    slot = EE_FindSlot(inst, items[i].virt_addr);
+    if (slot < inst->var_count &&
+        EE_ReadSlot(inst, slot, items[i].data, items[i].size,
+                    br != (void*)0 ? &br[i] : (uint16_t*)0) == 0) {
+      continue;
+    }
+    if (slot >= inst->var_count && br != (void*)0) {
+      br[i] = 0;
     }
+    if (missing != (void*)0) {
+      missing[i / 8] |= (uint8_t)(1 << (i % 8));
+    }
+    status = 1;
+  }
+  return status;
+}
 
-    if (addr_value == virt_addr) {
-      size = size > store_len ? store_len : size;
+/*!
+    \brief      读取变量的当前值：写回缓存、异步队列中尚未写完的值、Flash 中的记录，
+                都没有时为声明的默认值
+    \param[in]  slot: 变量下标
+    \param[in]  size: 要读取的大小
+    \param[out] data: 接收读出数据的缓冲区
+    \param[out] br: 实际读取到的字节数，NULL 时不使用
+    \retval     同 EE_InstRead
+*/
+static uint16_t EE_ReadSlot(ee_instance_t* inst, uint16_t slot, void* data,
+                            uint16_t size, uint16_t* br) {
+#if EE_WRITE_BACK
+  /* 写回缓存中的值比 Flash 中的新 */
+  ee_cache_t* entry = EE_CacheFind(inst, slot);
+  if (entry != (void*)0) {
+    size = size > entry->len ? entry->len : size;
+    if (br != (void*)0) {
+      *br = size;
+    }
+    memcpy(data, entry->data, size);
+    return 0;
+  }
+#endif
+#if EE_ASYNC_QUEUE
+  /* 尚未写完的异步写入 */
+  uint16_t pending_len;
+  const uint8_t* pending = EE_AsyncFind(inst, slot, &pending_len);
+  if (pending != (void*)0) {
+    size = size > pending_len ? pending_len : size;
+    if (br != (void*)0) {
+      *br = size;
+    }
+    memcpy(data, pending, size);
+    return 0;
+  }
+#endif
+  if (inst->index[slot].offset == 0) {
+    /* 没有声明默认值时不改动缓冲区，调用者可以预先填入自己的默认值 */
+    if (inst->var_size[slot] == 0 || inst->var_default[slot] == 0) {
       if (br != (void*)0) {
-        *br = size;
+        *br = 0;
       }
-      BaseRead(read_addr - (4 * store_word_len), data, size);
-      read_status = 0;
-      break;
-    } else if (addr_value != 0xFFFF && store_len != 0xFFFF) {
-      read_addr -= (4 * store_word_len + 4);
-    } else {
-      read_addr -= 4;
+      return 1;
+    }
+    size = size > inst->var_size[slot] ? inst->var_size[slot] : size;
+    if (br != (void*)0) {
+      *br = size;
     }
+    memset(data, 0, size);
+    memcpy(data, &inst->var_default[slot], size < 4 ? size : 4);
+    return 1;
   }
 
-  /* Return read_status value: (0: variable exist, 1: variable doesn't exist) */
-  return read_status;
+  size = size > inst->index[slot].len ? inst->index[slot].len : size;
+  if (br != (void*)0) {
+    *br = size;
+  }
+  EE_ReadData(inst, slot, 0, data, size);
+  if (inst->index[slot].delta != 0) {
+    EE_ApplyDelta(inst, slot, (uint8_t*)data, size);
+  }
+  return 0;
+}
+
+/*!
+    \brief      不复制，返回变量最新记录在 Flash 中的数据地址
+                指针在所在页被擦除前有效：回收把记录搬到新页后，旧页要等到擦除时
+                才失效。使用期间可能发生擦除时（EE_Maintenance、写入触发的回收、
+                其他任务写入），用完后以 EE_InstRefValid(inst, *gen) 检查，
+                返回 0 则数据可能已被擦除，需重新获取
+    \param[in]  inst: 实例
+    \param[in]  virt_addr: 虚拟地址
+    \param[out] ptr: 数据地址，失败时为 NULL
+    \param[out] len: 数据字节数
+    \param[out] gen: 获取指针时的擦除代数，NULL 时不使用
+    \retval     读取状态
+      \arg        0: 成功
+      \arg        1: 未查找到要读取的变量（默认值需用 EE_InstRead 读取）
+      \arg        REF_UNAVAILABLE: 当前值为差分记录、大变量或尚在写回缓存、异步队列中，
+                  需用 EE_InstRead 读取
+      \arg        NO_VALID_PAGE: 未查找到valid页
+      \arg        POINT_INVALID: ptr 或 len 为 NULL
+*/
+uint16_t EE_InstReadRef(ee_instance_t* inst, uint16_t virt_addr,
+                        const void** ptr, uint16_t* len, uint32_t* gen) {
+  uint16_t slot;
+
+  if (ptr == (void*)0 || len == (void*)0) {
+    return POINT_INVALID;
+  }
+  *ptr = (void*)0;
+  *len = 0;
+  slot = EE_FindSlot(inst, virt_addr);
+  if (slot >= inst->var_count) {
+    return 1;
+  }
+#if EE_CONCURRENT
+  /* 同 EE_InstRead：索引在取地址期间被修改则重取 */
+  uint32_t seq;
+  uint16_t status, retry;
+
+  for (retry = 0; retry < EE_READ_RETRIES; retry++) {
+    seq = inst->seq;
+    EE_PORT_BARRIER();
+    if (seq & 1) {
+      continue;
+    }
+    status = EE_RefSlot(inst, slot, ptr, len, gen);
+    EE_PORT_BARRIER();
+    if (inst->seq == seq) {
+      return status;
+    }
+  }
+  EE_LOCK();
+  status = EE_RefSlot(inst, slot, ptr, len, gen);
+  EE_UNLOCK();
+  return status;
+#else
+  return EE_RefSlot(inst, slot, ptr, len, gen);
+#endif
+}
+
+/*!
+    \brief      检查 EE_InstReadRef 返回的指针是否仍然有效
+    \param[in]  inst: 实例
+    \param[in]  gen: EE_InstReadRef 返回的擦除代数
+    \param[out] none
+    \retval     1: 之后没有擦除过任何页，0: 指针可能已失效
+*/
+uint8_t EE_InstRefValid(ee_instance_t* inst, uint32_t gen) {
+  /* 读取数据之后再比较代数 */
+  EE_PORT_BARRIER();
+  return inst->generation == gen;
+}
+
+/*!
+    \brief      取变量最新记录的数据地址，见 EE_InstReadRef
+    \param[in]  slot: 变量下标
+    \param[out] ptr: 数据地址
+    \param[out] len: 数据字节数
+    \param[out] gen: 擦除代数，NULL 时不使用
+    \retval     同 EE_InstReadRef
+*/
+static uint16_t EE_RefSlot(ee_instance_t* inst, uint16_t slot, const void** ptr,
+                           uint16_t* len, uint32_t* gen) {
+  *ptr = (void*)0;
+  *len = 0;
+  /* 同 EE_ReadItems，在版本号检查的范围内查找写入页 */
+  if (EE_FindValidPage(inst) == NO_VALID_PAGE) {
+    return NO_VALID_PAGE;
+  }
+#if EE_WRITE_BACK
+  if (EE_CacheFind(inst, slot) != (void*)0) {
+    return REF_UNAVAILABLE;
+  }
+#endif
+#if EE_ASYNC_QUEUE
+  uint16_t pending_len;
+  if (EE_AsyncFind(inst, slot, &pending_len) != (void*)0) {
+    return REF_UNAVAILABLE;
+  }
+#endif
+  if (inst->index[slot].offset == 0) {
+    return 1;
+  }
+  /* 差分记录要在基准上套用后才是当前值，大变量的各块之间隔着尾字 */
+  if (inst->index[slot].delta != 0 || EE_LARGE(inst, slot)) {
+    return REF_UNAVAILABLE;
+  }
+  if (gen != (void*)0) {
+    *gen = inst->generation;
+  }
+  *ptr = EE_PortMap(EE_SlotDataAddr(inst, slot));
+  *len = inst->index[slot].len;
+  return 0;
 }
 
 /*!
-    \brief      写入变量
+    \brief      写入变量，EE_WRITE_BACK 时只写入缓存；大变量不经过缓存，
+                直接由 data 逐块写入整个值
+    \param[in]  inst: 实例
     \param[in]  virt_addr: 虚拟地址
     \param[in]  data: 要存储的数据缓冲区地址
     \param[in]  size: 要存储的数据大小
@@ -261,318 +726,2726 @@ uint16_t EE_ReadVariable(uint16_t virt_addr, void* data, uint16_t size,
       \arg        FLASH_COMPLETE: 成功写入
       \arg        PAGE_FULL: 页满
       \arg        NO_VALID_PAGE: 未查找到可用页
-      \arg        VAR_SIZE_OVERFLOW: 长度超过设定
+      \arg        VAR_SIZE_OVERFLOW: 长度超过设定，或与定长变量的长度不符
+      \arg        ADDR_INVALID: 虚拟地址不在变量表中
       \arg        Flash error code: on write Flash error
 */
-uint16_t EE_WriteVaribal(uint16_t virt_addr, void* data, uint16_t size) {
-  if (size > VARIABLE_MAX_SIZE) {
+uint16_t EE_InstWrite(ee_instance_t* inst, uint16_t virt_addr, void* data,
+                      uint16_t size) {
+  uint16_t status;
+
+  EE_LOCK();
+  EE_STAT_START(start);
+  status = EE_WriteLocked(inst, virt_addr, data, size);
+  EE_STAT_TIME(inst, write, start);
+  EE_STAT_ADD(inst, writes, 1);
+  EE_UNLOCK();
+  return status;
+}
+
+/*!
+    \brief      同 EE_InstWrite，调用者已持有写锁
+*/
+static uint16_t EE_WriteLocked(ee_instance_t* inst, uint16_t virt_addr,
+                               void* data, uint16_t size) {
+  uint16_t slot;
+  uint16_t status = EE_CheckWrite(inst, virt_addr, size, &slot);
+  if (status != FLASH_COMPLETE) {
+    return status;
+  }
+#if EE_WRITE_BACK
+  if (!inst->cache_bypass && !EE_LARGE(inst, slot)) {
+    return EE_CacheWrite(inst, slot, data, size);
+  }
+#endif
+  return EE_WriteSlot(inst, slot, data, size);
+}
+
+/*!
+    \brief      检查写入参数
+    \param[in]  virt_addr: 虚拟地址
+    \param[in]  size: 字节数
+    \param[out] slot: 变量下标
+    \retval     FLASH_COMPLETE、VAR_SIZE_OVERFLOW 或 ADDR_INVALID
+*/
+static uint16_t EE_CheckWrite(ee_instance_t* inst, uint16_t virt_addr,
+                              uint16_t size, uint16_t* slot) {
+  if (size > EE_LARGE_MAX_SIZE) {
     return VAR_SIZE_OVERFLOW;
   }
-  uint16_t status = EE_VerifyPageFullWriteVariable(virt_addr, data, size);
-  if (status == PAGE_FULL) {
-    status = EE_PageTransfer(virt_addr, data, size);
+  *slot = EE_FindSlot(inst, virt_addr);
+  if (*slot >= inst->var_count) {
+    return ADDR_INVALID;
   }
-  return status;
+  /* 超过 VARIABLE_MAX_SIZE 的只能是大变量（定长） */
+  if (inst->var_size[*slot] != 0 ? size != inst->var_size[*slot]
+                                 : size > VARIABLE_MAX_SIZE) {
+    return VAR_SIZE_OVERFLOW;
+  }
+  return FLASH_COMPLETE;
 }
 
 /*!
-    \brief      擦除 PAGE0 和 PAGE1，写 VALID_PAGE 至 PAGE0
-    \param[in]  none
+    \brief      把变量写入 Flash，参数已检查
+    \param[in]  slot: 变量下标
+    \param[in]  data: 数据
+    \param[in]  size: 字节数
     \param[out] none
-    \retval     Flash 操作状态
-      \arg        FLASH_COMPLETE: 成功
-      \arg        其他: 错误码
+    \retval     同 EE_WriteVaribal
 */
-static uint16_t EE_Format(void) {
-  uint16_t flash_status = BaseErase(PAGE0_BASE_ADDRESS);
-  if (flash_status != FLASH_COMPLETE) {
-    return flash_status;
+static uint16_t EE_WriteSlot(ee_instance_t* inst, uint16_t slot, void* data,
+                             uint16_t size) {
+#if EE_ASYNC_QUEUE
+  /* 先完成已提交的异步写入，保持写入顺序 */
+  EE_AsyncDrain(inst);
+#endif
+#if EE_SKIP_UNCHANGED
+  if (EE_SkipUnchanged(inst, slot, data, size)) {
+    return FLASH_COMPLETE;
   }
-
-  flash_status = EE_Mark(PAGE0_BASE_ADDRESS, VALID_PAGE);
-  if (flash_status != FLASH_COMPLETE) {
-    return flash_status;
+#endif
+  if (EE_LARGE(inst, slot)) {
+    return EE_WriteLarge(inst, slot, data);
   }
+  return EE_WriteRecord(inst, slot, data, size);
+}
 
-  flash_status = BaseErase(PAGE1_BASE_ADDRESS);
-  if (flash_status != FLASH_COMPLETE) {
-    return flash_status;
+/*!
+    \brief      追加一条记录，写入页已满时补做回收或换页
+    \param[in]  slot: 变量下标
+    \param[in]  data: 数据
+    \param[in]  size: 字节数
+    \param[out] none
+    \retval     同 EE_WriteVaribal
+*/
+static uint16_t EE_WriteRecord(ee_instance_t* inst, uint16_t slot, void* data,
+                               uint16_t size) {
+  uint16_t virt_addr = EE_KEY(inst, slot);
+  uint16_t status = EE_VerifyPageFullWriteVariable(inst, virt_addr, data, size);
+  if (status == PAGE_FULL) {
+    /* EE_Maintenance 没来得及完成回收时在这里补做，之后再换页 */
+    uint16_t budget = EE_RECLAIM_ALL;
+    status = EE_ReclaimPages(inst, &budget, !EE_ERASE_AHEAD);
+    if (status == FLASH_COMPLETE) {
+      status = EE_VerifyPageFullWriteVariable(inst, virt_addr, data, size);
+    }
   }
-
-  return FLASH_COMPLETE;
+  if (status == PAGE_FULL) {
+    status = EE_PageTransfer(inst, virt_addr, data, size);
+  }
+  return status;
 }
 
+#if EE_WRITE_BACK
 /*!
-    \brief      为写或读操作查找 VALID_PAGE
-    \param[in]  Operation: 操作
-      \arg        READ_FROM_VALID_PAGE: 从 VALIDE_PAGE 读
-      \arg        WRITE_IN_VALID_PAGE: 从 VALIDE_PAGE 写
+    \brief      查找变量在写回缓存中的项
+    \param[in]  slot: 变量下标
     \param[out] none
-    \retval     页编码
-      \arg        PAGE0
-      \arg        PAGE1
-      \arg        NO_VALID_PAGE
+    \retval     缓存项，NULL 表示不在缓存中
 */
-static uint16_t EE_FindValidPage(uint8_t Operation) {
-  uint64_t page0_status = 0;
-  uint64_t page1_status = 0;
+static ee_cache_t* EE_CacheFind(ee_instance_t* inst, uint16_t slot) {
+  uint16_t i;
+  for (i = 0; i < EE_WRITE_BACK; i++) {
+    if (inst->cache[i].used && inst->cache[i].slot == slot) {
+      return &inst->cache[i];
+    }
+  }
+  return (void*)0;
+}
 
-  BaseRead(PAGE0_BASE_ADDRESS, &page0_status, sizeof(page0_status));
-  BaseRead(PAGE1_BASE_ADDRESS, &page1_status, sizeof(page1_status));
+/*!
+    \brief      把变量写入缓存：已在缓存中则覆盖，否则占用空闲项，
+                没有空闲项时先把最早写入的一项写入 Flash
+    \param[in]  slot: 变量下标
+    \param[in]  data: 数据
+    \param[in]  size: 字节数
+    \param[out] none
+    \retval     FLASH_COMPLETE 或写出旧项时的错误码
+*/
+static uint16_t EE_CacheWrite(ee_instance_t* inst, uint16_t slot,
+                              const void* data, uint16_t size) {
+  ee_cache_t* entry = EE_CacheFind(inst, slot);
+  uint32_t now = EE_PortCycles();
+  uint16_t i, status;
 
-  switch (Operation) {
-    case WRITE_IN_VALID_PAGE:
-      if (page1_status == VALID_PAGE) {
-        if (page0_status == RECEIVE_DATA) {
-          return PAGE0;
-        } else {
-          return PAGE1;
-        }
-      } else if (page0_status == VALID_PAGE) {
-        if (page1_status == RECEIVE_DATA) {
-          return PAGE1;
-        } else {
-          return PAGE0;
-        }
-      } else {
-        return NO_VALID_PAGE;
+  if (entry == (void*)0) {
+    for (i = 0; i < EE_WRITE_BACK; i++) {
+      if (!inst->cache[i].used) {
+        entry = &inst->cache[i];
+        break;
       }
-      break;
-    case READ_FROM_VALID_PAGE:
-      if (page0_status == VALID_PAGE) {
-        return PAGE0;
-      } else if (page1_status == VALID_PAGE) {
-        return PAGE1;
-      } else {
-        return NO_VALID_PAGE;
+      if (entry == (void*)0 || (uint32_t)(now - inst->cache[i].since) >
+                                   (uint32_t)(now - entry->since)) {
+        entry = &inst->cache[i];
       }
-      break;
-
-    default:
-      return PAGE0;
+    }
+    if (entry->used) {
+      status = EE_CacheFlushEntry(inst, entry);
+      if (status != FLASH_COMPLETE) {
+        return status;
+      }
+    }
+  }
+  EE_SEQ_BEGIN(inst);
+  if (!entry->used) {
+    entry->used = 1;
+    entry->slot = slot;
+    entry->since = now;
   }
+  entry->len = (uint8_t)size;
+  memcpy(entry->data, data, size);
+  EE_SEQ_END(inst);
+  return FLASH_COMPLETE;
 }
 
 /*!
-   \brief      检查 VALID_PAGE 是否满，在 EEPROM 写入变量
-   \param[in]  virt_addr: 16 bit virtual address of the variable
-   \param[in]  size:
-   \param[in]  data:
-   \param[out] none
-   \retval     成功或错误状态:
-     \arg        FLASH_COMPLETE: 成功
-     \arg        PAGE_FULL: VALID_PAGE 满
-     \arg        NO_VALID_PAGE: 没有 VALID_PAGE
-     \arg        Flash error code: 写 Flash 错误码
+    \brief      把一项缓存写入 Flash，成功后释放该项
+    \param[in]  entry: 缓存项
+    \param[out] none
+    \retval     同 EE_WriteVaribal，失败时该项保留
 */
-static uint16_t EE_VerifyPageFullWriteVariable(uint16_t virt_addr, void* data,
-                                               uint16_t size) {
-  if (size == 0) {
-    return FLASH_COMPLETE;
+static uint16_t EE_CacheFlushEntry(ee_instance_t* inst, ee_cache_t* entry) {
+  uint16_t status = EE_WriteSlot(inst, entry->slot, entry->data, entry->len);
+  if (status == FLASH_COMPLETE) {
+    entry->used = 0;
   }
-  uint16_t flash_status = FLASH_COMPLETE;
-  uint16_t valid_page = PAGE0;
-  uint32_t write_addr, page_start_addr, page_end_addr;
-  uint32_t word_size = 0;
+  return status;
+}
 
-  valid_page = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+/*!
+    \brief      把缓存中超过 EE_FLUSH_TIMEOUT_MS 的项写入 Flash
+    \param[in]  budget: 最多写入的项数
+    \param[out] budget: 剩余步数
+    \retval     FLASH_COMPLETE、MAINTENANCE_PENDING 或写 Flash 的错误码
+*/
+static uint16_t EE_CacheFlushExpired(ee_instance_t* inst, uint16_t* budget) {
+  uint32_t now = EE_PortCycles();
+  uint16_t i, status;
 
-  if (valid_page == NO_VALID_PAGE) {
-    return NO_VALID_PAGE;
+  for (i = 0; i < EE_WRITE_BACK; i++) {
+    if (!inst->cache[i].used ||
+        (uint32_t)(now - inst->cache[i].since) <
+            (uint32_t)EE_FLUSH_TIMEOUT_MS * EE_CYCLES_PER_MS) {
+      continue;
+    }
+    if (*budget == 0) {
+      return MAINTENANCE_PENDING;
+    }
+    (*budget)--;
+    status = EE_CacheFlushEntry(inst, &inst->cache[i]);
+    if (status != FLASH_COMPLETE) {
+      return status;
+    }
   }
+  return FLASH_COMPLETE;
+}
 
-  page_start_addr =
-      (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(valid_page * PAGE_SIZE));
-  page_end_addr = (uint32_t)(EEPROM_START_ADDRESS +
-                             (uint32_t)((1 + valid_page) * PAGE_SIZE));
-  write_addr = (uint32_t)((EEPROM_START_ADDRESS - 4) +
-                          (uint32_t)((1 + valid_page) * PAGE_SIZE));
-
-  /* 从后往前查找第一个不是 0xFFFFFFFF 的地址，在其后写入 */
-  while (write_addr >= (page_start_addr + 4)) {
-    if (*(__IO uint32_t*)write_addr != 0xFFFFFFFF) {
-      write_addr += 4;
-      if (page_end_addr - write_addr >= (size + 4)) {
-        /* 写入变量 */
-        flash_status = BaseWrite(write_addr, data, size);
-        if (flash_status != FLASH_COMPLETE) {
-          return flash_status;
-        }
-        /* 写入虚拟地址和变量大小 */
-        uint32_t temp_data = (virt_addr << 16) + size;
-        word_size = size / 4;
-        if (size % 4 != 0) {
-          word_size += 1;
+/*!
+    \brief      把写回缓存中的所有值写入 Flash
+    \param[in]  inst: 实例
+    \param[out] none
+    \retval     同 EE_WriteVaribal，失败的项保留在缓存中
+*/
+uint16_t EE_InstFlush(ee_instance_t* inst) {
+  uint16_t status;
+
+  EE_LOCK();
+  status = EE_FlushLocked(inst);
+  EE_UNLOCK();
+  return status;
+}
+
+/*!
+    \brief      同 EE_InstFlush，调用者已持有写锁
+*/
+static uint16_t EE_FlushLocked(ee_instance_t* inst) {
+  uint16_t i, status;
+
+#if EE_ASYNC_QUEUE
+  EE_AsyncDrain(inst);
+#endif
+  for (i = 0; i < EE_WRITE_BACK; i++) {
+    if (inst->cache[i].used) {
+      status = EE_CacheFlushEntry(inst, &inst->cache[i]);
+      if (status != FLASH_COMPLETE) {
+        return status;
+      }
+    }
+  }
+  return FLASH_COMPLETE;
+}
+
+/*!
+    \brief      掉电预警（低电压检测）时调用：写出缓存，之后的写入直接写 Flash，
+                直到下次 EE_Init
+    \param[in]  inst: 实例
+    \param[out] none
+    \retval     同 EE_Flush
+*/
+uint16_t EE_InstPowerFail(ee_instance_t* inst) {
+  uint16_t status;
+
+  EE_LOCK();
+  inst->cache_bypass = 1;
+  status = EE_FlushLocked(inst);
+  EE_UNLOCK();
+  return status;
+}
+#endif
+
+#if EE_ASYNC_QUEUE
+/*!
+    \brief      提交一次异步写入：检查参数并复制数据后立即返回，
+                由 EE_AsyncService 按提交顺序写入
+    \param[in]  inst: 实例
+    \param[in]  virt_addr: 虚拟地址
+    \param[in]  data: 数据，返回后即可重用
+    \param[in]  size: 字节数
+    \param[in]  req: 调用者提供的控制块，done/ctx 已填好，完成前不能重用
+    \param[out] req->status: EE_ASYNC_PENDING，完成后为写入结果（同 EE_WriteVaribal）
+    \retval
+      \arg        EE_ASYNC_PENDING: 已提交
+      \arg        ASYNC_QUEUE_FULL: 队列已满，未提交
+      \arg        VAR_SIZE_OVERFLOW、ADDR_INVALID: 同 EE_WriteVaribal（大变量不能异步写入），
+                  未提交
+*/
+uint16_t EE_InstWriteAsync(ee_instance_t* inst, uint16_t virt_addr,
+                           const void* data, uint16_t size, ee_async_t* req) {
+  uint16_t status;
+
+  EE_LOCK();
+  status = EE_WriteAsyncLocked(inst, virt_addr, data, size, req);
+  EE_UNLOCK();
+  return status;
+}
+
+/*!
+    \brief      同 EE_InstWriteAsync，调用者已持有写锁
+*/
+static uint16_t EE_WriteAsyncLocked(ee_instance_t* inst, uint16_t virt_addr,
+                                    const void* data, uint16_t size,
+                                    ee_async_t* req) {
+  ee_async_entry_t* entry;
+  uint16_t slot;
+  uint16_t status = EE_CheckWrite(inst, virt_addr, size, &slot);
+
+  if (status != FLASH_COMPLETE) {
+    return status;
+  }
+  /* 队列中的记录映像只放得下一块 */
+  if (EE_LARGE(inst, slot)) {
+    return VAR_SIZE_OVERFLOW;
+  }
+  if ((uint16_t)(inst->async_tail - inst->async_head) == EE_ASYNC_QUEUE) {
+    return ASYNC_QUEUE_FULL;
+  }
+  EE_SEQ_BEGIN(inst);
+  entry = &inst->async_queue[inst->async_tail % EE_ASYNC_QUEUE];
+  entry->req = req;
+  entry->slot = slot;
+  entry->len = (uint8_t)size;
+  memcpy(entry->data, data, size);
+  req->status = EE_ASYNC_PENDING;
+#if EE_WRITE_BACK
+  /* 缓存中的旧值已被覆盖 */
+  ee_cache_t* cached = EE_CacheFind(inst, slot);
+  if (cached != (void*)0) {
+    cached->used = 0;
+  }
+#endif
+  inst->async_tail++;
+  EE_SEQ_END(inst);
+  return EE_ASYNC_PENDING;
+}
+
+/*!
+    \brief      推进异步写入：查询进行中的编程，结束后启动下一个编程单元，
+                一条记录的单元写完即更新索引、通知完成并接着写下一条。
+                只能在任务上下文中调用：EE_CONCURRENT 时要取写锁，队首记录放不下时
+                按同步方式写入，可能换页、回收和擦除。在专用任务中循环调用，
+                或由 Flash 编程结束中断通知该任务后调用；不定义 EE_CONCURRENT 时
+                须与其他写入接口在同一任务中调用
+    \param[in]  inst: 实例
+    \param[out] none
+    \retval     FLASH_COMPLETE: 队列已空 EE_ASYNC_PENDING: 编程进行中，稍后再调用
+*/
+uint16_t EE_InstAsyncService(ee_instance_t* inst) {
+  uint16_t status;
+
+  EE_LOCK();
+  status = EE_AsyncServiceLocked(inst);
+  EE_UNLOCK();
+  return status;
+}
+
+/*!
+    \brief      同 EE_InstAsyncService，调用者已持有写锁
+*/
+static uint16_t EE_AsyncServiceLocked(ee_instance_t* inst) {
+  ee_async_entry_t* entry;
+  uint32_t i, k, blank;
+  uint16_t status;
+
+  if (inst->async_busy) {
+    status = EE_PortProgramPoll();
+    if (status == EE_PORT_BUSY) {
+      return EE_ASYNC_PENDING;
+    }
+    inst->async_busy = 0;
+    if (status != FLASH_COMPLETE) {
+      inst->write_addr = 0;
+      EE_AsyncFinish(inst, status);
+    }
+  }
+  while (inst->async_head != inst->async_tail) {
+    entry = &inst->async_queue[inst->async_head % EE_ASYNC_QUEUE];
+    if (inst->async_size == 0) {
+      status = EE_AsyncPrepare(inst, entry);
+      if (status != EE_ASYNC_PENDING) {
+        EE_AsyncFinish(inst, status);
+        continue;
+      }
+    }
+    /* 与 EE_ProgramRecord 的顺序相同，全为 0xFF 的单元不写 */
+    while (inst->async_unit <= inst->async_size / EE_PROGRAM_WIDTH) {
+      i = inst->async_unit * EE_PROGRAM_WIDTH % inst->async_size;
+      inst->async_unit++;
+      blank = 0xFFFFFFFF;
+      for (k = 0; k < EE_PROGRAM_WIDTH / 4; k++) {
+        blank &= inst->async_image[i / 4 + k];
+      }
+      if (blank == 0xFFFFFFFF) {
+        continue;
+      }
+      status = EE_PortProgramStart(inst->async_addr + i,
+                                   &inst->async_image[i / 4]);
+      if (status == EE_PORT_BUSY) {
+        /* 另一个实例的编程尚未结束，下次再启动这一单元 */
+        inst->async_unit--;
+        return EE_ASYNC_PENDING;
+      }
+      if (status != FLASH_COMPLETE) {
+        inst->write_addr = 0;
+        EE_AsyncFinish(inst, status);
+        break;
+      }
+      inst->async_busy = 1;
+      EE_STAT_ADD(inst, programs, 1);
+      return EE_ASYNC_PENDING;
+    }
+    if (inst->async_size != 0) {
+      EE_IndexRecord(inst, entry->slot, inst->async_addr, inst->async_size,
+                     entry->len, inst->async_packed, inst->async_delta);
+      EE_AsyncFinish(inst, FLASH_COMPLETE);
+    }
+  }
+  return FLASH_COMPLETE;
+}
+
+/*!
+    \brief      为队首的写入生成记录映像。值未改变时直接完成；
+                写入页放不下时需要回收或换页，这一条按同步方式写入
+    \param[in]  entry: 队首
+    \param[out] none
+    \retval     EE_ASYNC_PENDING: 映像已生成，等待逐单元写入；其他为已完成的结果
+*/
+static uint16_t EE_AsyncPrepare(ee_instance_t* inst, ee_async_entry_t* entry) {
+  uint16_t valid_page;
+  uint32_t rec_size;
+
+#if EE_SKIP_UNCHANGED
+  if (EE_SkipUnchanged(inst, entry->slot, entry->data, entry->len)) {
+    return FLASH_COMPLETE;
+  }
+#endif
+  valid_page = EE_FindValidPage(inst);
+  if (valid_page == NO_VALID_PAGE) {
+    return NO_VALID_PAGE;
+  }
+  inst->async_addr = EE_GetWriteHead(inst, valid_page);
+  rec_size = EE_PrepareRecord(inst, entry->slot, entry->data, entry->len,
+                              inst->async_image, &inst->async_packed,
+                              &inst->async_delta);
+  if (EE_FreeSpaceLocked(inst) < rec_size) {
+    return EE_WriteRecord(inst, entry->slot, entry->data, entry->len);
+  }
+  inst->async_size = rec_size;
+  inst->async_unit = 1;
+  return EE_ASYNC_PENDING;
+}
+
+/*!
+    \brief      结束队首的写入：出队后写入结果并调用完成回调
+    \param[in]  status: 写入结果
+    \param[out] none
+    \retval     none
+*/
+static void EE_AsyncFinish(ee_instance_t* inst, uint16_t status) {
+  ee_async_t* req = inst->async_queue[inst->async_head % EE_ASYNC_QUEUE].req;
+
+  inst->async_size = 0;
+  /* 不加锁的读取方在 EE_AsyncFind 中遍历队列 */
+  EE_SEQ_BEGIN(inst);
+  inst->async_head++;
+  EE_SEQ_END(inst);
+  req->status = status;
+  if (req->done != (void*)0) {
+    req->done(req);
+  }
+}
+
+/*!
+    \brief      查找变量最后一次提交、尚未完成的异步写入
+    \param[in]  slot: 变量下标
+    \param[out] len: 数据字节数
+    \retval     数据，NULL 表示没有
+*/
+static const uint8_t* EE_AsyncFind(ee_instance_t* inst, uint16_t slot,
+                                   uint16_t* len) {
+  /* 队首和队尾只读一次，读取期间出入队由 inst->seq 发现 */
+  uint16_t head = inst->async_head;
+  uint16_t n = inst->async_tail;
+  ee_async_entry_t* entry;
+
+  for (; n != head && (uint16_t)(n - head) <= EE_ASYNC_QUEUE; n--) {
+    entry = &inst->async_queue[(uint16_t)(n - 1) % EE_ASYNC_QUEUE];
+    if (entry->slot == slot) {
+      *len = entry->len;
+      return entry->data;
+    }
+  }
+  return (void*)0;
+}
+
+/*!
+    \brief      在调用者的上下文中完成所有已提交的异步写入
+*/
+static void EE_AsyncDrain(ee_instance_t* inst) {
+  while (EE_AsyncServiceLocked(inst) == EE_ASYNC_PENDING) {
+  }
+}
+#endif
+
+#if EE_SKIP_UNCHANGED
+/*!
+    \brief      写入值与当前存储值相同时不追加记录，并计入统计
+    \param[in]  slot: 变量下标
+    \param[in]  data: 数据
+    \param[in]  size: 字节数
+    \param[out] none
+    \retval     1: 已跳过 0: 需要写入
+*/
+static uint8_t EE_SkipUnchanged(ee_instance_t* inst, uint16_t slot,
+                                const void* data, uint16_t size) {
+  uint32_t units;
+
+  if (inst->index[slot].offset == 0 || inst->index[slot].len != size ||
+      !EE_RecordEquals(inst, slot, data, size)) {
+    return 0;
+  }
+  if (EE_LARGE(inst, slot)) {
+    units = EE_CHUNKED_SIZE(size) / EE_PROGRAM_WIDTH;
+  } else {
+    units = (EE_CanPack(inst, slot, data, size) ? EE_PROGRAM_WIDTH
+                                                : EE_RECORD_SIZE(size)) /
+            EE_PROGRAM_WIDTH;
+  }
+  inst->skip_stats.writes++;
+  inst->skip_stats.words += units;
+  inst->skip_words += units;
+  /* 每省下一页可用空间，即少一次页传输和擦除 */
+  if (inst->skip_words >=
+      (PAGE_SIZE - EE_PAGE_HEADER_SIZE) / EE_PROGRAM_WIDTH) {
+    inst->skip_words -= (PAGE_SIZE - EE_PAGE_HEADER_SIZE) / EE_PROGRAM_WIDTH;
+    inst->skip_stats.erases++;
+  }
+  return 1;
+}
+
+/*!
+    \brief      比较变量的当前值与缓冲区是否相同
+    \param[in]  slot: 变量下标，长度与 size 相同
+    \param[in]  data: 缓冲区
+    \param[in]  size: 字节数
+    \param[out] none
+    \retval     1: 相同 0: 不同
+*/
+static uint8_t EE_RecordEquals(ee_instance_t* inst, uint16_t slot,
+                               const void* data, uint16_t size) {
+  const uint8_t* p_data = (const uint8_t*)data;
+  uint32_t flash_word;
+  uint16_t pos = 0, n;
+
+  if (inst->index[slot].delta != 0) {
+    uint8_t value[VARIABLE_MAX_SIZE];
+    EE_ReadData(inst, slot, 0, value, size);
+    EE_ApplyDelta(inst, slot, value, size);
+    return memcmp(value, p_data, size) == 0;
+  }
+
+  /* 每次比较 4 字节，不同则立即返回 */
+  while (pos < size) {
+    n = size - pos > 4 ? 4 : size - pos;
+    EE_ReadData(inst, slot, pos, &flash_word, n);
+    if (memcmp(&flash_word, p_data + pos, n) != 0) {
+      return 0;
+    }
+    pos += n;
+  }
+  return 1;
+}
+
+/*!
+    \brief      获取因写入值未改变而省去的操作次数
+    \param[in]  inst: 实例
+    \param[out] stats: 统计结果
+    \retval     none
+*/
+void EE_InstGetSkipStats(ee_instance_t* inst, ee_skip_stats_t* stats) {
+  EE_LOCK();
+  *stats = inst->skip_stats;
+  EE_UNLOCK();
+}
+#endif
+
+/*!
+    \brief      生成相对基准记录的差分：逐段列出改动的字节，相隔不超过 2 字节的改动
+                合并为一段（省下的段头与多写的字节相当）
+    \param[in]  slot: 变量下标
+    \param[in]  data: 新数据
+    \param[in]  size: 字节数
+    \param[out] patch: 差分数据，至少 VARIABLE_MAX_SIZE 字节
+    \retval     差分字节数，0 表示应写完整记录（变量太短、长度改变、没有基准，
+                或差分记录不比完整记录小）
+*/
+static uint16_t EE_MakeDelta(ee_instance_t* inst, uint16_t slot,
+                             const void* data, uint16_t size, uint8_t* patch) {
+#if EE_DELTA_MIN_SIZE > 0
+  const uint8_t* p_data = (const uint8_t*)data;
+  uint8_t base[VARIABLE_MAX_SIZE];
+  uint32_t full_size;
+  uint16_t i, start, end, patch_len = 0;
+
+  if (size < EE_DELTA_MIN_SIZE || inst->index[slot].offset == 0 ||
+      inst->index[slot].len != size) {
+    return 0;
+  }
+  full_size = EE_CanPack(inst, slot, data, size) ? EE_PROGRAM_WIDTH
+                                                 : EE_RECORD_SIZE(size);
+  EE_FlashRead(inst, EE_SlotDataAddr(inst, slot), base, size);
+  for (i = 0; i < size;) {
+    if (p_data[i] == base[i]) {
+      i++;
+      continue;
+    }
+    start = i;
+    end = i + 1;
+    for (i = end; i < size && i < end + 2; i++) {
+      if (p_data[i] != base[i]) {
+        end = i + 1;
+      }
+    }
+    if (EE_RECORD_SIZE(patch_len + 2 + end - start) >= full_size) {
+      return 0;
+    }
+    patch[patch_len++] = (uint8_t)start;
+    patch[patch_len++] = (uint8_t)(end - start);
+    memcpy(&patch[patch_len], &p_data[start], end - start);
+    patch_len += end - start;
+  }
+  return patch_len;
+#else
+  (void)inst;
+  (void)slot;
+  (void)data;
+  (void)size;
+  (void)patch;
+  return 0;
+#endif
+}
+
+/*!
+    \brief      在基准数据上套用变量最新的差分记录
+    \param[in]  slot: 变量下标
+    \param[in]  data: 基准数据
+    \param[in]  size: data 的字节数，超出部分的改动忽略
+    \param[out] data: 当前数据
+    \retval     none
+*/
+static void EE_ApplyDelta(ee_instance_t* inst, uint16_t slot, uint8_t* data,
+                          uint16_t size) {
+  uint32_t trailer_addr = inst->start + inst->index[slot].delta;
+  uint16_t patch_len =
+      (uint16_t)(EE_PortReadWord(trailer_addr) & EE_REC_LEN_MASK);
+  uint8_t patch[VARIABLE_MAX_SIZE];
+  uint16_t i, off, n;
+
+  if (patch_len > VARIABLE_MAX_SIZE) {
+    /* 不加锁读取时索引可能已过时（记录所在页已擦除），重读前不能越界 */
+    return;
+  }
+  EE_FlashRead(inst, trailer_addr + 4 - EE_RECORD_SIZE(patch_len), patch,
+               patch_len);
+  for (i = 0; i + 2 <= patch_len; i += 2 + n) {
+    off = patch[i];
+    n = patch[i + 1];
+    if (i + 2 + n > patch_len) {
+      break;
+    }
+    if (off < size) {
+      memcpy(&data[off], &patch[i + 2], off + n > size ? size - off : n);
+    }
+  }
+}
+
+/*!
+    \brief      擦除所有页，启用第 0 页
+    \param[in]  none
+    \param[out] none
+    \retval     Flash 操作状态
+      \arg        FLASH_COMPLETE: 成功
+      \arg        其他: 错误码
+*/
+static uint16_t EE_Format(ee_instance_t* inst) {
+  uint16_t flash_status;
+  uint16_t page;
+
+  for (page = 1; page < inst->page_count; page++) {
+    flash_status = EE_FlashErase(inst, EE_INST_PAGE(inst, page));
+    if (flash_status != FLASH_COMPLETE) {
+      return flash_status;
+    }
+  }
+  return EE_OpenPage(inst, 0, 0);
+}
+
+/*!
+    \brief      查找写入页：已启用的页中序号最大的一页（序号相同取编号大的）
+    \param[in]  none
+    \param[out] none
+    \retval     页编号，NO_VALID_PAGE 表示没有已启用的页
+*/
+static uint16_t EE_FindValidPage(ee_instance_t* inst) {
+  uint16_t page, valid_page = NO_VALID_PAGE;
+
+  for (page = 0; page < inst->page_count; page++) {
+    if (EE_IsLivePage(inst, page) &&
+        (valid_page == NO_VALID_PAGE ||
+         inst->page_seq[page] >= inst->page_seq[valid_page])) {
+      valid_page = page;
+    }
+  }
+  return valid_page;
+}
+
+/*!
+    \brief      查找最旧的页：已启用的页中序号最小的一页（序号相同取编号小的）
+    \param[in]  none
+    \param[out] none
+    \retval     页编号，NO_VALID_PAGE 表示没有已启用的页
+*/
+static uint16_t EE_FindOldestPage(ee_instance_t* inst) {
+  uint16_t page, oldest_page = NO_VALID_PAGE;
+
+  for (page = 0; page < inst->page_count; page++) {
+    if (EE_IsLivePage(inst, page) &&
+        (oldest_page == NO_VALID_PAGE ||
+         inst->page_seq[page] < inst->page_seq[oldest_page])) {
+      oldest_page = page;
+    }
+  }
+  return oldest_page;
+}
+
+/*!
+    \brief      从写入页之后按环形顺序查找空闲页（未启用或已回收），
+                优先返回已擦除的页，换页时不必等待擦除
+    \param[in]  valid_page: 写入页
+    \param[out] none
+    \retval     页编号，NO_VALID_PAGE 表示所有页都在使用中
+*/
+static uint16_t EE_FindFreePage(ee_instance_t* inst, uint16_t valid_page) {
+  uint16_t i, page, free_page = NO_VALID_PAGE;
+
+  for (i = 1; i < inst->page_count; i++) {
+    page = (uint16_t)((valid_page + i) % inst->page_count);
+    if (inst->page_seq[page] == EE_SEQ_ERASED) {
+      return page;
+    }
+    if (free_page == NO_VALID_PAGE && !EE_IsLivePage(inst, page)) {
+      free_page = page;
+    }
+  }
+  return free_page;
+}
+
+/*!
+    \brief      页是否已启用且未回收
+    \param[in]  page: 页编号
+    \param[out] none
+    \retval     1: 是 0: 否
+*/
+static uint8_t EE_IsLivePage(ee_instance_t* inst, uint16_t page) {
+  return inst->page_seq[page] != EE_SEQ_ERASED && !inst->page_retired[page];
+}
+
+/*!
+    \brief      启用一页作为新的写入页：确认已擦除（EE_Maintenance 未及时擦除的
+                已回收页在这里擦除）后写入页序号
+    \param[in]  page: 页编号
+    \param[in]  seq: 页序号
+    \param[out] none
+    \retval     FLASH_COMPLETE 或错误码
+*/
+static uint16_t EE_OpenPage(ee_instance_t* inst, uint16_t page, uint32_t seq) {
+  uint32_t page_addr = EE_INST_PAGE(inst, page);
+  uint16_t flash_status = EE_FlashErase(inst, page_addr);
+
+  if (flash_status != FLASH_COMPLETE) {
+    return flash_status;
+  }
+  flash_status = EE_FlashWrite(inst, page_addr, &seq, sizeof(seq));
+  EE_UpdatePageStatus(inst, page_addr, flash_status, seq, 0);
+  if (flash_status != FLASH_COMPLETE) {
+    return flash_status;
+  }
+  inst->write_addr = page_addr + EE_PAGE_HEADER_SIZE;
+  return FLASH_COMPLETE;
+}
+
+/*!
+   \brief      检查 VALID_PAGE 是否满，在 EEPROM 写入变量
+   \param[in]  virt_addr: 16 bit virtual address of the variable
+   \param[in]  size:
+   \param[in]  data:
+   \param[out] none
+   \retval     成功或错误状态:
+     \arg        FLASH_COMPLETE: 成功
+     \arg        PAGE_FULL: VALID_PAGE 满
+     \arg        NO_VALID_PAGE: 没有 VALID_PAGE
+     \arg        Flash error code: 写 Flash 错误码
+*/
+static uint16_t EE_VerifyPageFullWriteVariable(ee_instance_t* inst,
+                                               uint16_t virt_addr, void* data,
+                                               uint16_t size) {
+  if (size == 0) {
+    return FLASH_COMPLETE;
+  }
+  uint16_t flash_status = FLASH_COMPLETE;
+  uint16_t valid_page;
+  uint32_t write_addr, rec_size;
+  uint16_t slot = EE_FindSlot(inst, virt_addr);
+  uint32_t image[EE_RECORD_SIZE(VARIABLE_MAX_SIZE) / 4];
+  uint8_t packed, delta;
+
+  valid_page = EE_FindValidPage(inst);
+
+  if (valid_page == NO_VALID_PAGE) {
+    return NO_VALID_PAGE;
+  }
+
+  write_addr = EE_GetWriteHead(inst, valid_page);
+  rec_size = EE_PrepareRecord(inst, slot, data, size, image, &packed, &delta);
+
+  if (EE_FreeSpaceLocked(inst) < rec_size) {
+    return PAGE_FULL;
+  }
+
+  flash_status = EE_ProgramRecord(inst, write_addr, image, rec_size);
+  if (flash_status != FLASH_COMPLETE) {
+    inst->write_addr = 0;
+    return flash_status;
+  }
+  EE_IndexRecord(inst, slot, write_addr, rec_size, size, packed, delta);
+  return FLASH_COMPLETE;
+}
+
+/*!
+   \brief      按写入规则在 RAM 中生成变量的下一条记录：能写差分时写差分记录，
+                否则能写紧凑记录时写紧凑记录，其余写普通记录
+   \param[in]  slot: 变量下标
+   \param[in]  data: 数据
+   \param[in]  size: 字节数
+   \param[out] image: 记录映像，EE_RECORD_SIZE(VARIABLE_MAX_SIZE) 字节
+   \param[out] packed: 1: 紧凑记录
+   \param[out] delta: 1: 差分记录
+   \retval     记录字节数
+*/
+static uint32_t EE_PrepareRecord(ee_instance_t* inst, uint16_t slot,
+                                 const void* data, uint16_t size,
+                                 uint32_t* image, uint8_t* packed,
+                                 uint8_t* delta) {
+  uint8_t patch[VARIABLE_MAX_SIZE];
+  uint16_t patch_len = EE_MakeDelta(inst, slot, data, size, patch);
+
+  *packed = 0;
+  *delta = patch_len != 0;
+  if (patch_len != 0) {
+    return EE_BuildRecord(image, EE_KEY(inst, slot), patch, patch_len,
+                          EE_REC_DELTA);
+  }
+  if (EE_CanPack(inst, slot, data, size)) {
+    *packed = 1;
+    return EE_BuildPacked(inst, image, slot, data, size);
+  }
+  return EE_BuildRecord(image, EE_KEY(inst, slot), data, size,
+                        EE_REC_DATA);
+}
+
+/*!
+   \brief      记录写完后更新写指针和 RAM 索引，差分记录只更新差分位置
+   \param[in]  slot: 变量下标
+   \param[in]  write_addr: 记录起始地址
+   \param[in]  rec_size: 记录字节数
+   \param[in]  size: 变量字节数
+   \param[in]  packed: 1: 紧凑记录
+   \param[in]  delta: 1: 差分记录
+   \param[out] none
+   \retval     none
+*/
+static void EE_IndexRecord(ee_instance_t* inst, uint16_t slot,
+                           uint32_t write_addr, uint32_t rec_size,
+                           uint16_t size, uint8_t packed, uint8_t delta) {
+  inst->write_addr = write_addr + rec_size;
+  EE_SEQ_BEGIN(inst);
+  if (delta) {
+    inst->index[slot].delta = (uint16_t)(inst->write_addr - 4 - inst->start);
+  } else {
+    EE_ReclaimDrop(inst, slot);
+    inst->index[slot].offset = (uint16_t)(write_addr - inst->start);
+    inst->index[slot].len = size;
+    inst->index[slot].packed = packed;
+    inst->index[slot].delta = 0;
+  }
+  EE_SEQ_END(inst);
+}
+
+/*!
+   \brief      在 RAM 中生成一条记录：数据 + 尾字，其余字节为 0xFF
+   \param[out] image: 记录映像
+   \param[in]  virt_addr: 虚拟地址
+   \param[in]  data: 数据
+   \param[in]  size: 数据字节数
+   \param[in]  type: 记录类型 EE_REC_DATA/EE_REC_BATCH/EE_REC_DELTA
+   \retval     记录字节数
+*/
+static uint32_t EE_BuildRecord(uint32_t* image, uint16_t virt_addr,
+                               const void* data, uint16_t size, uint16_t type) {
+  uint32_t rec_size = EE_RECORD_SIZE(size);
+  uint32_t i;
+
+  memset(image, 0xFF, rec_size);
+  memcpy(image, data, size);
+  if (rec_size > EE_PROGRAM_WIDTH) {
+    for (i = 0; i < EE_PROGRAM_WIDTH / 4; i++) {
+      if (image[i] != 0xFFFFFFFF) {
+        type |= EE_REC_HEAD;
+        break;
+      }
+    }
+  }
+  /* 写入虚拟地址、类型和变量大小 */
+  image[rec_size / 4 - 1] = ((uint32_t)virt_addr << 16) | type | size;
+  return rec_size;
+}
+
+/*!
+   \brief      在 RAM 中生成一条紧凑记录（一个编程单元），
+                数据紧靠单元末尾的取反虚拟地址
+   \param[out] image: 记录映像
+   \param[in]  slot: 变量下标
+   \param[in]  data: 数据
+   \param[in]  size: 数据字节数，不超过 EE_PACKED_MAX
+   \retval     记录字节数
+*/
+static uint32_t EE_BuildPacked(ee_instance_t* inst, uint32_t* image,
+                               uint16_t slot, const void* data, uint16_t size) {
+  uint16_t key = (uint16_t)~EE_KEY(inst, slot);
+
+  memset(image, 0xFF, EE_PROGRAM_WIDTH);
+  memcpy((uint8_t*)image + EE_PROGRAM_WIDTH - 2 - EE_PACKED_FIELD(size), data,
+         size);
+  memcpy((uint8_t*)image + EE_PROGRAM_WIDTH - 2, &key, sizeof(key));
+  return EE_PROGRAM_WIDTH;
+}
+
+/*!
+   \brief      在 write_addr 处写入记录映像：从第二个编程单元写起，尾字所在的
+                最后一个单元随之写入，第一个单元最后写；全为 0xFF 的单元不写
+   \param[in]  write_addr: 记录起始地址
+   \param[in]  image: 记录映像
+   \param[in]  rec_size: 记录字节数
+   \param[out] none
+   \retval     FLASH_COMPLETE 或写 Flash 错误码
+*/
+static uint16_t EE_ProgramRecord(ee_instance_t* inst, uint32_t write_addr,
+                                 const uint32_t* image, uint32_t rec_size) {
+  uint32_t n, i;
+  uint16_t flash_status;
+
+  for (n = 1; n <= rec_size / EE_PROGRAM_WIDTH; n++) {
+    i = n * EE_PROGRAM_WIDTH % rec_size;
+    flash_status = EE_FlashWrite(inst, write_addr + i, (void*)&image[i / 4],
+                                 EE_PROGRAM_WIDTH);
+    if (flash_status != FLASH_COMPLETE) {
+      return flash_status;
+    }
+  }
+  return FLASH_COMPLETE;
+}
+
+/*!
+   \brief      在 write_addr 处写入一条记录
+   \param[in]  write_addr: 记录起始地址
+   \param[in]  virt_addr: 虚拟地址
+   \param[in]  data: 数据
+   \param[in]  size: 数据字节数
+   \param[in]  type: 记录类型 EE_REC_DATA/EE_REC_BATCH/EE_REC_DELTA
+   \param[out] none
+   \retval     FLASH_COMPLETE 或写 Flash 错误码
+*/
+static uint16_t EE_AppendRecord(ee_instance_t* inst, uint32_t write_addr,
+                                uint16_t virt_addr, void* data, uint16_t size,
+                                uint16_t type) {
+  uint32_t image[EE_RECORD_SIZE(VARIABLE_MAX_SIZE) / 4];
+  uint32_t rec_size = EE_BuildRecord(image, virt_addr, data, size, type);
+  return EE_ProgramRecord(inst, write_addr, image, rec_size);
+}
+
+/*!
+   \brief      在 write_addr 处写入一条紧凑记录
+   \param[in]  write_addr: 记录起始地址
+   \param[in]  slot: 变量下标
+   \param[in]  data: 数据
+   \param[in]  size: 数据字节数，不超过 EE_PACKED_MAX
+   \param[out] none
+   \retval     FLASH_COMPLETE 或写 Flash 错误码
+*/
+static uint16_t EE_AppendPacked(ee_instance_t* inst, uint32_t write_addr,
+                                uint16_t slot, const void* data,
+                                uint16_t size) {
+  uint32_t image[EE_PROGRAM_WIDTH / 4];
+  EE_BuildPacked(inst, image, slot, data, size);
+  return EE_ProgramRecord(inst, write_addr, image, EE_PROGRAM_WIDTH);
+}
+
+/*!
+   \brief      在 write_addr 处写入只含尾字（提交字、填充字）的一个编程单元
+   \param[in]  write_addr: 单元起始地址
+   \param[in]  trailer: 尾字
+   \param[out] none
+   \retval     FLASH_COMPLETE 或写 Flash 错误码
+*/
+static uint16_t EE_WriteTrailer(ee_instance_t* inst, uint32_t write_addr,
+                                uint32_t trailer) {
+  uint32_t unit[EE_PROGRAM_WIDTH / 4];
+
+  memset(unit, 0xFF, sizeof(unit));
+  unit[EE_PROGRAM_WIDTH / 4 - 1] = trailer;
+  return EE_FlashWrite(inst, write_addr, unit, sizeof(unit));
+}
+
+/*!
+   \brief      返回写入页的写指针，缓存不在该页时重新查找
+   \param[in]  page: 页编号
+   \param[out] none
+   \retval     第一个可写地址，页满时为页结束地址
+*/
+static uint32_t EE_GetWriteHead(ee_instance_t* inst, uint16_t page) {
+  uint32_t page_start_addr = EE_INST_PAGE(inst, page);
+
+  if (inst->write_addr < page_start_addr + EE_PAGE_HEADER_SIZE ||
+      inst->write_addr > page_start_addr + PAGE_SIZE) {
+    inst->write_addr = EE_FindPageHead(inst, page);
+  }
+  return inst->write_addr;
+}
+
+/*!
+   \brief      用二分查找定位指定页第一个未使用的编程单元
+                页内已用区域之后全部为 0xFFFFFFFF；记录数据本身也可能含有
+                0xFFFFFFFF，但连续长度不超过一条最长记录，
+                因此二分得到的位置之后需确认一条最长记录范围内均为擦除状态
+   \param[in]  page: 页编号
+   \param[out] none
+   \retval     第一个未使用的地址，页满时为页结束地址
+*/
+static uint32_t EE_FindPageHead(ee_instance_t* inst, uint16_t page) {
+  uint32_t page_start_addr = EE_INST_PAGE(inst, page);
+  uint32_t page_end_addr = page_start_addr + PAGE_SIZE;
+  uint32_t lo, hi, mid, addr, limit;
+
+  /* lo 之前均已使用，hi 及之后均为擦除状态 */
+  lo = page_start_addr + EE_PAGE_HEADER_SIZE;
+  hi = page_end_addr;
+  for (;;) {
+    while (lo < hi) {
+      mid = lo + (hi - lo) / (2 * EE_PROGRAM_WIDTH) * EE_PROGRAM_WIDTH;
+      EE_STAT_ADD(inst, scan_words, EE_PROGRAM_WIDTH / 4);
+      if (EE_IsBlank(mid, EE_PROGRAM_WIDTH)) {
+        hi = mid;
+      } else {
+        lo = mid + EE_PROGRAM_WIDTH;
+      }
+    }
+    limit = lo + EE_RECORD_SIZE(VARIABLE_MAX_SIZE);
+    if (limit > page_end_addr) {
+      limit = page_end_addr;
+    }
+    for (addr = lo; addr < limit; addr += EE_PROGRAM_WIDTH) {
+      EE_STAT_ADD(inst, scan_words, EE_PROGRAM_WIDTH / 4);
+      if (!EE_IsBlank(addr, EE_PROGRAM_WIDTH)) {
+        break;
+      }
+    }
+    if (addr >= limit) {
+      break;
+    }
+    /* 落在记录数据中，从该位置之后继续查找 */
+    lo = addr + EE_PROGRAM_WIDTH;
+    hi = page_end_addr;
+  }
+
+  return lo;
+}
+
+/*!
+    \brief      查询写入页剩余空间（已扣除未完成的回收还需复制的字节数），
+                写入 EE_RECORD_SIZE(size) 以内的变量不会触发页传输
+    \param[in]  inst: 实例
+    \param[out] none
+    \retval     剩余字节数，无写入页时为 0
+*/
+uint16_t EE_InstGetFreeSpace(ee_instance_t* inst) {
+  uint16_t free_bytes;
+
+  EE_LOCK();
+  free_bytes = EE_FreeSpaceLocked(inst);
+  EE_UNLOCK();
+  return free_bytes;
+}
+
+/*!
+    \brief      同 EE_InstGetFreeSpace，调用者已持有写锁
+*/
+static uint16_t EE_FreeSpaceLocked(ee_instance_t* inst) {
+  uint16_t valid_page = EE_FindValidPage(inst);
+  uint32_t free_bytes, reserved;
+  if (valid_page == NO_VALID_PAGE) {
+    return 0;
+  }
+  free_bytes =
+      EE_INST_PAGE(inst, valid_page + 1) - EE_GetWriteHead(inst, valid_page);
+  reserved = EE_ReclaimBytes(inst);
+  return (uint16_t)(free_bytes > reserved ? free_bytes - reserved : 0);
+}
+
+/*!
+    \brief      批量写入多个变量：为整批记录预留空间后连续写入，最后写一个提交字，
+                掉电后 EE_Init 只承认有提交字的批次，整批要么全部生效要么全部保持原值
+    \param[in]  inst: 实例
+    \param[in]  items: 变量数组，size 为 0 的项跳过，没有要写的项时什么都不写
+    \param[in]  count: 变量个数
+    \param[out] none
+    \retval
+      \arg        FLASH_COMPLETE: 成功写入
+      \arg        PAGE_FULL: 页传输后仍放不下
+      \arg        NO_VALID_PAGE: 未查找到可用页
+      \arg        VAR_SIZE_OVERFLOW: 单个变量超过设定长度或与定长变量的长度不符
+                                     （大变量不能批量写入），或整批超过一页
+      \arg        ADDR_INVALID: 虚拟地址不在变量表中
+      \arg        Flash error code: on write Flash error
+*/
+uint16_t EE_InstWriteBatch(ee_instance_t* inst, const ee_batch_item_t* items,
+                           uint16_t count) {
+  uint16_t status;
+
+  EE_LOCK();
+  status = EE_WriteBatchLocked(inst, items, count);
+  EE_UNLOCK();
+  return status;
+}
+
+/*!
+    \brief      同 EE_InstWriteBatch，调用者已持有写锁
+*/
+static uint16_t EE_WriteBatchLocked(ee_instance_t* inst,
+                                    const ee_batch_item_t* items,
+                                    uint16_t count) {
+  uint32_t total = EE_PROGRAM_WIDTH; /* 提交字 */
+  uint32_t write_addr, commit;
+  uint16_t i, slot, status;
+
+  for (i = 0; i < count; i++) {
+    if (items[i].size > VARIABLE_MAX_SIZE) {
+      return VAR_SIZE_OVERFLOW;
+    }
+    slot = EE_FindSlot(inst, items[i].virt_addr);
+    if (slot >= inst->var_count) {
+      return ADDR_INVALID;
+    }
+    if (items[i].size != 0 && inst->var_size[slot] != 0 &&
+        items[i].size != inst->var_size[slot]) {
+      return VAR_SIZE_OVERFLOW;
+    }
+    if (items[i].size != 0) {
+      total += EE_RECORD_SIZE(items[i].size);
+    }
+  }
+  if (total > PAGE_SIZE - EE_PAGE_HEADER_SIZE) {
+    return VAR_SIZE_OVERFLOW;
+  }
+  /* 没有要写的项，不写只有提交字的空批次 */
+  if (total == EE_PROGRAM_WIDTH) {
+    return FLASH_COMPLETE;
+  }
+#if EE_ASYNC_QUEUE
+  EE_AsyncDrain(inst);
+#endif
+
+  status = EE_ReserveSpace(inst, total, &write_addr);
+  if (status != FLASH_COMPLETE) {
+    return status;
+  }
+  for (i = 0; i < count; i++) {
+    if (items[i].size == 0) {
+      continue;
+    }
+    status = EE_AppendRecord(inst, write_addr, items[i].virt_addr,
+                             items[i].data, items[i].size, EE_REC_BATCH);
+    if (status != FLASH_COMPLETE) {
+      inst->write_addr = 0;
+      return status;
+    }
+    write_addr += EE_RECORD_SIZE(items[i].size);
+  }
+  commit = ((uint32_t)EE_KEY_COMMIT << 16) | ((total - EE_PROGRAM_WIDTH) / 4);
+  status = EE_WriteTrailer(inst, write_addr, commit);
+  if (status != FLASH_COMPLETE) {
+    inst->write_addr = 0;
+    return status;
+  }
+  inst->write_addr = write_addr + EE_PROGRAM_WIDTH;
+
+  /* 提交后才更新索引 */
+  write_addr = inst->write_addr - total;
+  EE_SEQ_BEGIN(inst);
+  for (i = 0; i < count; i++) {
+    if (items[i].size == 0) {
+      continue;
+    }
+    slot = EE_FindSlot(inst, items[i].virt_addr);
+    EE_ReclaimDrop(inst, slot);
+    inst->index[slot].offset = (uint16_t)(write_addr - inst->start);
+    inst->index[slot].len = items[i].size;
+    inst->index[slot].packed = 0;
+    inst->index[slot].delta = 0;
+#if EE_WRITE_BACK
+    /* 缓存中的旧值已被本批覆盖 */
+    ee_cache_t* entry = EE_CacheFind(inst, slot);
+    if (entry != (void*)0) {
+      entry->used = 0;
+    }
+#endif
+    write_addr += EE_RECORD_SIZE(items[i].size);
+  }
+  EE_SEQ_END(inst);
+  return FLASH_COMPLETE;
+}
+
+/*!
+    \brief      在写入页为连续写入的 total 字节预留空间：不够时先完成回收、启用下一页，
+                旧值仍保留在旧页或随回收复制，提交前掉电可恢复到旧值
+    \param[in]  total: 字节数
+    \param[out] write_addr: 写入起始地址
+    \retval     FLASH_COMPLETE、PAGE_FULL、NO_VALID_PAGE 或写 Flash 错误码
+*/
+static uint16_t EE_ReserveSpace(ee_instance_t* inst, uint32_t total,
+                                uint32_t* write_addr) {
+  uint16_t valid_page, status, budget;
+
+  valid_page = EE_FindValidPage(inst);
+  if (valid_page == NO_VALID_PAGE) {
+    return NO_VALID_PAGE;
+  }
+  if (EE_FreeSpaceLocked(inst) < total) {
+    budget = EE_RECLAIM_ALL;
+    status = EE_ReclaimPages(inst, &budget, !EE_ERASE_AHEAD);
+    if (status == FLASH_COMPLETE && EE_FreeSpaceLocked(inst) < total) {
+      status = EE_PageTransfer(inst, 0, (void*)0, 0);
+    }
+    if (status != FLASH_COMPLETE) {
+      return status;
+    }
+    if (EE_FreeSpaceLocked(inst) < total) {
+      return PAGE_FULL;
+    }
+    valid_page = EE_FindValidPage(inst);
+  }
+  *write_addr = EE_GetWriteHead(inst, valid_page);
+  return FLASH_COMPLETE;
+}
+
+/*!
+    \brief      打开大变量的流式写入：为整个值预留写入页空间（不够时先完成回收、
+                启用下一页），之后用 EE_StreamWrite 分段写入，EE_StreamCommit 提交。
+                提交前掉电或放弃写入，变量保持原值
+    \param[in]  inst: 实例
+    \param[in]  virt_addr: 虚拟地址，须为大变量
+    \param[out] stream: 写入句柄
+    \retval
+      \arg        FLASH_COMPLETE: 成功
+      \arg        PAGE_FULL: 页传输后仍放不下
+      \arg        NO_VALID_PAGE: 未查找到可用页
+      \arg        ADDR_INVALID: 虚拟地址不在变量表中或不是大变量
+      \arg        POINT_INVALID: stream 为 NULL
+      \arg        Flash error code: on write Flash error
+*/
+uint16_t EE_InstStreamOpenWrite(ee_instance_t* inst, ee_stream_t* stream,
+                               uint16_t virt_addr) {
+  uint16_t status;
+
+  if (stream == (void*)0) {
+    return POINT_INVALID;
+  }
+  stream->inst = inst;
+  stream->slot = EE_FindSlot(inst, virt_addr);
+  stream->pos = 0;
+  stream->mode = 0;
+  stream->start = 0;
+  if (stream->slot >= inst->var_count || !EE_LARGE(inst, stream->slot)) {
+    return ADDR_INVALID;
+  }
+  EE_LOCK();
+#if EE_ASYNC_QUEUE
+  EE_AsyncDrain(inst);
+#endif
+  status = EE_ReserveSpace(
+      inst, EE_CHUNKED_SIZE(inst->var_size[stream->slot]), &stream->start);
+  EE_UNLOCK();
+  if (status != FLASH_COMPLETE) {
+    stream->start = 0;
+  } else {
+    stream->mode = EE_STREAM_WRITE;
+  }
+  stream->addr = stream->start;
+  return status;
+}
+
+/*!
+    \brief      写入大变量的下一段数据，每满一块写入 Flash
+    \param[in]  stream: EE_StreamOpenWrite 打开的句柄
+    \param[in]  data: 数据
+    \param[in]  size: 字节数，累计不能超过变量的长度
+    \param[out] none
+    \retval
+      \arg        FLASH_COMPLETE: 成功
+      \arg        VAR_SIZE_OVERFLOW: 累计超过变量的长度
+      \arg        STREAM_ABORTED: 句柄未打开或为读取句柄，
+                  或打开后有其他写入，需重新打开
+      \arg        Flash error code: on write Flash error
+*/
+uint16_t EE_StreamWrite(ee_stream_t* stream, const void* data, uint16_t size) {
+  const uint8_t* p_data = (const uint8_t*)data;
+  uint16_t fill, n, status;
+
+  if (stream->mode != EE_STREAM_WRITE || stream->start == 0) {
+    return STREAM_ABORTED;
+  }
+  if (size > stream->inst->var_size[stream->slot] - stream->pos) {
+    return VAR_SIZE_OVERFLOW;
+  }
+  while (size > 0) {
+    fill = stream->pos % EE_CHUNK_SIZE;
+    n = EE_CHUNK_SIZE - fill;
+    n = n > size ? size : n;
+    memcpy(stream->buf + fill, p_data, n);
+    stream->pos += n;
+    p_data += n;
+    size -= n;
+    if (fill + n == EE_CHUNK_SIZE) {
+      status = EE_StreamChunk(stream, EE_CHUNK_SIZE);
+      if (status != FLASH_COMPLETE) {
+        return status;
+      }
+    }
+  }
+  return FLASH_COMPLETE;
+}
+
+/*!
+    \brief      写完最后一块和提交字，新值生效，句柄随之关闭
+    \param[in]  stream: EE_StreamOpenWrite 打开的句柄
+    \param[out] none
+    \retval
+      \arg        FLASH_COMPLETE: 成功
+      \arg        VAR_SIZE_OVERFLOW: 写入的字节数不足变量的长度（句柄仍可继续写入）
+      \arg        STREAM_ABORTED: 句柄未打开或为读取句柄，
+                  或打开后有其他写入，需重新打开
+      \arg        Flash error code: on write Flash error
+*/
+uint16_t EE_StreamCommit(ee_stream_t* stream) {
+  ee_instance_t* inst = stream->inst;
+  uint16_t status;
+
+  if (stream->mode != EE_STREAM_WRITE || stream->start == 0) {
+    return STREAM_ABORTED;
+  }
+  if (stream->pos != inst->var_size[stream->slot]) {
+    return VAR_SIZE_OVERFLOW;
+  }
+  if (stream->pos % EE_CHUNK_SIZE != 0) {
+    status = EE_StreamChunk(stream, stream->pos % EE_CHUNK_SIZE);
+    if (status != FLASH_COMPLETE) {
+      return status;
+    }
+  }
+  EE_LOCK();
+#if EE_ASYNC_QUEUE
+  EE_AsyncDrain(inst);
+#endif
+  status = inst->write_addr == stream->addr
+               ? EE_CommitChunks(inst, stream->slot, stream->start,
+                                 stream->addr)
+               : STREAM_ABORTED;
+  EE_UNLOCK();
+  stream->start = 0;
+  return status;
+}
+
+/*!
+    \brief      把句柄中缓存的一块写入 Flash；写指针已不在上一块之后说明中间
+                有其他写入，已写的块没有提交字，不会生效
+    \param[in]  stream: 写入句柄
+    \param[in]  len: 块的字节数
+    \param[out] none
+    \retval     FLASH_COMPLETE、STREAM_ABORTED 或写 Flash 错误码
+*/
+static uint16_t EE_StreamChunk(ee_stream_t* stream, uint16_t len) {
+  ee_instance_t* inst = stream->inst;
+  uint16_t status = STREAM_ABORTED;
+
+  EE_LOCK();
+#if EE_ASYNC_QUEUE
+  /* 打开后提交的异步写入可能正在写流的下一块的位置，先写完，流随之放弃 */
+  EE_AsyncDrain(inst);
+#endif
+  if (inst->write_addr == stream->addr) {
+    status = EE_AppendChunk(inst, stream->slot, stream->addr, stream->buf, len);
+  }
+  EE_UNLOCK();
+  if (status != FLASH_COMPLETE) {
+    stream->start = 0;
+    return status;
+  }
+  stream->addr += EE_RECORD_SIZE(len);
+  return FLASH_COMPLETE;
+}
+
+/*!
+    \brief      一次写入大变量的整个值：直接由 data 逐块写入，最后写提交字
+    \param[in]  slot: 变量下标
+    \param[in]  data: 数据，长度为变量表中的字节数
+    \param[out] none
+    \retval     同 EE_WriteVaribal
+*/
+static uint16_t EE_WriteLarge(ee_instance_t* inst, uint16_t slot,
+                              const void* data) {
+  uint16_t size = inst->var_size[slot];
+  uint32_t start, write_addr;
+  uint16_t pos, len, status;
+
+  status = EE_ReserveSpace(inst, EE_CHUNKED_SIZE(size), &start);
+  write_addr = start;
+  for (pos = 0; status == FLASH_COMPLETE && pos < size; pos += len) {
+    len = size - pos > EE_CHUNK_SIZE ? EE_CHUNK_SIZE : size - pos;
+    status = EE_AppendChunk(inst, slot, write_addr,
+                            (const uint8_t*)data + pos, len);
+    write_addr += EE_RECORD_SIZE(len);
+  }
+  if (status != FLASH_COMPLETE) {
+    return status;
+  }
+  return EE_CommitChunks(inst, slot, start, write_addr);
+}
+
+/*!
+    \brief      在 write_addr 处写入大变量的一块，写指针随之后移
+    \param[in]  slot: 变量下标
+    \param[in]  write_addr: 块的起始地址
+    \param[in]  data: 数据
+    \param[in]  len: 字节数，不超过 EE_CHUNK_SIZE
+    \param[out] none
+    \retval     FLASH_COMPLETE 或写 Flash 错误码
+*/
+static uint16_t EE_AppendChunk(ee_instance_t* inst, uint16_t slot,
+                               uint32_t write_addr, const void* data,
+                               uint16_t len) {
+  uint16_t status = EE_AppendRecord(inst, write_addr, EE_KEY(inst, slot),
+                                    (void*)data, len, EE_REC_CHUNK);
+  if (status != FLASH_COMPLETE) {
+    inst->write_addr = 0;
+    return status;
+  }
+  inst->write_addr = write_addr + EE_RECORD_SIZE(len);
+  return FLASH_COMPLETE;
+}
+
+/*!
+    \brief      在各块之后写提交字，再把 RAM 索引指向第一块
+    \param[in]  slot: 变量下标
+    \param[in]  start: 第一块的地址
+    \param[in]  write_addr: 最后一块之后的地址
+    \param[out] none
+    \retval     FLASH_COMPLETE 或写 Flash 错误码
+*/
+static uint16_t EE_CommitChunks(ee_instance_t* inst, uint16_t slot,
+                                uint32_t start, uint32_t write_addr) {
+  uint32_t commit =
+      ((uint32_t)EE_KEY_COMMIT << 16) | ((write_addr - start) / 4);
+  uint16_t status = EE_WriteTrailer(inst, write_addr, commit);
+
+  if (status != FLASH_COMPLETE) {
+    inst->write_addr = 0;
+    return status;
+  }
+  inst->write_addr = write_addr + EE_PROGRAM_WIDTH;
+  EE_SEQ_BEGIN(inst);
+  EE_ReclaimDrop(inst, slot);
+  inst->index[slot].offset = (uint16_t)(start - inst->start);
+  inst->index[slot].len = inst->var_size[slot];
+  inst->index[slot].packed = 0;
+  inst->index[slot].delta = 0;
+  EE_SEQ_END(inst);
+  return FLASH_COMPLETE;
+}
+
+/*!
+    \brief      打开大变量的流式读取，之后用 EE_StreamRead 分段读出打开时的值；
+                期间写入的新值不影响已打开的读取，值所在页被擦除时返回 STREAM_ABORTED
+    \param[in]  inst: 实例
+    \param[in]  virt_addr: 虚拟地址，须为大变量
+    \param[out] stream: 读取句柄
+    \retval
+      \arg        0: 成功
+      \arg        1: 未写入过，读出默认值
+      \arg        NO_VALID_PAGE: 未查找到valid页
+      \arg        ADDR_INVALID: 虚拟地址不在变量表中或不是大变量
+      \arg        POINT_INVALID: stream 为 NULL
+*/
+uint16_t EE_InstStreamOpenRead(ee_instance_t* inst, ee_stream_t* stream,
+                              uint16_t virt_addr) {
+  if (stream == (void*)0) {
+    return POINT_INVALID;
+  }
+  stream->inst = inst;
+  stream->slot = EE_FindSlot(inst, virt_addr);
+  stream->pos = 0;
+  stream->mode = 0;
+  stream->start = 0;
+  if (EE_FindValidPage(inst) == NO_VALID_PAGE) {
+    return NO_VALID_PAGE;
+  }
+  if (stream->slot >= inst->var_count || !EE_LARGE(inst, stream->slot)) {
+    return ADDR_INVALID;
+  }
+  /* 大变量不经过写回缓存和异步队列，记下索引和擦除代数即可 */
+  EE_LOCK();
+  if (inst->index[stream->slot].offset != 0) {
+    stream->start = inst->start + inst->index[stream->slot].offset;
+  }
+  stream->gen = inst->generation;
+  stream->mode = EE_STREAM_READ;
+  EE_UNLOCK();
+  return stream->start != 0 ? 0 : 1;
+}
+
+/*!
+    \brief      读取大变量的下一段数据
+    \param[in]  stream: EE_StreamOpenRead 成功打开的句柄
+    \param[in]  size: 要读取的大小
+    \param[out] data: 接收读出数据的缓冲区
+    \param[out] br: 实际读取到的字节数（读到末尾时少于 size），NULL 时不使用
+    \retval
+      \arg        FLASH_COMPLETE: 成功
+      \arg        STREAM_ABORTED: 句柄未打开或为写入句柄（br 为 0），
+                  或值所在页已被擦除，读出的数据无效，需重新打开
+*/
+uint16_t EE_StreamRead(ee_stream_t* stream, void* data, uint16_t size,
+                       uint16_t* br) {
+  ee_instance_t* inst = stream->inst;
+  uint16_t rest, n;
+
+  if (stream->mode != EE_STREAM_READ || stream->slot >= inst->var_count) {
+    if (br != (void*)0) {
+      *br = 0;
+    }
+    return STREAM_ABORTED;
+  }
+  rest = inst->var_size[stream->slot] - stream->pos;
+  size = size > rest ? rest : size;
+  if (br != (void*)0) {
+    *br = size;
+  }
+  if (stream->start == 0) {
+    /* 默认值按小端存放在前 4 字节 */
+    memset(data, 0, size);
+    if (stream->pos < 4) {
+      n = 4 - stream->pos;
+      memcpy(data,
+             (const uint8_t*)&inst->var_default[stream->slot] + stream->pos,
+             size < n ? size : n);
+    }
+  } else {
+    EE_ReadChunks(inst, stream->start, stream->pos, data, size);
+    if (!EE_InstRefValid(inst, stream->gen)) {
+      return STREAM_ABORTED;
+    }
+  }
+  stream->pos += size;
+  return FLASH_COMPLETE;
+}
+
+/*!
+   \brief      写入页已满：按环形顺序启用下一页，写入新变量；
+                没有空闲页时最旧页的回收交给 EE_Maintenance 逐步完成
+   \param[in]  virt_addr: 新写入的变量虚拟地址，size 为 0 时只换页
+   \param[in]  size: 字节数
+   \param[in]  data: 数据地址
+   \param[out] none
+   \retval     成功或错误状态:
+     \arg        FLASH_COMPLETE: 成功
+     \arg        PAGE_FULL: 没有空闲页
+     \arg        NO_VALID_PAGE: 没有找到可用页
+     \arg        Flash error code: 写Flash的错误码
+*/
+static uint16_t EE_PageTransfer(ee_instance_t* inst, uint16_t virt_addr,
+                                void* data, uint16_t size) {
+  uint16_t valid_page, new_page;
+  uint16_t eeprom_status;
+  EE_STAT_START(start);
+
+  valid_page = EE_FindValidPage(inst);
+  if (valid_page == NO_VALID_PAGE) {
+    return NO_VALID_PAGE;
+  }
+  new_page = EE_FindFreePage(inst, valid_page);
+  if (new_page == NO_VALID_PAGE) {
+    return PAGE_FULL;
+  }
+
+  /* 序号 32 位，按每页擦写寿命计算不会回绕 */
+  eeprom_status = EE_OpenPage(inst, new_page, inst->page_seq[valid_page] + 1);
+  if (eeprom_status != FLASH_COMPLETE) {
+    return eeprom_status;
+  }
+#if EE_BOOT_SNAPSHOT
+  eeprom_status = EE_WriteSnapshot(inst);
+  if (eeprom_status != FLASH_COMPLETE) {
+    return eeprom_status;
+  }
+#endif
+  eeprom_status = EE_VerifyPageFullWriteVariable(inst, virt_addr, data, size);
+  EE_STAT_TIME(inst, transfer, start);
+  EE_STAT_ADD(inst, transfers, 1);
+  return eeprom_status;
+}
+
+#if EE_BOOT_SNAPSHOT
+/*!
+   \brief      在刚启用的写入页开头写入索引快照：快照之后的记录都在这一页，
+                EE_InstInit 由快照和这一页即可恢复完整的索引
+   \param[in]  none
+   \param[out] none
+   \retval     FLASH_COMPLETE 或写 Flash 错误码
+*/
+static uint16_t EE_WriteSnapshot(ee_instance_t* inst) {
+  uint32_t rec_size = EE_RECORD_SIZE(EE_SNAPSHOT_LEN(inst));
+  uint32_t write_addr = inst->write_addr;
+  uint32_t unit[EE_PROGRAM_WIDTH / 4];
+  uint32_t i, k, n;
+  uint16_t flash_status;
+
+  /* 快照太大时省下的扫描抵不上占用的空间 */
+  if (rec_size > PAGE_SIZE / 4) {
+    return FLASH_COMPLETE;
+  }
+  /* 与 EE_ProgramRecord 相同，从第二个单元写起，第一个单元最后写 */
+  for (n = 1; n <= rec_size / EE_PROGRAM_WIDTH; n++) {
+    i = n * EE_PROGRAM_WIDTH % rec_size;
+    for (k = 0; k < EE_PROGRAM_WIDTH / 4; k++) {
+      unit[k] = EE_SnapshotWord(inst, i / 4 + k, rec_size / 4);
+    }
+    flash_status = EE_FlashWrite(inst, write_addr + i, unit, sizeof(unit));
+    if (flash_status != FLASH_COMPLETE) {
+      inst->write_addr = 0;
+      return flash_status;
+    }
+  }
+  inst->write_addr = write_addr + rec_size;
+  return FLASH_COMPLETE;
+}
+
+/*!
+   \brief      生成索引快照记录的第 word 个字
+   \param[in]  word: 字序号
+   \param[in]  words: 记录总字数
+   \param[out] none
+   \retval     字的内容
+*/
+static uint32_t EE_SnapshotWord(ee_instance_t* inst, uint32_t word,
+                                uint32_t words) {
+  uint16_t slot = (uint16_t)(word - 1);
+  uint16_t head = words > EE_PROGRAM_WIDTH / 4 ? EE_REC_HEAD : 0;
+
+  if (word == 0) {
+    return ((uint32_t)inst->key_base << 16) | inst->var_count;
+  }
+  if (word == words - 1) {
+    return ((uint32_t)EE_KEY_INDEX << 16) | EE_REC_DATA | head |
+           EE_SNAPSHOT_LEN(inst);
+  }
+  if (word > inst->var_count) {
+    return 0xFFFFFFFF;
+  }
+  if (inst->index[slot].offset == 0) {
+    return 0;
+  }
+  return ((uint32_t)inst->index[slot].delta << 16) |
+         (uint16_t)(inst->index[slot].offset + EE_SlotRecordSize(inst, slot) -
+                    4);
+}
+#endif
+
+/*!
+    \brief      后台维护，在空闲任务中调用：每次最多做 budget 步 Flash 操作
+                （复制一条记录、启用一页或擦除一页各算一步），
+                使前台写入不必等待整页复制和擦除
+                - 写出写回缓存中超过 EE_FLUSH_TIMEOUT_MS 的值（每项一步）
+                - 只剩一个空闲页且写入页剩余空间低于 EE_COMPACT_THRESHOLD：
+                  提前换页，开始回收
+                - 没有空闲页：继续回收最旧的页
+                - 擦除已回收的页，为下次换页备好空白页
+    \param[in]  inst: 实例
+    \param[in]  budget: 本次最多执行的步数
+    \param[out] none
+    \retval     状态
+      \arg        FLASH_COMPLETE: 没有待做的工作
+      \arg        MAINTENANCE_PENDING: 预算用完，仍有工作
+      \arg        NO_VALID_PAGE: 未初始化
+      \arg        其他: 错误码
+*/
+uint16_t EE_InstMaintenance(ee_instance_t* inst, uint16_t budget) {
+  uint16_t status;
+
+  EE_LOCK();
+  status = EE_MaintenanceLocked(inst, budget);
+  EE_UNLOCK();
+  return status;
+}
+
+/*!
+    \brief      同 EE_InstMaintenance，调用者已持有写锁
+*/
+static uint16_t EE_MaintenanceLocked(ee_instance_t* inst, uint16_t budget) {
+  uint16_t valid_page = EE_FindValidPage(inst);
+  uint16_t page, free_pages = 0;
+  uint16_t status;
+
+  if (valid_page == NO_VALID_PAGE) {
+    return NO_VALID_PAGE;
+  }
+#if EE_ASYNC_QUEUE
+  /* 回收会移动写指针，先完成异步写入 */
+  EE_AsyncDrain(inst);
+#endif
+#if EE_WRITE_BACK
+  /* 先写出超时的缓存，之后的回收再把它们计入 */
+  status = EE_CacheFlushExpired(inst, &budget);
+  if (status != FLASH_COMPLETE) {
+    return status;
+  }
+#endif
+  for (page = 0; page < inst->page_count; page++) {
+    if (!EE_IsLivePage(inst, page)) {
+      free_pages++;
+    }
+  }
+  if (free_pages == 1 && EE_FreeSpaceLocked(inst) < EE_COMPACT_THRESHOLD) {
+    if (budget == 0) {
+      return MAINTENANCE_PENDING;
+    }
+    budget--;
+    status = EE_PageTransfer(inst, 0, (void*)0, 0);
+    if (status != FLASH_COMPLETE) {
+      return status;
+    }
+  }
+  /* 空闲时间里直接擦除，省去回收标记 */
+  status = EE_ReclaimPages(inst, &budget, 1);
+  if (status != FLASH_COMPLETE) {
+    return status;
+  }
+  for (page = 0; page < inst->page_count; page++) {
+    if (!inst->page_retired[page]) {
+      continue;
+    }
+    if (budget == 0) {
+      return MAINTENANCE_PENDING;
+    }
+    budget--;
+    status = EE_FlashErase(inst, EE_INST_PAGE(inst, page));
+    if (status != FLASH_COMPLETE) {
+      return status;
+    }
+  }
+  return FLASH_COMPLETE;
+}
+
+/*!
+   \brief      所有页都在使用中时回收最旧的页：只把其中仍是最新的记录复制到
+                写入页，然后擦除或标记为已回收，保证下次换页时总有一个空闲页。
+                进度保存在 reclaim_slot 中，可分多次完成；
+                中途掉电后 EE_Init 从头检查最旧页，已复制的记录不再指向它
+   \param[in]  budget: 本次最多执行的步数（复制一条记录或回收一页），
+                EE_RECLAIM_ALL 表示一次完成
+   \param[in]  erase_now: 1: 立即擦除 0: 只标记为已回收，留待 EE_Maintenance 擦除
+   \param[out] budget: 剩余步数
+   \param[out] none
+   \retval     成功或错误状态:
+     \arg        FLASH_COMPLETE: 回收完成或不需要回收
+     \arg        MAINTENANCE_PENDING: 预算用完，回收尚未完成
+     \arg        PAGE_FULL: 写入页放不下
+     \arg        Flash error code: 写Flash的错误码
+*/
+static uint16_t EE_ReclaimPages(ee_instance_t* inst, uint16_t* budget,
+                                uint8_t erase_now) {
+  uint16_t valid_page, oldest_page, slot;
+  uint16_t flash_status;
+  uint32_t src_start;
+
+  valid_page = EE_FindValidPage(inst);
+  while (valid_page != NO_VALID_PAGE &&
+         EE_FindFreePage(inst, valid_page) == NO_VALID_PAGE) {
+    oldest_page = EE_FindOldestPage(inst);
+    if (oldest_page == valid_page) {
+      return PAGE_FULL;
+    }
+    src_start = EE_INST_PAGE(inst, oldest_page);
+    EE_ReclaimScan(inst, oldest_page);
+    for (; inst->reclaim_slot < inst->var_count; inst->reclaim_slot++) {
+      slot = inst->reclaim_slot;
+      if (!(inst->reclaim_map[slot / 8] & (1 << (slot % 8)))) {
+        if (inst->reclaim_map[slot / 8] == 0) {
+          inst->reclaim_slot |= 7; /* 整个字节都不用复制 */
+        }
+        continue;
+      }
+      if (*budget == 0) {
+        return MAINTENANCE_PENDING;
+      }
+      (*budget)--;
+      flash_status = EE_CopyRecord(inst, inst->reclaim_slot, valid_page);
+      if (flash_status != FLASH_COMPLETE) {
+        return flash_status;
+      }
+      EE_STAT_ADD(inst, copies, 1);
+#if EE_STATS
+      inst->stats_copies++;
+#endif
+    }
+    if (*budget == 0) {
+      return MAINTENANCE_PENDING;
+    }
+    (*budget)--;
+    flash_status =
+        erase_now ? EE_FlashErase(inst, src_start)
+                  : EE_RetirePage(inst, oldest_page);
+    if (flash_status != FLASH_COMPLETE) {
+      return flash_status;
+    }
+    inst->reclaim_slot = 0;
+#if EE_STATS
+    inst->stats.reclaims++;
+    if (inst->stats_copies > inst->stats.copies_max) {
+      inst->stats.copies_max = inst->stats_copies;
+    }
+    inst->stats_copies = 0;
+#endif
+  }
+  return FLASH_COMPLETE;
+}
+
+/*!
+   \brief      把记录已全部迁出的页标记为已回收，留待 EE_Maintenance 擦除
+   \param[in]  page: 页编号
+   \param[out] none
+   \retval     FLASH_COMPLETE 或错误码
+*/
+static uint16_t EE_RetirePage(ee_instance_t* inst, uint16_t page) {
+  uint32_t page_addr = EE_INST_PAGE(inst, page);
+  uint32_t mark = EE_PAGE_RETIRED;
+  uint16_t flash_status;
+
+  if (!EE_IsBlank(page_addr + EE_PROGRAM_WIDTH, EE_PROGRAM_WIDTH)) {
+    /* 旧版格式的页，第二个字已写过，不能再编程：直接擦除 */
+    return EE_FlashErase(inst, page_addr);
+  }
+  flash_status =
+      EE_FlashWrite(inst, page_addr + EE_PROGRAM_WIDTH, &mark, sizeof(mark));
+  EE_UpdatePageStatus(inst, page_addr, flash_status, inst->page_seq[page], 1);
+  return flash_status;
+}
+
+/*!
+   \brief      未完成的回收需要在写入页保留的字节数：还需复制的记录加 EE_RECLAIM_SLACK
+   \param[in]  none
+   \param[out] none
+   \retval     字节数，没有待回收的页时为 0
+*/
+static uint32_t EE_ReclaimBytes(ee_instance_t* inst) {
+  uint16_t valid_page = EE_FindValidPage(inst);
+  uint16_t oldest_page;
+
+  if (valid_page == NO_VALID_PAGE ||
+      EE_FindFreePage(inst, valid_page) != NO_VALID_PAGE) {
+    return 0;
+  }
+  oldest_page = EE_FindOldestPage(inst);
+  if (oldest_page == valid_page) {
+    return 0;
+  }
+  EE_ReclaimScan(inst, oldest_page);
+  return EE_RECLAIM_SLACK + inst->reclaim_bytes;
+}
+
+/*!
+   \brief      开始回收一页时建立回收位图：标出最新记录在该页中的变量并累计其字节数。
+                之后只随索引更新（EE_ReclaimDrop）维护，每次写入计算保留空间时
+                不必再遍历所有变量
+   \param[in]  page: 最旧页
+   \param[out] none
+   \retval     none
+*/
+static void EE_ReclaimScan(ee_instance_t* inst, uint16_t page) {
+  uint32_t src_start = EE_INST_PAGE(inst, page);
+  uint32_t read_addr;
+  uint16_t slot;
+
+  if (inst->reclaim_page == page &&
+      inst->reclaim_seq == inst->page_seq[page]) {
+    return;
+  }
+  memset(inst->reclaim_map, 0, sizeof(inst->reclaim_map));
+  inst->reclaim_bytes = 0;
+  for (slot = inst->reclaim_slot; slot < inst->var_count; slot++) {
+    read_addr = inst->start + inst->index[slot].offset;
+    if (inst->index[slot].offset != 0 && read_addr >= src_start &&
+        read_addr < src_start + PAGE_SIZE) {
+      inst->reclaim_map[slot / 8] |= (uint8_t)(1 << (slot % 8));
+      inst->reclaim_bytes += EE_SlotRecordSize(inst, slot);
+    }
+  }
+  inst->reclaim_page = page;
+  inst->reclaim_seq = inst->page_seq[page];
+}
+
+/*!
+   \brief      变量的最新记录即将改变位置（复制到写入页或写入了新值），
+                不再需要从最旧页复制，在修改索引之前调用
+   \param[in]  slot: 变量下标
+   \param[out] none
+   \retval     none
+*/
+static void EE_ReclaimDrop(ee_instance_t* inst, uint16_t slot) {
+  if (inst->reclaim_map[slot / 8] & (1 << (slot % 8))) {
+    inst->reclaim_map[slot / 8] &= (uint8_t)~(1 << (slot % 8));
+    inst->reclaim_bytes -= EE_SlotRecordSize(inst, slot);
+  }
+}
+
+/*!
+   \brief      把一个变量的最新记录（数据 + 尾字）按编程单元复制到 dst_page 的
+                写指针处，不经过整条记录的 RAM 缓冲；有差分的变量合并后写入，
+                大变量逐块复制
+   \param[in]  slot: 变量下标
+   \param[in]  dst_page: 目标页
+   \param[out] none
+   \retval     成功或错误状态:
+     \arg        FLASH_COMPLETE: 成功
+     \arg        PAGE_FULL: 目标页放不下
+     \arg        Flash error code: 写Flash的错误码
+*/
+static uint16_t EE_CopyRecord(ee_instance_t* inst, uint16_t slot,
+                              uint16_t dst_page) {
+  uint32_t dst_end = EE_INST_PAGE(inst, dst_page + 1);
+  uint32_t write_addr = EE_GetWriteHead(inst, dst_page);
+  uint32_t read_addr = inst->start + inst->index[slot].offset;
+  uint32_t rec_size = EE_SlotRecordSize(inst, slot);
+  uint32_t unit[EE_PROGRAM_WIDTH / 4];
+  uint32_t i, n, head;
+  uint16_t flash_status;
+
+  if (dst_end - write_addr < rec_size) {
+    return PAGE_FULL;
+  }
+  if (EE_LARGE(inst, slot)) {
+    return EE_CopyChunks(inst, slot, write_addr);
+  }
+  if (inst->index[slot].delta != 0) {
+    return EE_FoldRecord(inst, slot, write_addr);
+  }
+  /* 与 EE_ProgramRecord 相同，从第二个单元写起，第一个单元最后写 */
+  head = rec_size > EE_PROGRAM_WIDTH && !EE_IsBlank(read_addr, EE_PROGRAM_WIDTH)
+             ? EE_REC_HEAD
+             : 0;
+  for (n = 1; n <= rec_size / EE_PROGRAM_WIDTH; n++) {
+    i = n * EE_PROGRAM_WIDTH % rec_size;
+    EE_FlashRead(inst, read_addr + i, unit, sizeof(unit));
+    if (i + EE_PROGRAM_WIDTH == rec_size && !inst->index[slot].packed) {
+      /* 尾字重新生成，批量记录复制后即为普通记录 */
+      unit[EE_PROGRAM_WIDTH / 4 - 1] =
+          ((uint32_t)EE_KEY(inst, slot) << 16) | head | inst->index[slot].len;
+    }
+    flash_status = EE_FlashWrite(inst, write_addr + i, unit, sizeof(unit));
+    if (flash_status != FLASH_COMPLETE) {
+      inst->write_addr = 0;
+      return flash_status;
+    }
+  }
+  EE_SEQ_BEGIN(inst);
+  EE_ReclaimDrop(inst, slot);
+  inst->index[slot].offset = (uint16_t)(write_addr - inst->start);
+  EE_SEQ_END(inst);
+  inst->write_addr = write_addr + rec_size;
+  return FLASH_COMPLETE;
+}
+
+/*!
+   \brief      把有差分的变量合并为一条完整记录写到 write_addr，
+                格式与基准记录相同，占用空间不变
+   \param[in]  slot: 变量下标
+   \param[in]  write_addr: 写入地址，已确认放得下
+   \param[out] none
+   \retval     FLASH_COMPLETE 或写 Flash 错误码
+*/
+static uint16_t EE_FoldRecord(ee_instance_t* inst, uint16_t slot,
+                              uint32_t write_addr) {
+  uint8_t value[VARIABLE_MAX_SIZE];
+  uint16_t len = inst->index[slot].len;
+  uint16_t flash_status;
+
+  EE_FlashRead(inst, EE_SlotDataAddr(inst, slot), value, len);
+  EE_ApplyDelta(inst, slot, value, len);
+  if (inst->index[slot].packed) {
+    flash_status = EE_AppendPacked(inst, write_addr, slot, value, len);
+  } else {
+    flash_status = EE_AppendRecord(inst, write_addr, EE_KEY(inst, slot), value,
+                                   len, EE_REC_DATA);
+  }
+  if (flash_status != FLASH_COMPLETE) {
+    inst->write_addr = 0;
+    return flash_status;
+  }
+  inst->write_addr = write_addr + EE_SlotRecordSize(inst, slot);
+  EE_SEQ_BEGIN(inst);
+  EE_ReclaimDrop(inst, slot);
+  inst->index[slot].offset = (uint16_t)(write_addr - inst->start);
+  inst->index[slot].delta = 0;
+  EE_SEQ_END(inst);
+  return FLASH_COMPLETE;
+}
+
+/*!
+   \brief      把大变量的各块按编程单元复制到 write_addr（每块与 EE_ProgramRecord
+                相同，第一个单元最后写，尾字不变），最后写提交字；复制中途掉电时
+                没有提交字的块无效，旧值仍在原页
+   \param[in]  slot: 变量下标
+   \param[in]  write_addr: 写入地址，已确认放得下
+   \param[out] none
+   \retval     FLASH_COMPLETE 或写 Flash 错误码
+*/
+static uint16_t EE_CopyChunks(ee_instance_t* inst, uint16_t slot,
+                              uint32_t write_addr) {
+  uint32_t read_addr = inst->start + inst->index[slot].offset;
+  uint32_t span = EE_SlotRecordSize(inst, slot) - EE_PROGRAM_WIDTH;
+  uint32_t unit[EE_PROGRAM_WIDTH / 4];
+  uint32_t pos, rec_size, i, n;
+  uint16_t flash_status;
+
+  for (pos = 0; pos < span; pos += rec_size) {
+    rec_size = span - pos < EE_RECORD_SIZE(EE_CHUNK_SIZE)
+                   ? span - pos
+                   : EE_RECORD_SIZE(EE_CHUNK_SIZE);
+    for (n = 1; n <= rec_size / EE_PROGRAM_WIDTH; n++) {
+      i = pos + n * EE_PROGRAM_WIDTH % rec_size;
+      EE_FlashRead(inst, read_addr + i, unit, sizeof(unit));
+      flash_status = EE_FlashWrite(inst, write_addr + i, unit, sizeof(unit));
+      if (flash_status != FLASH_COMPLETE) {
+        inst->write_addr = 0;
+        return flash_status;
+      }
+    }
+  }
+  return EE_CommitChunks(inst, slot, write_addr, write_addr + span);
+}
+
+/*!
+   \brief      写入页尾部有不完整的记录时，在写指针处写一个填充字跳过它，
+                之后可以继续在该页追加
+   \param[in]  page: 写入页
+   \param[in]  skip: 不完整部分的字节数
+   \param[out] none
+   \retval     FLASH_COMPLETE 或写 Flash 错误码
+*/
+static uint16_t EE_PadTail(ee_instance_t* inst, uint16_t page, uint32_t skip) {
+  uint32_t write_addr = EE_GetWriteHead(inst, page);
+  uint32_t pad;
+  uint16_t flash_status;
+
+  if (EE_INST_PAGE(inst, page + 1) - write_addr < EE_PROGRAM_WIDTH) {
+    /* 页已写满，不会再追加 */
+    return FLASH_COMPLETE;
+  }
+  pad = ((uint32_t)EE_KEY_PAD << 16) | ((skip + EE_PROGRAM_WIDTH) / 4);
+  flash_status = EE_WriteTrailer(inst, write_addr, pad);
+  if (flash_status != FLASH_COMPLETE) {
+    inst->write_addr = 0;
+    return flash_status;
+  }
+  inst->write_addr = write_addr + EE_PROGRAM_WIDTH;
+  return FLASH_COMPLETE;
+}
+
+/*!
+    \brief      Flash 操作后更新页状态缓存，操作失败时从 Flash 重新读取页头
+    \param[in]  addr: 页内任意地址
+    \param[in]  flash_status: 操作结果
+    \param[in]  seq: 操作成功后的页序号
+    \param[in]  retired: 操作成功后是否为已回收
+    \param[out] none
+    \retval     none
+*/
+static void EE_UpdatePageStatus(ee_instance_t* inst, uint32_t addr,
+                                uint16_t flash_status, uint32_t seq,
+                                uint8_t retired) {
+  uint16_t page = (uint16_t)((addr - inst->start) / PAGE_SIZE);
+  uint32_t header[2];
+  if (page >= inst->page_count) {
+    return;
+  }
+  if (flash_status != FLASH_COMPLETE) {
+    EE_FlashRead(inst, EE_INST_PAGE(inst, page), header, sizeof(header));
+    seq = header[0];
+    retired = header[1] == EE_PAGE_RETIRED;
+  }
+  /* 不加锁的读取方据此查找写入页 */
+  EE_SEQ_BEGIN(inst);
+  inst->page_seq[page] = seq;
+  inst->page_retired[page] = retired;
+  EE_SEQ_END(inst);
+}
+
+/*!
+    \brief      检查实例配置：页数和地址范围、变量个数和字节数（大变量的两份值连同
+                回收保留空间和索引快照须能放进一页），虚拟地址不能是
+                0xFFFF、0xFFFE、0xFFFD，取反后（紧凑记录）也不能落在表中或上述值上
+    \param[in]  inst: 实例
+    \param[out] none
+    \retval     FLASH_COMPLETE 或 INSTANCE_INVALID
+*/
+static uint16_t EE_CheckInstance(ee_instance_t* inst) {
+  uint32_t first = (uint32_t)inst->key_base + 1;
+  uint32_t last = first + inst->var_count - 1;
+  uint32_t reserve = EE_RECLAIM_SLACK;
+  uint16_t slot;
+
+  if (inst->page_count < 2 || inst->page_count > EE_MAX_PAGE_COUNT ||
+      (uint32_t)inst->page_count * PAGE_SIZE > 0x10000 ||
+      inst->start % PAGE_SIZE != 0) {
+    return INSTANCE_INVALID;
+  }
+  if (inst->var_count == 0 || inst->var_count > EE_MAX_VAR_COUNT) {
+    return INSTANCE_INVALID;
+  }
+  if (inst->var_key == (void*)0 &&
+      (first < 3 || last >= 0xFFFD ||
+       ((uint16_t)~last <= last && (uint16_t)~first >= first))) {
+    return INSTANCE_INVALID;
+  }
+#if EE_BOOT_SNAPSHOT
+  /* 与 EE_WriteSnapshot 相同，太大的快照不写 */
+  if (EE_RECORD_SIZE(EE_SNAPSHOT_LEN(inst)) <= PAGE_SIZE / 4) {
+    reserve += EE_RECORD_SIZE(EE_SNAPSHOT_LEN(inst));
+  }
+#endif
+  for (slot = 0; slot < inst->var_count; slot++) {
+    if (inst->var_size[slot] > EE_LARGE_MAX_SIZE) {
+      return INSTANCE_INVALID;
+    }
+    if (EE_LARGE(inst, slot) &&
+        2 * EE_CHUNKED_SIZE(inst->var_size[slot]) + reserve >
+            PAGE_SIZE - EE_PAGE_HEADER_SIZE) {
+      return INSTANCE_INVALID;
+    }
+  }
+  return EE_BuildDirectory(inst);
+}
+
+/*!
+    \brief      虚拟地址不按顺序分配时建立散列目录（开放寻址、线性探测，
+                项数不少于变量个数的 2 倍），同时检查各虚拟地址：不是保留值、
+                不重复、取反后（紧凑记录）不落在表中
+    \param[in]  inst: 实例
+    \param[out] none
+    \retval     FLASH_COMPLETE 或 INSTANCE_INVALID
+*/
+static uint16_t EE_BuildDirectory(ee_instance_t* inst) {
+  uint32_t size = (uint32_t)inst->dir_mask + 1;
+  uint16_t slot, key, h;
+
+  if (inst->var_key == (void*)0) {
+    return FLASH_COMPLETE;
+  }
+  if (inst->dir == (void*)0 || (size & (size - 1)) != 0 ||
+      size < 2 * (uint32_t)inst->var_count) {
+    return INSTANCE_INVALID;
+  }
+  memset(inst->dir, 0xFF, size * sizeof(inst->dir[0]));
+  for (slot = 0; slot < inst->var_count; slot++) {
+    key = inst->var_key[slot];
+    if (key < 3 || key >= 0xFFFD || EE_FindSlot(inst, key) < inst->var_count) {
+      return INSTANCE_INVALID;
+    }
+    h = EE_DIR_HASH(key) & inst->dir_mask;
+    while (inst->dir[h] != EE_DIR_EMPTY) {
+      h = (h + 1) & inst->dir_mask;
+    }
+    inst->dir[h] = slot;
+  }
+  for (slot = 0; slot < inst->var_count; slot++) {
+    if (EE_FindSlot(inst, (uint16_t)~inst->var_key[slot]) < inst->var_count) {
+      return INSTANCE_INVALID;
+    }
+  }
+  return FLASH_COMPLETE;
+}
+
+/*!
+    \brief      查找虚拟地址在变量表中的下标
+    \param[in]  virt_addr: 虚拟地址
+    \param[out] none
+    \retval     下标，var_count 表示不在表中
+*/
+static uint16_t EE_FindSlot(ee_instance_t* inst, uint16_t virt_addr) {
+  uint16_t slot, h;
+
+  EE_STAT_ADD(inst, lookups, 1);
+  if (inst->var_key == (void*)0) {
+    /* 变量表按顺序分配虚拟地址，下标可直接算出 */
+    slot = (uint16_t)(virt_addr - inst->key_base - 1);
+    return slot < inst->var_count ? slot : inst->var_count;
+  }
+  /* 目录至少一半为空项，探测很快结束 */
+  for (h = EE_DIR_HASH(virt_addr) & inst->dir_mask;;
+       h = (h + 1) & inst->dir_mask) {
+    slot = inst->dir[h];
+    EE_STAT_ADD(inst, probes, 1);
+    if (slot == EE_DIR_EMPTY || inst->var_key[slot] == virt_addr) {
+      return slot == EE_DIR_EMPTY ? inst->var_count : slot;
+    }
+  }
+}
+
+/*!
+    \brief      数据能否写成紧凑记录
+    \param[in]  slot: 变量下标
+    \param[in]  data: 数据
+    \param[in]  size: 字节数
+    \param[out] none
+    \retval     1: 能 0: 不能
+*/
+static uint8_t EE_CanPack(ee_instance_t* inst, uint16_t slot, const void* data,
+                          uint16_t size) {
+#if EE_PACKED_RECORDS
+  if (size > EE_PACKED_MAX) {
+    return 0;
+  }
+  if (inst->var_size[slot] != 0) {
+    return 1;
+  }
+  /* 变长变量：第二字节为 0xFF 的 2 字节值与 1 字节值的编码冲突 */
+  return size == 1 || (size == 2 && ((const uint8_t*)data)[1] != 0xFF);
+#else
+  (void)inst;
+  (void)slot;
+  (void)data;
+  (void)size;
+  return 0;
+#endif
+}
+
+/*!
+    \brief      判断尾字是否属于紧凑记录
+    \param[in]  trailer: 尾字
+    \param[out] none
+    \retval     紧凑记录中数据的字节数，0 表示不是紧凑记录
+*/
+static uint16_t EE_PackedLen(ee_instance_t* inst, uint32_t trailer) {
+#if EE_PACKED_RECORDS
+  uint16_t slot = EE_FindSlot(inst, (uint16_t)~(trailer >> 16));
+
+  if (slot < inst->var_count) {
+    if (inst->var_size[slot] == 0) {
+      return (trailer & 0xFF00) == 0xFF00 ? 1 : 2;
+    }
+    /* 定长变量不可能写成的形式：放不进一个单元，或 1 字节值的第二字节不是 0xFF */
+    if (inst->var_size[slot] > EE_PACKED_MAX ||
+        (inst->var_size[slot] == 1 && (trailer & 0xFF00) != 0xFF00)) {
+      return 0;
+    }
+    return inst->var_size[slot];
+  }
+#else
+  (void)inst;
+  (void)trailer;
+#endif
+  return 0;
+}
+
+/*!
+    \brief      变量最新记录在 Flash 中占用的字节数
+    \param[in]  slot: 变量下标
+    \param[out] none
+    \retval     字节数
+*/
+static uint32_t EE_SlotRecordSize(ee_instance_t* inst, uint16_t slot) {
+  if (EE_LARGE(inst, slot)) {
+    return EE_CHUNKED_SIZE(inst->index[slot].len);
+  }
+  return inst->index[slot].packed ? EE_PROGRAM_WIDTH
+                                  : EE_RECORD_SIZE(inst->index[slot].len);
+}
+
+/*!
+    \brief      变量最新记录中数据的地址，紧凑记录的数据紧靠记录末尾的 2 字节地址
+    \param[in]  slot: 变量下标
+    \param[out] none
+    \retval     绝对地址
+*/
+static uint32_t EE_SlotDataAddr(ee_instance_t* inst, uint16_t slot) {
+  uint32_t addr = inst->start + inst->index[slot].offset;
+  uint16_t len = inst->index[slot].len;
+
+  if (inst->index[slot].packed) {
+    addr += EE_PROGRAM_WIDTH - 2 - EE_PACKED_FIELD(len);
+  }
+  return addr;
+}
+
+/*!
+    \brief      读取变量最新记录中从 pos 起的数据（不套用差分）
+    \param[in]  slot: 变量下标
+    \param[in]  pos: 起始字节
+    \param[in]  size: 字节数
+    \param[out] data: 接收数据的缓冲区
+    \retval     none
+*/
+static void EE_ReadData(ee_instance_t* inst, uint16_t slot, uint16_t pos,
+                        void* data, uint16_t size) {
+  if (EE_LARGE(inst, slot)) {
+    EE_ReadChunks(inst, inst->start + inst->index[slot].offset, pos, data,
+                  size);
+  } else {
+    EE_FlashRead(inst, EE_SlotDataAddr(inst, slot) + pos, data, size);
+  }
+}
+
+/*!
+    \brief      读取分块存放的大变量中从 pos 起的数据，跨过各块的尾字
+    \param[in]  addr: 第一块的地址
+    \param[in]  pos: 起始字节
+    \param[in]  size: 字节数
+    \param[out] data: 接收数据的缓冲区
+    \retval     none
+*/
+static void EE_ReadChunks(ee_instance_t* inst, uint32_t addr, uint16_t pos,
+                          void* data, uint16_t size) {
+  uint8_t* p_data = (uint8_t*)data;
+  uint16_t n;
+
+  while (size > 0) {
+    n = EE_CHUNK_SIZE - pos % EE_CHUNK_SIZE;
+    n = n > size ? size : n;
+    EE_FlashRead(inst,
+                 addr + pos / EE_CHUNK_SIZE * EE_RECORD_SIZE(EE_CHUNK_SIZE) +
+                     pos % EE_CHUNK_SIZE,
+                 p_data, n);
+    pos += n;
+    p_data += n;
+    size -= n;
+  }
+}
+
+/*!
+    \brief      由提交字覆盖的字节数和最后一块的尾字得到大变量的字节数
+    \param[in]  span: 提交字覆盖的字节数
+    \param[in]  trailer: 最后一块的尾字
+    \param[out] none
+    \retval     字节数，0 表示各块的长度不符
+*/
+static uint16_t EE_ChunkedLen(uint32_t span, uint32_t trailer) {
+  uint16_t last = (uint16_t)trailer & EE_REC_LEN_MASK;
+
+  if (span < EE_RECORD_SIZE(last) ||
+      (span - EE_RECORD_SIZE(last)) % EE_RECORD_SIZE(EE_CHUNK_SIZE) != 0) {
+    return 0;
+  }
+  return (uint16_t)((span - EE_RECORD_SIZE(last)) /
+                        EE_RECORD_SIZE(EE_CHUNK_SIZE) * EE_CHUNK_SIZE +
+                    last);
+}
+
+/*!
+    \brief      清空 RAM 索引
+*/
+static void EE_ClearIndex(ee_instance_t* inst) {
+  uint16_t slot;
+  for (slot = 0; slot < inst->var_count; slot++) {
+    inst->index[slot].offset = 0;
+    inst->index[slot].delta = 0;
+  }
+}
+
+/*!
+    \brief      从写指针往前扫描指定页，用每个变量在该页中的最新记录更新 RAM 索引
+                （后扫描的页覆盖先扫描的页）。最新记录是差分时继续往前找它的基准，
+                本页没有基准则沿用先扫描的页中的
+    \param[in]  page: 页编号，超出范围时不做任何操作
+    \param[out] none
+    \retval     页尾不完整记录的字节数（已跳过），0 表示页内记录完整
+*/
+static uint32_t EE_IndexPage(ee_instance_t* inst, uint16_t page) {
+  if (page >= inst->page_count) {
+    return 0;
+  }
+  uint8_t seen[(EE_MAX_VAR_COUNT + 7) / 8] = {0};  /* 已找到最新记录 */
+  uint8_t based[(EE_MAX_VAR_COUNT + 7) / 8] = {0}; /* 已找到基准（完整记录） */
+  uint32_t data_start = EE_INST_PAGE(inst, page) + EE_PAGE_HEADER_SIZE;
+  uint32_t head = EE_FindPageHead(inst, page);
+  uint32_t end;
+  uint32_t read_addr, trailer, rec_size, rec_start;
+  uint32_t batch_words = 0; /* 当前提交字尚未覆盖完的字数 */
+  uint16_t slot, len, packed_len, type;
+
+  /* 写入中途掉电时，从页尾往前找到能沿记录链完整回溯到页头的位置 */
+  end = EE_FindChainEnd(inst, data_start, head, 1);
+  if (end == 0) {
+    end = EE_FindChainEnd(inst, data_start, head, 0);
+  }
+
+  /* 从后往前查找，每个变量第一次出现的有效记录即最新记录 */
+  for (read_addr = end; read_addr > data_start; read_addr -= rec_size) {
+    trailer = EE_PortReadWord(read_addr - 4);
+    rec_size = EE_RecordSize(inst, trailer);
+    EE_STAT_ADD(inst, scan_words, 1);
+    if ((trailer >> 16) == EE_KEY_COMMIT) {
+      batch_words = (uint16_t)trailer;
+      continue;
+    }
+    if ((trailer >> 16) == EE_KEY_PAD) {
+      batch_words = 0;
+      continue;
+    }
+    packed_len = EE_PackedLen(inst, trailer);
+    type = packed_len != 0 ? EE_REC_DATA : (trailer & EE_REC_TYPE_MASK);
+    if (packed_len != 0) {
+      slot = EE_FindSlot(inst, (uint16_t)~(trailer >> 16));
+      len = packed_len;
+    } else if (((type != EE_REC_BATCH && type != EE_REC_CHUNK) ||
+                batch_words >= rec_size / 4) &&
+               !((trailer & EE_REC_HEAD) &&
+                 EE_IsBlank(read_addr - rec_size, EE_PROGRAM_WIDTH))) {
+      /* 批量记录和块只有被提交字覆盖时才有效；第一个单元没写完的记录无效 */
+      slot = EE_FindSlot(inst, (uint16_t)(trailer >> 16));
+      len = (uint16_t)(trailer & EE_REC_LEN_MASK);
+    } else {
+      slot = inst->var_count;
+      len = 0;
+    }
+    rec_start = read_addr - rec_size;
+    if (type == EE_REC_CHUNK && slot < inst->var_count) {
+      /* 往前先遇到的是最后一块，整个值从提交字覆盖的第一个字开始；
+         长度与变量表不符的不承认 */
+      rec_start = read_addr - batch_words * 4;
+      len = EE_ChunkedLen(batch_words * 4, trailer);
+      if (!EE_LARGE(inst, slot) || len != inst->var_size[slot]) {
+        slot = inst->var_count;
+      }
+    }
+    if (slot < inst->var_count && !(based[slot / 8] & (1 << (slot % 8)))) {
+      if (type == EE_REC_DELTA) {
+        /* 只有最新的差分有效，更早的差分已被它包含 */
+        if (!(seen[slot / 8] & (1 << (slot % 8)))) {
+          inst->index[slot].delta = (uint16_t)(read_addr - 4 - inst->start);
         }
-        flash_status = BaseWrite(write_addr + word_size * 4, &temp_data,
-                                 sizeof(temp_data));
-        return flash_status;
       } else {
-        return PAGE_FULL;
+        if (!(seen[slot / 8] & (1 << (slot % 8)))) {
+          inst->index[slot].delta = 0;
+        }
+        based[slot / 8] |= (uint8_t)(1 << (slot % 8));
+        inst->index[slot].offset = (uint16_t)(rec_start - inst->start);
+        inst->index[slot].len = len;
+        inst->index[slot].packed = packed_len != 0;
       }
-    } else {
-      write_addr -= 4;
+      seen[slot / 8] |= (uint8_t)(1 << (slot % 8));
     }
+    batch_words = batch_words > rec_size / 4 ? batch_words - rec_size / 4 : 0;
   }
 
-  return PAGE_FULL;
+  return head - end;
 }
 
 /*!
-   \brief      将最新的数据从已满页传输到另一页
-   \param[in]  virt_addr: 新写入的变量虚拟地址
-   \param[in]  size: 字节数
-   \param[in]  data: 数据地址
-   \param[out] none
-   \retval     成功或错误状态:
-     \arg        FLASH_COMPLETE: 成功
-     \arg        PAGE_FULL: 页满
-     \arg        NO_VALID_PAGE: 没有找到可用页
-     \arg        Flash error code: 写Flash的错误码
+    \brief      按序号从旧到新扫描所有已启用的页建立 RAM 索引
+    \param[in]  none
+    \param[out] none
+    \retval     写入页尾部不完整记录的字节数，0 表示完整
 */
-static uint16_t EE_PageTransfer(uint16_t virt_addr, void* data, uint16_t size) {
-  uint16_t flash_status;
-  uint32_t new_page_addr, old_page_addr;
-  uint16_t valid_page, var_idx;
-  uint16_t eeprom_status, read_status;
-  uint16_t byte_read;
-
-  valid_page = EE_FindValidPage(READ_FROM_VALID_PAGE);
-
-  if (valid_page == PAGE1) {
-    new_page_addr = PAGE0_BASE_ADDRESS;
-    old_page_addr = PAGE1_BASE_ADDRESS;
-  } else if (valid_page == PAGE0) {
-    new_page_addr = PAGE1_BASE_ADDRESS;
-    old_page_addr = PAGE0_BASE_ADDRESS;
-  } else {
-    return NO_VALID_PAGE;
-  }
+static uint32_t EE_IndexPages(ee_instance_t* inst) {
+  uint16_t page, next, count;
+  uint32_t torn = 0;
 
-  flash_status = EE_Mark(new_page_addr, RECEIVE_DATA);
-  if (flash_status != FLASH_COMPLETE) {
-    return flash_status;
+  EE_ClearIndex(inst);
+  /* 写入页开头有索引快照时，之前各页的索引由快照给出，只需扫描写入页 */
+  page = EE_FindValidPage(inst);
+  if (page != NO_VALID_PAGE && EE_LoadSnapshot(inst, page)) {
+    return EE_IndexPage(inst, page);
+  }
+  /* 每次取序号（相同时取编号）大于上一页的最小者，页数不多，不必排序 */
+  page = EE_FindOldestPage(inst);
+  for (count = 0; page != NO_VALID_PAGE && count < inst->page_count; count++) {
+    torn = EE_IndexPage(inst, page);
+    next = NO_VALID_PAGE;
+    for (uint16_t i = 0; i < inst->page_count; i++) {
+      if (!EE_IsLivePage(inst, i) || inst->page_seq[i] < inst->page_seq[page] ||
+          (inst->page_seq[i] == inst->page_seq[page] && i <= page)) {
+        continue;
+      }
+      if (next == NO_VALID_PAGE || inst->page_seq[i] < inst->page_seq[next] ||
+          (inst->page_seq[i] == inst->page_seq[next] && i < next)) {
+        next = i;
+      }
+    }
+    page = next;
   }
+  /* 只有最后扫描的写入页会继续追加，其余页尾部不完整不影响 */
+  return torn;
+}
 
-  eeprom_status = EE_VerifyPageFullWriteVariable(virt_addr, data, size);
-  if (eeprom_status != FLASH_COMPLETE) {
-    return eeprom_status;
+/*!
+    \brief      由写入页开头的索引快照恢复 RAM 索引；快照引用的每条记录都检查尾字，
+                有不符时清空索引，由调用者逐页扫描。引用已回收页的项跳过，
+                这些记录回收时已复制到写入页
+    \param[in]  page: 写入页
+    \param[out] none
+    \retval     1: 已恢复 0: 没有可用的快照
+*/
+static uint8_t EE_LoadSnapshot(ee_instance_t* inst, uint16_t page) {
+  uint32_t data_start = EE_INST_PAGE(inst, page) + EE_PAGE_HEADER_SIZE;
+  uint32_t rec_size = EE_RECORD_SIZE(EE_SNAPSHOT_LEN(inst));
+  uint32_t entry, trailer, size, span;
+  uint16_t slot, base, delta, packed_len;
+
+  if (rec_size > PAGE_SIZE - EE_PAGE_HEADER_SIZE) {
+    return 0;
   }
-  /* 查找表中的每个虚拟地址 */
-  for (var_idx = 0; var_idx < NumbOfVar; var_idx++) {
-    /* 跳过新写入的虚拟地址 */
-    if (virt_addr_var_tab[var_idx] != virt_addr) {
-      read_status = EE_ReadVariable(virt_addr_var_tab[var_idx], &data_var,
-                                    VARIABLE_MAX_SIZE, &byte_read);
-      if (read_status != 0x1) {
-        eeprom_status = EE_VerifyPageFullWriteVariable(
-            virt_addr_var_tab[var_idx], data_var, byte_read);
-        if (eeprom_status != FLASH_COMPLETE) {
-          return eeprom_status;
-        }
+  trailer = EE_PortReadWord(data_start + rec_size - 4);
+  /* 长度不符说明变量表已改变；第一个字不符说明快照没有写完 */
+  if ((uint16_t)(trailer >> 16) != EE_KEY_INDEX ||
+      (trailer & (EE_REC_TYPE_MASK | EE_REC_LEN_MASK)) !=
+          (EE_REC_DATA | EE_SNAPSHOT_LEN(inst)) ||
+      EE_PortReadWord(data_start) !=
+          (((uint32_t)inst->key_base << 16) | inst->var_count)) {
+    return 0;
+  }
+  for (slot = 0; slot < inst->var_count; slot++) {
+    entry = EE_PortReadWord(data_start + 4 + 4 * (uint32_t)slot);
+    base = (uint16_t)entry;
+    delta = (uint16_t)(entry >> 16);
+    if (entry == 0) {
+      continue;
+    }
+    if (base % 4 != 0 || base >= inst->page_count * PAGE_SIZE ||
+        delta % 4 != 0 || delta >= inst->page_count * PAGE_SIZE) {
+      break;
+    }
+    /* 写快照之后回收的页：回收时最新记录已复制到写入页，扫描写入页即可得到 */
+    if (!EE_IsLivePage(inst, (uint16_t)(base / PAGE_SIZE)) ||
+        (delta != 0 && !EE_IsLivePage(inst, (uint16_t)(delta / PAGE_SIZE)))) {
+      continue;
+    }
+    trailer = EE_PortReadWord(inst->start + base);
+    if (EE_LARGE(inst, slot)) {
+      /* 大变量的快照项指向提交字，提交字之前是最后一块 */
+      span = (uint32_t)(uint16_t)trailer * 4;
+      if ((uint16_t)(trailer >> 16) != EE_KEY_COMMIT || delta != 0 ||
+          span == 0 || span + EE_PROGRAM_WIDTH > (uint32_t)base + 4) {
+        break;
+      }
+      trailer = EE_PortReadWord(inst->start + base - EE_PROGRAM_WIDTH);
+      if ((uint16_t)(trailer >> 16) != EE_KEY(inst, slot) ||
+          (trailer & EE_REC_TYPE_MASK) != EE_REC_CHUNK ||
+          EE_RecordSize(inst, trailer) == 0 ||
+          EE_ChunkedLen(span, trailer) != inst->var_size[slot]) {
+        break;
+      }
+      inst->index[slot].offset =
+          (uint16_t)(base + 4 - EE_PROGRAM_WIDTH - span);
+      inst->index[slot].len = inst->var_size[slot];
+      inst->index[slot].packed = 0;
+      continue;
+    }
+    size = EE_RecordSize(inst, trailer);
+    packed_len = EE_PackedLen(inst, trailer);
+    if (size == 0 || size > (uint32_t)base + 4 ||
+        (packed_len != 0
+             ? (uint16_t)~(trailer >> 16) != EE_KEY(inst, slot)
+             : (uint16_t)(trailer >> 16) != EE_KEY(inst, slot) ||
+                   (trailer & EE_REC_TYPE_MASK) == EE_REC_DELTA)) {
+      break;
+    }
+    inst->index[slot].offset = (uint16_t)(base + 4 - size);
+    inst->index[slot].len =
+        packed_len != 0 ? packed_len : (trailer & EE_REC_LEN_MASK);
+    inst->index[slot].packed = packed_len != 0;
+    if (delta != 0) {
+      trailer = EE_PortReadWord(inst->start + delta);
+      if ((uint16_t)(trailer >> 16) != EE_KEY(inst, slot) ||
+          (trailer & EE_REC_TYPE_MASK) != EE_REC_DELTA ||
+          EE_RecordSize(inst, trailer) == 0) {
+        break;
       }
+      inst->index[slot].delta = delta;
     }
   }
-  /* 擦除旧页，标记为 ERASED */
-  flash_status = BaseErase(old_page_addr);
-  if (flash_status != FLASH_COMPLETE) {
-    return flash_status;
+  if (slot < inst->var_count) {
+    EE_ClearIndex(inst);
+    return 0;
   }
-  /* 标记新页为 VALID_PAGE */
-  flash_status = EE_Mark(new_page_addr, VALID_PAGE);
-  if (flash_status != FLASH_COMPLETE) {
-    return flash_status;
+  return 1;
+}
+
+/*!
+    \brief      由尾字得到整条记录占用的字节数
+    \param[in]  trailer: 尾字
+    \param[out] none
+    \retval     记录字节数，0 表示不是合法的尾字
+*/
+static uint32_t EE_RecordSize(ee_instance_t* inst, uint32_t trailer) {
+  uint16_t key = (uint16_t)(trailer >> 16);
+  uint16_t type = (uint16_t)trailer & EE_REC_TYPE_MASK;
+  uint16_t len = (uint16_t)trailer & EE_REC_LEN_MASK;
+  uint16_t packed_len;
+  uint8_t in_table;
+
+  if (key == EE_KEY_COMMIT) {
+    return EE_PROGRAM_WIDTH;
+  }
+  if (key == EE_KEY_PAD) {
+    return (uint32_t)(uint16_t)trailer * 4;
+  }
+  if (key == EE_KEY_INDEX) {
+    /* 变量表改变后旧快照的长度与当前的不同，仍需能越过 */
+    return type == EE_REC_DATA && len > 4 && len % 4 == 0
+               ? EE_RECORD_SIZE(len)
+               : 0;
+  }
+  packed_len = EE_PackedLen(inst, trailer);
+  if (packed_len != 0) {
+    return EE_PROGRAM_WIDTH;
   }
+  in_table = EE_FindSlot(inst, key) < inst->var_count;
+#if EE_PACKED_RECORDS
+  if (!in_table && EE_RemovedKey(inst, (uint16_t)~key)) {
+    return EE_PROGRAM_WIDTH;
+  }
+#endif
+  /* 只承认表中的虚拟地址：数据字的低 16 位很容易形如合法的类型和长度，
+     若不限定地址，很容易被误认成尾字 */
+  if ((type != EE_REC_DATA && type != EE_REC_BATCH && type != EE_REC_DELTA &&
+       type != EE_REC_CHUNK) ||
+      len == 0 || len > VARIABLE_MAX_SIZE ||
+      (!in_table && !EE_RemovedKey(inst, key))) {
+    return 0;
+  }
+  return EE_RECORD_SIZE(len);
+}
 
-  return flash_status;
+/*!
+    \brief      虚拟地址是否属于从按顺序分配的表尾删去的变量（表尾之后
+                EE_REMOVED_KEYS 个地址）：这些记录仍按长度越过，建立索引时忽略，
+                回收时不复制
+    \param[in]  key: 虚拟地址
+    \param[out] none
+    \retval     1: 是 0: 不是
+*/
+static uint8_t EE_RemovedKey(ee_instance_t* inst, uint16_t key) {
+  uint32_t last = (uint32_t)inst->key_base + inst->var_count;
+
+  return inst->var_key == (void*)0 && key > last && key <= 0xFFFC &&
+         key - last <= EE_REMOVED_KEYS;
 }
 
 /*!
-    \brief      写指定标记到指定页数
-    \param[in]  addr: 绝对地址
-    \param[in]  mk:
-      \arg        ERASED: FFFF FFFF FFFF FFFF
-      \arg        RECEIVE_DATA: EEEE EEEE FFFF FFFF
-      \arg        VALID_PAGE: EEEE EEEE 0000 0000
+    \brief      从 head 往前找记录链的结尾：沿记录链能恰好回到页数据起始处的最大位置
+                多个编程单元的记录最后写第一个单元，掉电留下的不完整记录总是从一个
+                空白单元开始。不完整部分的数据碰巧形如尾字、记录链由此越过它回到
+                之前某条记录的结尾时，该位置之后不是空白单元，strict 时不承认
+    \param[in]  data_start: 页头之后第一个地址
+    \param[in]  head: 页内第一个未使用的地址
+    \param[in]  strict: 1: 只承认 head 或其后为空白单元的位置 0: 不检查
     \param[out] none
-    \retval     FLASH状态
-      \arg        FLASH_COMPLETE: 成功
-      \arg        其他: 错误码
+    \retval     记录链的结尾，strict 时没有找到返回 0
 */
-uint16_t EE_Mark(uint32_t addr, uint64_t mk) {
-  uint32_t temp;
-  uint16_t flash_status;
-  if (mk == ERASED) { /* 擦除状态 */
-    return FLASH_COMPLETE;
-  } else if (mk == RECEIVE_DATA) { /* 接收状态 */
-    temp = 0xEEEEEEEE;
-    return BaseWrite(addr + 4, &temp, sizeof(temp));
-  } else if (mk == VALID_PAGE) { /* 可用状态 */
-    /* 读出页第二个字的数据 */
-    BaseRead(addr + 4, &temp, sizeof(temp));
-    /* 如果4个字节全是F，则将其全写为E */
-    if (temp == 0xFFFFFFFF) {
-      temp = 0xEEEEEEEE;
-      flash_status = BaseWrite(addr + 4, &temp, sizeof(temp));
-      if (flash_status != FLASH_COMPLETE) {
-        return flash_status;
-      }
+static uint32_t EE_FindChainEnd(ee_instance_t* inst, uint32_t data_start,
+                                uint32_t head, uint8_t strict) {
+  uint32_t end;
+
+  for (end = head; end > data_start; end -= EE_PROGRAM_WIDTH) {
+    if ((!strict || end == head || EE_IsBlank(end, EE_PROGRAM_WIDTH)) &&
+        EE_CheckChain(inst, data_start, end)) {
+      return end;
     }
-    /* 将页首四个字节写为全0 */
-    temp = (uint32_t)0;
-    return BaseWrite(addr, &temp, sizeof(temp));
   }
-  return MARK_INVALID;
+  return !strict || end == head || EE_IsBlank(end, EE_PROGRAM_WIDTH) ? end : 0;
 }
 
 /*!
-    \brief      查找指定页存储的第一个虚拟地址并返回
-    \param[in]  page: 页编号
-      \arg        PAGE0
-      \arg        PAGE1
-    \param[out] none
-    \retval     第一个虚拟地址
-      \arg        非0xFFFF: 虚拟地址
-      \arg        0xFFFF: 参数错误
-*/
-static uint16_t EE_FindFirstVirAddr(uint16_t page) {
-  if (page != PAGE0 && page != PAGE1) {
-    return 0xFFFF;
-  }
-  uint32_t read_addr, page_start_addr;
-  uint16_t addr_value; /* 16byte，FLASH 中存储的虚拟地址值 */
-  uint16_t store_len;  /* 16byte，FLASH 中存储的虚拟地址对应长度 */
-  uint16_t store_word_len;
-
-  page_start_addr =
-      (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(page * PAGE_SIZE));
-
-  read_addr = (uint32_t)((EEPROM_START_ADDRESS - 4) +
-                         (uint32_t)((1 + page) * PAGE_SIZE));
-
-  /* 从后往前查找 */
-  while (read_addr > (page_start_addr + 8)) {
-    addr_value = *(__IO uint16_t*)(read_addr + 2);
-    store_len = *(__IO uint16_t*)read_addr;
-    if (store_len != 0xFFFF) {
-      store_word_len = store_len / 4;
-      if (store_len % 4 != 0) {
-        store_word_len += 1;
-      }
-    }
-
-    if (addr_value != 0xFFFF && store_len != 0xFFFF) {
-      read_addr -= (4 * store_word_len + 4);
-    } else {
-      read_addr -= 4;
+    \brief      检查从 end 沿记录链往前能否恰好回到页数据起始处
+    \param[in]  data_start: 页头之后第一个地址
+    \param[in]  end: 最后一条记录之后的地址
+    \param[out] none
+    \retval     1: 记录链完整 0: 不完整
+*/
+static uint8_t EE_CheckChain(ee_instance_t* inst, uint32_t data_start,
+                             uint32_t end) {
+  uint32_t rec_size;
+  while (end > data_start) {
+    rec_size = EE_RecordSize(inst, EE_PortReadWord(end - 4));
+    EE_STAT_ADD(inst, scan_words, 1);
+    if (rec_size == 0 || rec_size > end - data_start) {
+      return 0;
     }
+    end -= rec_size;
   }
-
-  return addr_value;
+  return 1;
 }
 
 /*!
-    \brief      在指定地址写入指定字节数的数据（不足4字节按4字节写入）
+    \brief      在指定地址写入指定字节数的数据，按编程单元（EE_PROGRAM_WIDTH）写入，
+                最后不足一个单元的部分以 0xFF 补齐
+    \param[in]  inst: 实例，地址须在其范围内
     \param[in]  addr: 地址
     \param[in]  data: 数据缓冲区
     \param[in]  size: 字节数
@@ -582,8 +3455,9 @@ static uint16_t EE_FindFirstVirAddr(uint16_t page) {
       \arg      POINT_INVALID: 写指针空
       \arg      其他: 错误码
 */
-uint16_t BaseWrite(uint32_t addr, void* data, uint16_t size) {
-  if (addr < PAGE0_BASE_ADDRESS || (addr + size) > PAGE1_END_ADDRESS) {
+static uint16_t EE_FlashWrite(ee_instance_t* inst, uint32_t addr, void* data,
+                              uint16_t size) {
+  if (addr < inst->start || (addr + size) > EE_INST_END(inst)) {
     return ADDR_INVALID;
   }
   if (data == (void*)0) {
@@ -593,24 +3467,29 @@ uint16_t BaseWrite(uint32_t addr, void* data, uint16_t size) {
     return FLASH_COMPLETE;
   }
   uint8_t* p_data = (uint8_t*)data;
-  uint32_t remain_data = 0;
-  uint16_t word_size = size / 4;
-  uint32_t data_temp;
-
-  /* 按字（4byte）写入 */
-  while (word_size--) {
-    data_temp = *(uint32_t*)p_data;
-    fmc_word_program(addr, data_temp);
-    addr += 4;
-    p_data += 4;
-  }
+  uint32_t unit[EE_PROGRAM_WIDTH / 4];
+  uint32_t blank;
+  uint16_t n, i, flash_status;
 
-  size %= 4;
-  for (uint16_t i = 0; i < size; i++) {
-    remain_data += (*p_data++) << (i * 8);
-  }
-  if (size != 0) {
-    fmc_word_program(addr, remain_data);
+  while (size > 0) {
+    n = size < EE_PROGRAM_WIDTH ? size : EE_PROGRAM_WIDTH;
+    memset(unit, 0xFF, sizeof(unit));
+    memcpy(unit, p_data, n);
+    /* 全 1 的单元保持擦除状态即可，不需要编程 */
+    blank = 0xFFFFFFFF;
+    for (i = 0; i < EE_PROGRAM_WIDTH / 4; i++) {
+      blank &= unit[i];
+    }
+    if (blank != 0xFFFFFFFF) {
+      flash_status = EE_PortProgram(addr, unit);
+      if (flash_status != FLASH_COMPLETE) {
+        return flash_status;
+      }
+      EE_STAT_ADD(inst, programs, 1);
+    }
+    addr += EE_PROGRAM_WIDTH;
+    p_data += n;
+    size -= n;
   }
 
   return FLASH_COMPLETE;
@@ -618,51 +3497,357 @@ uint16_t BaseWrite(uint32_t addr, void* data, uint16_t size) {
 
 /*!
     \brief      读取指定地址的指定字节数据
+    \param[in]  inst: 实例，地址须在其范围内
     \param[in]  addr: 起始地址
     \param[in]  size: 读取字节数
     \param[out] data: 接收数据缓冲区
     \retval     读取状态
       \arg        FLASH_COMPLETE: 成功
-      \arg        ADDR_INVALID: 地址不在EEPROM范围
+      \arg        ADDR_INVALID: 地址不在实例范围
       \arg        POINT_INVALID: 接收指针空
 */
-uint16_t BaseRead(uint32_t addr, void* data, uint16_t size) {
-  if (addr < PAGE0_BASE_ADDRESS || (addr + size) > PAGE1_END_ADDRESS) {
+static uint16_t EE_FlashRead(ee_instance_t* inst, uint32_t addr, void* data,
+                             uint16_t size) {
+  if (addr < inst->start || (addr + size) > EE_INST_END(inst)) {
     return ADDR_INVALID;
   }
   if (data == (void*)0) {
     return POINT_INVALID;
   }
   uint8_t* p_data = (uint8_t*)data;
-  /* 按字节（1byte）读取 */
-  while (size--) {
-    *p_data++ = *(__IO uint8_t*)addr++;
+  uint32_t word, offset, n;
+
+  /* 起始地址不对齐：读出所在的字，取需要的字节 */
+  offset = addr % 4;
+  if (offset != 0 && size > 0) {
+    word = EE_PortReadWord(addr - offset);
+    n = 4 - offset < size ? 4 - offset : size;
+    memcpy(p_data, (uint8_t*)&word + offset, n);
+    addr += n;
+    p_data += n;
+    size -= n;
+  }
+  /* 按字（4byte）读取，接收缓冲区可以不对齐 */
+  while (size >= 4) {
+    word = EE_PortReadWord(addr);
+    memcpy(p_data, &word, 4);
+    addr += 4;
+    p_data += 4;
+    size -= 4;
+  }
+  /* 不足一个字的尾部 */
+  if (size > 0) {
+    word = EE_PortReadWord(addr);
+    memcpy(p_data, &word, size);
   }
   return FLASH_COMPLETE;
 }
 
+/*!
+    \brief      检查一段 Flash 是否全部为擦除状态，每次读 4 个字合并比较，
+                遇到已编程的字立即返回
+    \param[in]  addr: 起始地址（字对齐）
+    \param[in]  size: 字节数（字的整数倍）
+    \param[out] none
+    \retval     1: 全部为 0xFFFFFFFF 0: 有已编程的字
+*/
+static uint8_t EE_IsBlank(uint32_t addr, uint32_t size) {
+  uint32_t end = addr + size;
+
+  for (; addr + 16 <= end; addr += 16) {
+    if ((EE_PortReadWord(addr) & EE_PortReadWord(addr + 4) &
+         EE_PortReadWord(addr + 8) & EE_PortReadWord(addr + 12)) !=
+        0xFFFFFFFF) {
+      return 0;
+    }
+  }
+  for (; addr < end; addr += 4) {
+    if (EE_PortReadWord(addr) != 0xFFFFFFFF) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
 /*!
     \brief      擦除指定地址页
+    \param[in]  inst: 实例，地址须在其范围内
     \param[in]  addr: 页起始地址
     \param[out] none
     \retval     擦除状态
       \arg        FLASH_COMPLETE: 擦除完成
       \arg        其他: 错误码
 */
-uint16_t BaseErase(uint32_t addr) {
-  if (addr < PAGE0_BASE_ADDRESS || addr > PAGE1_END_ADDRESS) {
+static uint16_t EE_FlashErase(ee_instance_t* inst, uint32_t addr) {
+  if (addr < inst->start || addr >= EE_INST_END(inst)) {
     return ADDR_INVALID;
   }
-  uint32_t temp = 0;
-  if (addr % PAGE_SIZE == 0) {
-    for (int32_t i = 0; i < PAGE_SIZE / 4; i++) {
-      BaseRead(addr + i * 4, &temp, 4);
-      if (temp != 0xFFFFFFFF) {
-        return fmc_page_erase(addr);
+  uint16_t flash_status = FLASH_COMPLETE;
+  /* 整页全部为 0xFFFFFFFF 时不需要擦除 */
+  if (addr % PAGE_SIZE != 0 || !EE_IsBlank(addr, PAGE_SIZE)) {
+    /* 擦除前使指向该页的 EE_InstReadRef 指针失效 */
+    inst->generation++;
+    EE_PORT_BARRIER();
+    flash_status = EE_PortErasePage(addr);
+    EE_STAT_ADD(inst, erases, 1);
+  }
+  EE_UpdatePageStatus(inst, addr, flash_status, EE_SEQ_ERASED, 0);
+  return flash_status;
+}
+
+#if EE_STATS
+/*!
+    \brief      把一次操作的耗时计入统计
+    \param[in]  lat: 该操作的耗时统计
+    \param[in]  cycles: 耗时（EE_PortCycles 的周期）
+    \param[out] none
+    \retval     none
+*/
+static void EE_StatsLatency(ee_latency_t* lat, uint32_t cycles) {
+  uint16_t bucket = 0;
+
+  while (bucket < EE_STATS_BUCKETS - 1 &&
+         (cycles >> (EE_STATS_SHIFT + bucket)) != 0) {
+    bucket++;
+  }
+#if EE_CONCURRENT
+  uint32_t old;
+
+  /* 各项分别用比较交换更新；min 为 0 视为尚无记录，不依赖另一个字段 count */
+  do {
+    old = *(__IO uint32_t*)&lat->min;
+  } while ((old == 0 || cycles < old) && !EE_PortCas(&lat->min, old, cycles));
+  do {
+    old = *(__IO uint32_t*)&lat->max;
+  } while (cycles > old && !EE_PortCas(&lat->max, old, cycles));
+  EE_StatsAdd(&lat->count, 1);
+  EE_StatsAdd(&lat->hist[bucket], 1);
+#else
+  if (lat->count == 0 || cycles < lat->min) {
+    lat->min = cycles;
+  }
+  if (cycles > lat->max) {
+    lat->max = cycles;
+  }
+  lat->count++;
+  lat->hist[bucket]++;
+#endif
+}
+
+#if EE_CONCURRENT
+/*!
+    \brief      原子地累加一项统计
+    \param[in]  field: 统计项
+    \param[in]  n: 增量
+    \param[out] none
+    \retval     none
+*/
+static void EE_StatsAdd(uint32_t* field, uint32_t n) {
+  uint32_t old;
+
+  do {
+    old = *(__IO uint32_t*)field;
+  } while (!EE_PortCas(field, old, old + n));
+}
+#endif
+
+/*!
+    \brief      获取实例的操作计数和耗时统计
+                EE_CONCURRENT 时各项在读取期间仍可能被不加锁的读取方更新，
+                各项之间不保证是同一时刻的值
+    \param[in]  inst: 实例
+    \param[out] stats: 统计结果
+    \retval     none
+*/
+void EE_InstGetStats(ee_instance_t* inst, ee_stats_t* stats) {
+  EE_LOCK();
+  *stats = inst->stats;
+  EE_UNLOCK();
+}
+
+/*!
+    \brief      清零实例的统计
+    \param[in]  inst: 实例
+    \param[out] none
+    \retval     none
+*/
+void EE_InstResetStats(ee_instance_t* inst) {
+  EE_LOCK();
+  memset(&inst->stats, 0, sizeof(inst->stats));
+  EE_UNLOCK();
+}
+#endif
+
+#if EE_BENCHMARK
+/*!
+    \brief      测量 BaseRead 和空白检查每 KB 消耗的周期数（EE_PortCycles）：
+                读取从默认实例起始处连续读 1KB，空白检查使用一个已擦除的空闲页
+    \param[in]  none
+    \param[out] bench: 测量结果，没有已擦除的空闲页时 blank_cycles_per_kb 为 0
+    \retval     FLASH_COMPLETE 或 NO_VALID_PAGE
+*/
+uint16_t EE_Benchmark(ee_bench_t* bench) {
+  ee_instance_t* inst = &ee_default_instance;
+  uint16_t valid_page = EE_FindValidPage(inst);
+  uint16_t free_page;
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint32_t start, addr;
+
+  if (valid_page == NO_VALID_PAGE) {
+    return NO_VALID_PAGE;
+  }
+
+  start = EE_PortCycles();
+  for (addr = 0; addr < 1024; addr += sizeof(buf)) {
+    EE_FlashRead(inst, inst->start + addr % (inst->page_count * PAGE_SIZE), buf,
+                 sizeof(buf));
+  }
+  bench->read_cycles_per_kb = EE_PortCycles() - start;
+
+  bench->blank_cycles_per_kb = 0;
+  free_page = EE_FindFreePage(inst, valid_page);
+  if (free_page != NO_VALID_PAGE &&
+      inst->page_seq[free_page] == EE_SEQ_ERASED) {
+    start = EE_PortCycles();
+    EE_IsBlank(EE_INST_PAGE(inst, free_page), PAGE_SIZE);
+    bench->blank_cycles_per_kb =
+        (uint32_t)((uint64_t)(EE_PortCycles() - start) * 1024 / PAGE_SIZE);
+  }
+  return FLASH_COMPLETE;
+}
+#endif
+
+/* 以下为不带实例参数的旧接口，作用于默认实例 ee_default_instance */
+
+uint16_t EE_Init(void) { return EE_InstInit(&ee_default_instance); }
+
+uint16_t EE_ReadVariable(uint16_t virt_addr, void* data, uint16_t size,
+                         uint16_t* br) {
+  return EE_InstRead(&ee_default_instance, virt_addr, data, size, br);
+}
+
+uint16_t EE_ReadAll(const ee_batch_item_t* items, uint16_t count, uint16_t* br,
+                    uint8_t* missing) {
+  return EE_InstReadAll(&ee_default_instance, items, count, br, missing);
+}
+
+uint16_t EE_ReadVariableRef(uint16_t virt_addr, const void** ptr, uint16_t* len,
+                            uint32_t* gen) {
+  return EE_InstReadRef(&ee_default_instance, virt_addr, ptr, len, gen);
+}
+
+uint8_t EE_RefValid(uint32_t gen) {
+  return EE_InstRefValid(&ee_default_instance, gen);
+}
+
+uint16_t EE_WriteVaribal(uint16_t virt_addr, void* data, uint16_t size) {
+  return EE_InstWrite(&ee_default_instance, virt_addr, data, size);
+}
+
+uint16_t EE_WriteBatch(const ee_batch_item_t* items, uint16_t count) {
+  return EE_InstWriteBatch(&ee_default_instance, items, count);
+}
+
+uint16_t EE_StreamOpenWrite(ee_stream_t* stream, uint16_t virt_addr) {
+  return EE_InstStreamOpenWrite(&ee_default_instance, stream, virt_addr);
+}
+
+uint16_t EE_StreamOpenRead(ee_stream_t* stream, uint16_t virt_addr) {
+  return EE_InstStreamOpenRead(&ee_default_instance, stream, virt_addr);
+}
+
+uint16_t EE_GetFreeSpace(void) {
+  return EE_InstGetFreeSpace(&ee_default_instance);
+}
+
+uint16_t EE_Maintenance(uint16_t budget) {
+  return EE_InstMaintenance(&ee_default_instance, budget);
+}
+
+#if EE_SKIP_UNCHANGED
+void EE_GetSkipStats(ee_skip_stats_t* stats) {
+  EE_InstGetSkipStats(&ee_default_instance, stats);
+}
+#endif
+
+#if EE_STATS
+void EE_GetStats(ee_stats_t* stats) {
+  EE_InstGetStats(&ee_default_instance, stats);
+}
+
+void EE_ResetStats(void) { EE_InstResetStats(&ee_default_instance); }
+#endif
+
+#if EE_WRITE_BACK
+uint16_t EE_Flush(void) { return EE_InstFlush(&ee_default_instance); }
+
+uint16_t EE_PowerFail(void) { return EE_InstPowerFail(&ee_default_instance); }
+#endif
+
+#if EE_ASYNC_QUEUE
+uint16_t EE_WriteAsync(uint16_t virt_addr, const void* data, uint16_t size,
+                       ee_async_t* req) {
+  return EE_InstWriteAsync(&ee_default_instance, virt_addr, data, size, req);
+}
+
+uint16_t EE_AsyncService(void) {
+  return EE_InstAsyncService(&ee_default_instance);
+}
+#endif
+
+uint16_t BaseWrite(uint32_t addr, void* data, uint16_t size) {
+  return EE_FlashWrite(&ee_default_instance, addr, data, size);
+}
+
+uint16_t BaseRead(uint32_t addr, void* data, uint16_t size) {
+  return EE_FlashRead(&ee_default_instance, addr, data, size);
+}
+
+uint16_t BaseErase(uint32_t addr) {
+  return EE_FlashErase(&ee_default_instance, addr);
+}
+
+/* 旧版两页格式的页头标记，EE_Mark 使用 */
+const uint64_t ERASED = ((uint64_t)0xFFFFFFFFFFFFFFFF);
+const uint64_t RECEIVE_DATA = ((uint64_t)0xEEEEEEEEFFFFFFFF);
+const uint64_t VALID_PAGE = ((uint64_t)0xEEEEEEEE00000000);
+
+/*!
+    \brief      写指定标记到指定页数（旧版两页格式，保留给沿用它的代码；
+                EE_Init 把旧版的有效页按序号 0 沿用）
+    \param[in]  addr: 绝对地址
+    \param[in]  mk:
+      \arg        ERASED: FFFF FFFF FFFF FFFF
+      \arg        RECEIVE_DATA: EEEE EEEE FFFF FFFF
+      \arg        VALID_PAGE: EEEE EEEE 0000 0000
+    \param[out] none
+    \retval     FLASH状态
+      \arg        FLASH_COMPLETE: 成功
+      \arg        MARK_INVALID: 标记无效
+      \arg        其他: 错误码
+*/
+uint16_t EE_Mark(uint32_t addr, uint64_t mk) {
+  uint32_t temp;
+  uint16_t flash_status;
+  if (mk == ERASED) { /* 擦除状态 */
+    return FLASH_COMPLETE;
+  } else if (mk == RECEIVE_DATA) { /* 接收状态 */
+    temp = 0xEEEEEEEE;
+    return BaseWrite(addr + 4, &temp, sizeof(temp));
+  } else if (mk == VALID_PAGE) { /* 可用状态 */
+    /* 读出页第二个字的数据 */
+    BaseRead(addr + 4, &temp, sizeof(temp));
+    /* 如果4个字节全是F，则将其全写为E */
+    if (temp == 0xFFFFFFFF) {
+      temp = 0xEEEEEEEE;
+      flash_status = BaseWrite(addr + 4, &temp, sizeof(temp));
+      if (flash_status != FLASH_COMPLETE) {
+        return flash_status;
       }
     }
-    /* 不需要擦除 */
-    return FLASH_COMPLETE;
+    /* 将页首四个字节写为全0 */
+    temp = (uint32_t)0;
+    return BaseWrite(addr, &temp, sizeof(temp));
   }
-  return fmc_page_erase(addr);
+  return MARK_INVALID;
 }
@@ -7,34 +7,166 @@
 #ifndef EEPROM_H
 #define EEPROM_H
 
-#include "gd32e10x.h"
+#include "eeprom_port.h"
 
+#ifndef PAGE_SIZE
 #define PAGE_SIZE 1024
+#endif
 #define FLASH_COMPLETE 0
 #define VARIABLE_MAX_SIZE 64
 
-/* 使用124、125页 */
-#define EEPROM_START_ADDRESS ((uint32_t)(0x08000000 + 124 * 1024))
+/* 写入值与当前存储值相同时不追加记录，置 0 则每次都写 */
+#ifndef EE_SKIP_UNCHANGED
+#define EE_SKIP_UNCHANGED 1
+#endif
+
+/* 不超过 EE_PROGRAM_WIDTH - 2 字节的定长变量和 1~2 字节的变长变量写成只占一个编程单元、
+   不带长度字段的紧凑记录（尾字高 16 位为取反的虚拟地址，低 16 位为数据的最后两个字节），
+   置 0 则与旧版固件的记录格式保持一致 */
+#ifndef EE_PACKED_RECORDS
+#define EE_PACKED_RECORDS 1
+#endif
+
+/* 不小于该字节数的变量只改动一部分时写差分记录（只含改动的字节），置 0 则总是写完整记录 */
+#ifndef EE_DELTA_MIN_SIZE
+#define EE_DELTA_MIN_SIZE 16
+#endif
+
+/* 写回缓存的项数：EE_WriteVaribal 只把值存入 RAM，同一变量的多次写入合并，由 EE_Flush、
+   超时（EE_Maintenance 中检查）或 EE_PowerFail 写入 Flash；置 0 则每次直接写 Flash */
+#ifndef EE_WRITE_BACK
+#define EE_WRITE_BACK 0
+#endif
+
+/* 写回缓存中的值最多保留的时间，按 EE_PortCycles 计，EE_Maintenance 的调用间隔
+   应远小于周期计数器的回绕时间 */
+#ifndef EE_FLUSH_TIMEOUT_MS
+#define EE_FLUSH_TIMEOUT_MS 1000
+#endif
+#ifndef EE_CYCLES_PER_MS
+#define EE_CYCLES_PER_MS 120000 /* GD32E10x 120MHz */
+#endif
+
+/* 异步写入队列深度（2 的幂），置 0 不编译 EE_WriteAsync/EE_AsyncService */
+#ifndef EE_ASYNC_QUEUE
+#define EE_ASYNC_QUEUE 0
+#endif
+
+/* 置 1 时写入、回收和维护由 EE_PortLock/EE_PortUnlock 互斥，读取不加锁：
+   读取方按实例的版本号检查，读取期间索引被修改（记录被回收搬走）则重读 */
+#ifndef EE_CONCURRENT
+#define EE_CONCURRENT 0
+#endif
+
+/* 版本号连续变化时读取方重试的次数，之后加锁读取（写入方被低优先级任务抢占时
+   不会一直重试） */
+#ifndef EE_READ_RETRIES
+#define EE_READ_RETRIES 8
+#endif
+
+/* 置 1 编译 EE_Benchmark，测量读取和空白检查每 KB 的周期数 */
+#ifndef EE_BENCHMARK
+#define EE_BENCHMARK 0
+#endif
+
+/* 置 1 时每个实例统计读写、编程、擦除、换页和回收的次数，以及读取、写入、换页的
+   耗时（EE_PortCycles 的周期，目标板为 DWT，主机仿真为虚拟时钟），由 EE_GetStats 查询；
+   置 0 不编译统计代码 */
+#ifndef EE_STATS
+#define EE_STATS 0
+#endif
+/* 耗时直方图的格数：第 0 格为少于 2^EE_STATS_SHIFT 周期，第 k 格为
+   [2^(EE_STATS_SHIFT+k-1), 2^(EE_STATS_SHIFT+k))，最后一格包括所有更长的耗时 */
+#ifndef EE_STATS_BUCKETS
+#define EE_STATS_BUCKETS 16
+#endif
+#ifndef EE_STATS_SHIFT
+#define EE_STATS_SHIFT 8
+#endif
+
+/* 前台写入和 EE_Init 中完成的回收只把旧页标记为已回收，由 EE_Maintenance 在空闲时
+   擦除，前台写入不再等待擦除；置 0 则立即擦除 */
+#ifndef EE_ERASE_AHEAD
+#define EE_ERASE_AHEAD 1
+#endif
+
+/* 只剩一个空闲页且写入页剩余空间低于该字节数时，EE_Maintenance 提前换页并开始回收 */
+#ifndef EE_COMPACT_THRESHOLD
+#define EE_COMPACT_THRESHOLD (2 * EE_RECORD_SIZE(VARIABLE_MAX_SIZE))
+#endif
+
+/* 置 1 时换页后先在新写入页开头写入 RAM 索引的快照（每个变量 4 字节），EE_Init 由快照
+   恢复之前各页中的索引，只需扫描写入页；快照超过页大小的 1/4 时不写。
+   置 0 不写快照，已有的快照仍会在 EE_Init 中使用 */
+#ifndef EE_BOOT_SNAPSHOT
+#define EE_BOOT_SNAPSHOT 0
+#endif
+
+/* 大变量（变量表中字节数超过 VARIABLE_MAX_SIZE 的定长变量）的字节数上限：
+   改写时旧值和新值要同时放在写入页中，两份值连同回收保留空间（和索引快照）须能放进一页 */
+#ifndef EE_LARGE_MAX_SIZE
+#define EE_LARGE_MAX_SIZE (PAGE_SIZE / 4)
+#endif
 
-/* Pages 0 and 1 base and end addresses */
-#define PAGE0_BASE_ADDRESS ((uint32_t)(EEPROM_START_ADDRESS + 0x000))
-#define PAGE0_END_ADDRESS ((uint32_t)(EEPROM_START_ADDRESS + (PAGE_SIZE - 1)))
+/* 环形日志使用的页数，页越多回收时需要搬移的记录越少 */
+#ifndef EE_PAGE_COUNT
+#define EE_PAGE_COUNT 2
+#endif
 
-#define PAGE1_BASE_ADDRESS ((uint32_t)(EEPROM_START_ADDRESS + PAGE_SIZE))
-#define PAGE1_END_ADDRESS \
-  ((uint32_t)(EEPROM_START_ADDRESS + (2 * PAGE_SIZE - 1)))
+/* 各实例页数的上限，决定 ee_instance_t 中页状态缓存的大小 */
+#ifndef EE_MAX_PAGE_COUNT
+#define EE_MAX_PAGE_COUNT EE_PAGE_COUNT
+#endif
 
-/* Used Flash pages for EEPROM emulation */
+/* 每个实例变量个数的上限，决定建立索引和回收时所用位图的大小 */
+#ifndef EE_MAX_VAR_COUNT
+#define EE_MAX_VAR_COUNT 255
+#endif
+
+/* 按顺序分配的表删去表尾的变量后，表尾之后这么多个虚拟地址的记录仍按长度越过
+   （读不到，回收时不复制）。数据字碰巧形如尾字的可能随之增大，不宜过大；
+   散列目录（EE_INSTANCE_DEFINE_KEYED）的表不能删除变量 */
+#ifndef EE_REMOVED_KEYS
+#define EE_REMOVED_KEYS 16
+#endif
+
+/* 默认使用124、125页 */
+#ifndef EEPROM_START_ADDRESS
+#define EEPROM_START_ADDRESS ((uint32_t)(0x08000000 + 124 * 1024))
+#endif
+#define EEPROM_END_ADDRESS \
+  ((uint32_t)(EEPROM_START_ADDRESS + EE_PAGE_COUNT * PAGE_SIZE))
+
+/* 第 page 页的起始地址 */
+#define EE_PAGE_ADDRESS(page) \
+  ((uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(page) * PAGE_SIZE))
+
+/* 旧版两页格式的名字，保留给沿用它们的代码，新代码用 EE_PAGE_ADDRESS */
+#define PAGE0_BASE_ADDRESS EE_PAGE_ADDRESS(0)
+#define PAGE0_END_ADDRESS (EE_PAGE_ADDRESS(1) - 1)
+#define PAGE1_BASE_ADDRESS EE_PAGE_ADDRESS(1)
+#define PAGE1_END_ADDRESS (EE_PAGE_ADDRESS(2) - 1)
 #define PAGE0 ((uint16_t)0x0000)
 #define PAGE1 ((uint16_t)0x0001)
+#define READ_FROM_VALID_PAGE ((uint8_t)0x00)
+#define WRITE_IN_VALID_PAGE ((uint8_t)0x01)
+
+#if EE_PAGE_COUNT < 2
+#error "EE_PAGE_COUNT must be at least 2"
+#endif
+#if EE_PAGE_COUNT * PAGE_SIZE > 0x10000
+#error "RAM index offsets are 16 bit: EE_PAGE_COUNT * PAGE_SIZE must not exceed 64KB"
+#endif
+#if EE_MAX_PAGE_COUNT < EE_PAGE_COUNT
+#error "EE_MAX_PAGE_COUNT must not be less than EE_PAGE_COUNT"
+#endif
+#if EE_MAX_VAR_COUNT > 4096
+#error "EE_MAX_VAR_COUNT must not exceed 4096"
+#endif
 
 /* No valid page define */
 #define NO_VALID_PAGE ((uint16_t)0x00AB)
 
-/* Valid pages in read and write defines */
-#define READ_FROM_VALID_PAGE ((uint8_t)0x00)
-#define WRITE_IN_VALID_PAGE ((uint8_t)0x01)
-
 /* Page full define */
 #define PAGE_FULL ((uint8_t)0x80)
 
@@ -42,43 +174,381 @@
 #define VAR_SIZE_OVERFLOW  ((uint16_t)0x00AC)
 #define ADDR_INVALID      ((uint16_t)0x00AD)
 #define POINT_INVALID     ((uint16_t)0x00AE)
-#define MARK_INVALID      ((uint16_t)0x00AF)
+#define MARK_INVALID      ((uint16_t)0x00AF) /* EE_Mark 的标记无效 */
+/* EE_Maintenance 用完预算，仍有回收工作 */
+#define MAINTENANCE_PENDING ((uint16_t)0x00B1)
+/* 异步写入尚未完成 */
+#define EE_ASYNC_PENDING ((uint16_t)0x00B2)
+/* 异步写入队列已满 */
+#define ASYNC_QUEUE_FULL ((uint16_t)0x00B3)
+/* 实例配置无效（页数、地址范围或变量表） */
+#define INSTANCE_INVALID ((uint16_t)0x00B5)
+/* 变量的当前值不是 Flash 中一段连续的数据（差分记录、写回缓存或异步队列中），
+   需用 EE_ReadVariable 复制读取 */
+#define REF_UNAVAILABLE ((uint16_t)0x00B6)
+/* 流式读写期间其他写入改变了写指针，或读取的数据所在页被擦除，需重新打开 */
+#define STREAM_ABORTED ((uint16_t)0x00B7)
+
+/* 变量表：X(虚拟地址, 字节数, 默认值)
+   虚拟地址从 IDX_START + 1 起按顺序分配，新变量只能加在表尾；
+   字节数为 0 表示变长（最长 VARIABLE_MAX_SIZE），否则每次必须按该长度写入；
+   超过 VARIABLE_MAX_SIZE（最大 EE_LARGE_MAX_SIZE）的为大变量，分块存放，见 ee_stream_t；
+   默认值按小端存放在前 4 字节（其余为 0），0 表示没有默认值（不能声明默认为 0）：
+   定长变量未写入过时由 EE_ReadVariable 填入声明的默认值，没有默认值时不改动调用者的缓冲区。
+   定长只省去紧凑记录（不超过 EE_PROGRAM_WIDTH - 2 字节）的长度字段，普通记录的长度
+   仍在尾字中。
+   以下变量沿用旧版的写法（长度由调用者决定），确认各自的字节数前保持变长 */
+#define EE_VAR_TABLE(X)               \
+  X(IDX_GIMBLE_NAME, 0, 0)            \
+  X(IDX_WB, 0, 0)                     \
+  X(IDX_IS_SLE_ISO, 0, 0)             \
+  X(IDX_ISO_SLE, 0, 0)                \
+  X(IDX_EC_SLE, 0, 0)                 \
+  X(IDX_INCEPTION_SPEED, 0, 0)        \
+  X(IDX_TIME_LAPSE_PAN, 0, 0)         \
+  X(IDX_TIME_LAPSE_TILT, 0, 0)        \
+  X(IDX_TIME_LAPSE_INVL, 0, 0)        \
+  X(IDX_TIME_LAPSE_DWELL, 0, 0)       \
+  X(IDX_SCENE_SLE, 0, 0)              \
+  X(IDX_SCENE_CUSTOM_SPEED, 0, 0)     \
+  X(IDX_SCENE_CUSTOM_DEAD, 0, 0)      \
+  X(IDX_KNOB_GIMBLE_SENS, 0, 0)       \
+  X(IDX_KNOB_CAMERA_SENS, 0, 0)       \
+  X(IDX_KNOB_OBJ, 0, 0)               \
+  X(IDX_AUTO_FOCUS_TIME, 0, 0)        \
+  X(IDX_LANGUAGE, 0, 0)
+
+#define EE_VAR_ENUM(name, size, def) name,
+#define EE_VAR_SIZE_ENUM(name, size, def) EE_SIZE_##name = (size),
 
 enum {
   IDX_START = 0xDF00,
-  //
-    IDX_GIMBLE_NAME,
-    IDX_WB,
-    IDX_IS_SLE_ISO,
-    IDX_ISO_SLE,
-    IDX_EC_SLE,
-    IDX_INCEPTION_SPEED,
-    IDX_TIME_LAPSE_PAN,
-    IDX_TIME_LAPSE_TILT,
-    IDX_TIME_LAPSE_INVL,
-    IDX_TIME_LAPSE_DWELL,
-    IDX_SCENE_SLE,
-    IDX_SCENE_CUSTOM_SPEED,
-    IDX_SCENE_CUSTOM_DEAD,
-    IDX_KNOB_GIMBLE_SENS,
-    IDX_KNOB_CAMERA_SENS,
-    IDX_KNOB_OBJ,
-    IDX_AUTO_FOCUS_TIME,
-    IDX_LANGUAGE,
-  //
+  EE_VAR_TABLE(EE_VAR_ENUM)
   IDX_BUTT
 };
 
+/* 各变量的字节数 EE_SIZE_<虚拟地址名> */
+enum { EE_VAR_TABLE(EE_VAR_SIZE_ENUM) };
+
+/* 按变量表检查长度的读写：*ptr 的大小不符时编译报错 */
+#define EE_CHECK_SIZE(name, ptr)                                   \
+  ((void)sizeof(char[(EE_SIZE_##name == 0                          \
+                          ? sizeof(*(ptr)) <= VARIABLE_MAX_SIZE    \
+                          : sizeof(*(ptr)) == EE_SIZE_##name)      \
+                         ? 1                                       \
+                         : -1]))
+#define EE_WRITE(name, ptr) \
+  (EE_CHECK_SIZE(name, ptr), EE_WriteVaribal(name, (ptr), sizeof(*(ptr))))
+#define EE_READ(name, ptr) \
+  (EE_CHECK_SIZE(name, ptr),  \
+   EE_ReadVariable(name, (ptr), sizeof(*(ptr)), (uint16_t*)0))
+
+/* 一条 size 字节的变量记录在 Flash 中占用的字节数：数据按字对齐 + 地址/长度字，
+   再补齐到编程单元，地址/长度字位于最后一个单元的末尾 */
+#define EE_RECORD_SIZE(size)                                          \
+  (((((uint32_t)(size) + 3) / 4) * 4 + 4 + EE_PROGRAM_WIDTH - 1) / \
+   EE_PROGRAM_WIDTH * EE_PROGRAM_WIDTH)
+
 /* Variables' number */
 #define NumbOfVar ((uint8_t)(IDX_BUTT - IDX_START - 1))
 
+/* EE_WriteBatch / EE_ReadAll 的一项 */
+typedef struct {
+  uint16_t virt_addr;
+  uint16_t size;
+  void* data;
+} ee_batch_item_t;
+
+/* 因写入值未改变而省去的操作 */
+typedef struct {
+  uint32_t writes; /* 跳过的 EE_WriteVaribal 次数 */
+  uint32_t words;  /* 省去的编程次数（每次 EE_PROGRAM_WIDTH 字节） */
+  uint32_t erases; /* 按省去的字数折算的页擦除次数 */
+} ee_skip_stats_t;
+
+/* 一种操作的耗时，单位为 EE_PortCycles 的周期 */
+typedef struct {
+  uint32_t count;
+  uint32_t min; /* count 为 0 时无意义 */
+  uint32_t max;
+  uint32_t hist[EE_STATS_BUCKETS]; /* 见 EE_STATS_BUCKETS */
+} ee_latency_t;
+
+/* EE_GetStats 的结果，自上电或 EE_ResetStats 起累计，包括 EE_InstInit 中的扫描和回收 */
+typedef struct {
+  uint32_t reads;       /* EE_InstRead/EE_InstReadAll 次数 */
+  uint32_t writes;      /* EE_InstWrite 次数（含写入缓存和跳过的） */
+  uint32_t lookups;     /* 由虚拟地址查找变量的次数 */
+  uint32_t probes;      /* 查找时比较的散列目录项数（按顺序分配地址的实例为 0） */
+  uint32_t scan_words;  /* 扫描记录链、查找写指针时读取的 Flash 字数 */
+  uint32_t programs;    /* 编程次数（每次 EE_PROGRAM_WIDTH 字节） */
+  uint32_t erases;      /* 页擦除次数 */
+  uint32_t transfers;   /* 换页次数 */
+  uint32_t reclaims;    /* 回收完成的页数 */
+  uint32_t copies;      /* 回收时复制的记录数 */
+  uint32_t copies_max;  /* 回收一页时复制的最多记录数 */
+  ee_latency_t read;     /* EE_InstRead/EE_InstReadAll */
+  ee_latency_t write;    /* EE_InstWrite，不含等待写锁 */
+  ee_latency_t transfer; /* 换页：启用新页、写索引快照和触发换页的记录 */
+} ee_stats_t;
+
+/* 异步写入的控制块，由调用者提供，写入完成前不能重用 */
+typedef struct ee_async_s ee_async_t;
+struct ee_async_s {
+  void (*done)(ee_async_t* req); /* 完成回调，在 EE_AsyncService 的上下文中调用，可为 NULL */
+  void* ctx;                     /* 调用者自用 */
+  __IO uint16_t status; /* EE_ASYNC_PENDING，完成后为写入结果（同 EE_WriteVaribal） */
+};
+
+/* EE_Benchmark 的结果，单位为 EE_PortCycles 的周期 */
+typedef struct {
+  uint32_t read_cycles_per_kb;  /* BaseRead 连续读取 */
+  uint32_t blank_cycles_per_kb; /* 擦除前的空白检查 */
+} ee_bench_t;
+
+/* RAM 索引：每个变量最新记录的数据位置（相对实例起始地址）和长度，
+   下标为变量在变量表中的序号，在 EE_InstInit 中建立，每次写入后更新 */
+typedef struct {
+  uint16_t offset; /* 记录起始位置，0: 变量不存在（页头占用偏移 0） */
+  uint16_t len : 15;
+  uint16_t packed : 1; /* 1: 紧凑记录 */
+  uint16_t delta;      /* 基准之后最新差分记录的尾字位置，0: 没有差分 */
+} ee_index_t;
+
+#if EE_WRITE_BACK
+/* 写回缓存：尚未写入 Flash 的变量值，每个变量最多占一项 */
+typedef struct {
+  uint8_t used;
+  uint8_t len;
+  uint16_t slot;
+  uint32_t since; /* 写入缓存时的 EE_PortCycles，合并写入不更新 */
+  uint8_t data[VARIABLE_MAX_SIZE];
+} ee_cache_t;
+#endif
+
+#if EE_ASYNC_QUEUE
+/* 异步写入队列的一项：提交时复制数据，按提交顺序逐条写入 */
+typedef struct {
+  ee_async_t* req;
+  uint16_t slot;
+  uint8_t len;
+  uint8_t data[VARIABLE_MAX_SIZE];
+} ee_async_entry_t;
+#endif
+
+/* 一个独立的存储实例：占用自己的连续页，有自己的变量表、RAM 索引和运行状态，
+   不同实例之间不共享任何数据。各实例的回收只搬移本实例的记录，把很少改动的
+   数据和频繁改动的数据放在不同实例中，前者不会随后者的回收被反复复制。
+   配置部分由 EE_INSTANCE_DEFINE 填写，其余在 EE_InstInit 中初始化 */
+typedef struct {
+  uint32_t start;       /* 第 0 页起始地址，页对齐 */
+  uint16_t page_count;  /* 页数，2 ~ EE_MAX_PAGE_COUNT */
+  uint16_t key_base;    /* 虚拟地址从 key_base + 1 起按顺序分配（var_key 为 NULL 时） */
+  uint16_t var_count;   /* 变量个数 */
+  const uint16_t* var_key;      /* 各变量的虚拟地址（可不连续），NULL 时按顺序分配 */
+  const uint16_t* var_size;     /* 各变量字节数，0 为变长 */
+  const uint32_t* var_default;  /* 定长变量未写入过时的默认值，0 表示没有 */
+  ee_index_t* index;            /* var_count 项 */
+  uint16_t* dir;     /* var_key 的散列目录（虚拟地址 -> 下标），EE_InstInit 中建立 */
+  uint16_t dir_mask; /* 目录项数 - 1，项数为 2 的幂且不少于变量个数的 2 倍 */
+
+#if EE_CONCURRENT
+  /* 版本号：修改索引、写回缓存或异步队列期间为奇数，每次修改后加 2 */
+  __IO uint32_t seq;
+#endif
+  /* 擦除代数：每擦除一页前加 1，EE_InstReadRef 返回的指针在它改变前有效 */
+  __IO uint32_t generation;
+  uint32_t write_addr;   /* 写指针缓存，0 表示需要重新查找 */
+  uint16_t reclaim_slot; /* 回收进度：最旧页中下标小于它的变量已复制到写入页 */
+  /* 回收位图：最新记录仍在 reclaim_page 页（序号 reclaim_seq）中、尚待复制的变量，
+     reclaim_bytes 为这些记录的字节数；换了最旧页时重建，之后随索引更新维护 */
+  uint8_t reclaim_map[(EE_MAX_VAR_COUNT + 7) / 8];
+  uint32_t reclaim_bytes;
+  uint32_t reclaim_seq;
+  uint16_t reclaim_page;
+  /* 页状态缓存：EE_InstInit 时读出，之后只随换页、回收和擦除改变 */
+  uint32_t page_seq[EE_MAX_PAGE_COUNT];
+  uint8_t page_retired[EE_MAX_PAGE_COUNT];
+#if EE_SKIP_UNCHANGED
+  ee_skip_stats_t skip_stats;
+  uint32_t skip_words; /* 不足一页的累计字数 */
+#endif
+#if EE_STATS
+  ee_stats_t stats;
+  uint32_t stats_copies; /* 正在回收的页已复制的记录数 */
+#endif
+#if EE_WRITE_BACK
+  ee_cache_t cache[EE_WRITE_BACK];
+  uint8_t cache_bypass; /* EE_InstPowerFail 之后直接写 Flash */
+#endif
+#if EE_ASYNC_QUEUE
+  ee_async_entry_t async_queue[EE_ASYNC_QUEUE];
+  /* 自由计数的队首、队尾，下标取模：提交只改队尾，EE_InstAsyncService 只改队首 */
+  __IO uint16_t async_head; /* 队首为正在写入的一条 */
+  __IO uint16_t async_tail;
+  /* 队首记录的写入进度 */
+  uint32_t async_image[EE_RECORD_SIZE(VARIABLE_MAX_SIZE) / 4];
+  uint32_t async_addr; /* 记录起始地址 */
+  uint32_t async_size; /* 记录字节数，0: 尚未生成 */
+  uint16_t async_unit; /* 下一个要写的单元序号，见 EE_ProgramRecord */
+  uint8_t async_busy;  /* 已启动编程，等待完成 */
+  uint8_t async_packed, async_delta;
+#endif
+} ee_instance_t;
+
+/* 大变量的流式读写，由调用者提供，EE_StreamOpenWrite/EE_StreamOpenRead 打开：
+   写入时每满 VARIABLE_MAX_SIZE 字节写一块，EE_StreamCommit 写完最后一块和提交字后
+   新值才生效；打开到提交之间有其他写入（包括回收、换页）时返回 STREAM_ABORTED */
+#define EE_STREAM_WRITE 1 /* ee_stream_t.mode：EE_StreamOpenWrite 成功打开 */
+#define EE_STREAM_READ 2  /* ee_stream_t.mode：EE_StreamOpenRead 成功打开 */
+typedef struct {
+  ee_instance_t* inst;
+  uint16_t slot;  /* 变量下标 */
+  uint16_t pos;   /* 已写入（读取）的字节数 */
+  uint8_t mode;   /* EE_STREAM_WRITE、EE_STREAM_READ，打开失败时为 0 */
+  uint32_t start; /* 第一块的地址，读取时为 0 表示未写入过（读出默认值） */
+  uint32_t addr;  /* 写入：下一块的地址 */
+  uint32_t gen;   /* 读取：打开时的擦除代数 */
+  uint8_t buf[VARIABLE_MAX_SIZE]; /* 写入：未满一块的数据 */
+} ee_stream_t;
+
+/* 由变量表（格式同 EE_VAR_TABLE）定义一个实例 inst 及其只读表和 RAM 索引：
+   虚拟地址从 key_base + 1 起按顺序分配，占用 start 起的 pages 页。
+   在一个 .c 文件中使用，其他文件用 extern ee_instance_t inst; 声明 */
+#define EE_INST_VAR_SIZE(name, size, def) (size),
+#define EE_INST_VAR_DEFAULT(name, size, def) (def),
+#define EE_INST_VAR_COUNT(name, size, def) +1
+#define EE_INST_VAR_KEY(name, size, def) (name),
+#define EE_INSTANCE_DEFINE(inst, TABLE, base, start_addr, pages)         \
+  static const uint16_t inst##_var_size[] = {TABLE(EE_INST_VAR_SIZE)};   \
+  static const uint32_t inst##_var_default[] = {                         \
+      TABLE(EE_INST_VAR_DEFAULT)};                                       \
+  static ee_index_t inst##_index[0 TABLE(EE_INST_VAR_COUNT)];            \
+  ee_instance_t inst = {.start = (start_addr),                           \
+                        .page_count = (pages),                           \
+                        .key_base = (base),                              \
+                        .var_count = 0 TABLE(EE_INST_VAR_COUNT),         \
+                        .var_size = inst##_var_size,                     \
+                        .var_default = inst##_var_default,               \
+                        .index = inst##_index}
+
+/* 不少于 2n 的最小的 2 的幂（至少 8），散列目录的项数 */
+#define EE_DIR_SIZE(n)                                                      \
+  ((n) <= 4      ? 8                                                        \
+   : (n) <= 8    ? 16                                                       \
+   : (n) <= 16   ? 32                                                       \
+   : (n) <= 32   ? 64                                                       \
+   : (n) <= 64   ? 128                                                      \
+   : (n) <= 128  ? 256                                                      \
+   : (n) <= 256  ? 512                                                      \
+   : (n) <= 512  ? 1024                                                     \
+   : (n) <= 1024 ? 2048                                                     \
+   : (n) <= 2048 ? 4096                                                     \
+                 : 8192)
+
+/* 同 EE_INSTANCE_DEFINE，但虚拟地址不按顺序分配：表中的名字是调用者定义的常量，
+   其值即虚拟地址，可以不连续（如按场景、镜头分段编号）。EE_InstInit 建立散列目录，
+   由虚拟地址查找变量仍是 O(1)。虚拟地址不能小于 3 或大于 0xFFFC，取反后不能与
+   表中的地址相同。不再使用的变量要留在表中：删除后它的记录不再被认作记录，
+   写入页中其后的记录会丢失 */
+#define EE_INSTANCE_DEFINE_KEYED(inst, TABLE, start_addr, pages)         \
+  static const uint16_t inst##_var_key[] = {TABLE(EE_INST_VAR_KEY)};     \
+  static const uint16_t inst##_var_size[] = {TABLE(EE_INST_VAR_SIZE)};   \
+  static const uint32_t inst##_var_default[] = {                         \
+      TABLE(EE_INST_VAR_DEFAULT)};                                       \
+  static ee_index_t inst##_index[0 TABLE(EE_INST_VAR_COUNT)];            \
+  static uint16_t inst##_dir[EE_DIR_SIZE(0 TABLE(EE_INST_VAR_COUNT))];   \
+  ee_instance_t inst = {.start = (start_addr),                           \
+                        .page_count = (pages),                           \
+                        .var_count = 0 TABLE(EE_INST_VAR_COUNT),         \
+                        .var_key = inst##_var_key,                       \
+                        .var_size = inst##_var_size,                     \
+                        .var_default = inst##_var_default,               \
+                        .index = inst##_index,                           \
+                        .dir = inst##_dir,                               \
+                        .dir_mask =                                      \
+                            EE_DIR_SIZE(0 TABLE(EE_INST_VAR_COUNT)) - 1}
+
+/* 由 EE_VAR_TABLE 定义的默认实例，位于 EEPROM_START_ADDRESS 起的 EE_PAGE_COUNT 页，
+   下面不带实例参数的接口都作用于它 */
+extern ee_instance_t ee_default_instance;
+
+uint16_t EE_InstInit(ee_instance_t* inst);
+uint16_t EE_InstRead(ee_instance_t* inst, uint16_t virt_addr, void* data,
+                     uint16_t size, uint16_t* br);
+uint16_t EE_InstReadAll(ee_instance_t* inst, const ee_batch_item_t* items,
+                        uint16_t count, uint16_t* br, uint8_t* missing);
+uint16_t EE_InstReadRef(ee_instance_t* inst, uint16_t virt_addr,
+                        const void** ptr, uint16_t* len, uint32_t* gen);
+uint8_t EE_InstRefValid(ee_instance_t* inst, uint32_t gen);
+uint16_t EE_InstWrite(ee_instance_t* inst, uint16_t virt_addr, void* data,
+                      uint16_t size);
+uint16_t EE_InstWriteBatch(ee_instance_t* inst, const ee_batch_item_t* items,
+                           uint16_t count);
+uint16_t EE_InstStreamOpenWrite(ee_instance_t* inst, ee_stream_t* stream,
+                               uint16_t virt_addr);
+uint16_t EE_InstStreamOpenRead(ee_instance_t* inst, ee_stream_t* stream,
+                              uint16_t virt_addr);
+uint16_t EE_StreamWrite(ee_stream_t* stream, const void* data, uint16_t size);
+uint16_t EE_StreamCommit(ee_stream_t* stream);
+uint16_t EE_StreamRead(ee_stream_t* stream, void* data, uint16_t size,
+                       uint16_t* br);
+uint16_t EE_InstGetFreeSpace(ee_instance_t* inst);
+uint16_t EE_InstMaintenance(ee_instance_t* inst, uint16_t budget);
+#if EE_SKIP_UNCHANGED
+void EE_InstGetSkipStats(ee_instance_t* inst, ee_skip_stats_t* stats);
+#endif
+#if EE_STATS
+void EE_InstGetStats(ee_instance_t* inst, ee_stats_t* stats);
+void EE_InstResetStats(ee_instance_t* inst);
+#endif
+#if EE_WRITE_BACK
+uint16_t EE_InstFlush(ee_instance_t* inst);
+uint16_t EE_InstPowerFail(ee_instance_t* inst);
+#endif
+#if EE_ASYNC_QUEUE
+uint16_t EE_InstWriteAsync(ee_instance_t* inst, uint16_t virt_addr,
+                           const void* data, uint16_t size, ee_async_t* req);
+uint16_t EE_InstAsyncService(ee_instance_t* inst);
+#endif
+
 uint16_t EE_Init(void);
 uint16_t EE_ReadVariable(uint16_t virt_addr, void* data, uint16_t size, uint16_t *br);
+uint16_t EE_ReadAll(const ee_batch_item_t* items, uint16_t count, uint16_t* br,
+                    uint8_t* missing);
+uint16_t EE_ReadVariableRef(uint16_t virt_addr, const void** ptr, uint16_t* len,
+                            uint32_t* gen);
+uint8_t EE_RefValid(uint32_t gen);
 uint16_t EE_WriteVaribal(uint16_t virt_addr, void* data, uint16_t size);
+uint16_t EE_WriteBatch(const ee_batch_item_t* items, uint16_t count);
+uint16_t EE_StreamOpenWrite(ee_stream_t* stream, uint16_t virt_addr);
+uint16_t EE_StreamOpenRead(ee_stream_t* stream, uint16_t virt_addr);
+uint16_t EE_GetFreeSpace(void);
+uint16_t EE_Maintenance(uint16_t budget);
+#if EE_SKIP_UNCHANGED
+void EE_GetSkipStats(ee_skip_stats_t* stats);
+#endif
+#if EE_STATS
+void EE_GetStats(ee_stats_t* stats);
+void EE_ResetStats(void);
+#endif
+#if EE_WRITE_BACK
+uint16_t EE_Flush(void);
+uint16_t EE_PowerFail(void);
+#endif
+#if EE_ASYNC_QUEUE
+uint16_t EE_WriteAsync(uint16_t virt_addr, const void* data, uint16_t size,
+                       ee_async_t* req);
+uint16_t EE_AsyncService(void);
+#endif
+#if EE_BENCHMARK
+uint16_t EE_Benchmark(ee_bench_t* bench);
+#endif
 
 uint16_t BaseWrite(uint32_t addr, void* data, uint16_t size);
 uint16_t BaseRead(uint32_t addr, void* data, uint16_t size);
 uint16_t BaseErase(uint32_t addr);
+/* 旧版接口：按旧版两页格式（EE_PROGRAM_WIDTH 为 4）写页头标记，新格式的页不使用 */
 uint16_t EE_Mark(uint32_t addr, uint64_t mk);
 
 #endif
@@ -0,0 +1,83 @@
+/*!
+    \brief      Flash 后端接口
+                BaseWrite/BaseRead/BaseErase 只通过这里的函数访问 Flash：
+                - 目标板：eeprom_port_gd32.c，直接调用 FMC 库
+                - 主机仿真：定义 EE_PORT_SIM 并链接 eeprom_port_sim.c
+*/
+#ifndef EEPROM_PORT_H
+#define EEPROM_PORT_H
+
+#ifdef EE_PORT_SIM
+#include <stdint.h>
+#ifndef __IO
+#define __IO volatile
+#endif
+#else
+#include "gd32e10x.h"
+#endif
+
+/* 一次编程操作写入的字节数（4/8/16），由芯片决定；记录布局按它对齐 */
+#ifndef EE_PROGRAM_WIDTH
+#define EE_PROGRAM_WIDTH 4
+#endif
+#if EE_PROGRAM_WIDTH != 4 && EE_PROGRAM_WIDTH != 8 && EE_PROGRAM_WIDTH != 16
+#error "EE_PROGRAM_WIDTH must be 4, 8 or 16"
+#endif
+
+/* 在 addr（EE_PROGRAM_WIDTH 对齐）处编程 EE_PROGRAM_WIDTH 字节，
+   返回 FLASH_COMPLETE 或错误码 */
+uint16_t EE_PortProgram(uint32_t addr, const uint32_t* data);
+/* 非阻塞编程（EE_ASYNC_QUEUE 使用）：EE_PortProgramStart 启动一次编程后立即返回，
+   EE_PortProgramPoll 在编程进行中返回 EE_PORT_BUSY，结束后返回 FLASH_COMPLETE 或错误码 */
+#define EE_PORT_BUSY ((uint16_t)0x00B4)
+uint16_t EE_PortProgramStart(uint32_t addr, const uint32_t* data);
+uint16_t EE_PortProgramPoll(void);
+/* 擦除 addr 所在页，返回 FLASH_COMPLETE 或错误码 */
+uint16_t EE_PortErasePage(uint32_t addr);
+/* 自由运行的周期计数器，用于 EE_Benchmark 等测量 */
+uint32_t EE_PortCycles(void);
+
+/* EE_CONCURRENT 时写入方（写入、回收、维护）之间的互斥，由应用用 RTOS 互斥量实现，
+   互斥量应支持优先级继承；读取不加锁 */
+void EE_PortLock(void);
+void EE_PortUnlock(void);
+/* 内存屏障：保证版本号与索引、数据之间的访问顺序 */
+#ifdef EE_PORT_SIM
+#define EE_PORT_BARRIER() __sync_synchronize()
+#else
+#define EE_PORT_BARRIER() __DMB()
+#endif
+
+/* 比较交换：*addr 等于 expect 时写入 value 并返回 1，否则返回 0（可能偶尔失败，
+   调用者重试）。EE_STATS 与 EE_CONCURRENT 同时打开时，不加锁的读取方用它累加统计 */
+#ifdef EE_PORT_SIM
+#define EE_PortCas(addr, expect, value) \
+  __sync_bool_compare_and_swap((addr), (expect), (value))
+#else
+static inline uint8_t EE_PortCas(__IO uint32_t* addr, uint32_t expect,
+                                 uint32_t value) {
+  if (__LDREXW(addr) != expect) {
+    __CLREX();
+    return 0;
+  }
+  return __STREXW(value, addr) == 0;
+}
+#endif
+
+/* 读取 addr（4 字节对齐）处的一个字；EE_PortMap 返回 addr 处内容的只读指针，
+   供 EE_ReadVariableRef 直接访问记录，内容在该页被擦除前不变 */
+#ifdef EE_PORT_SIM
+uint32_t EE_PortReadWord(uint32_t addr);
+const void* EE_PortMap(uint32_t addr);
+#else
+/* 片上 Flash 直接映射，读操作内联 */
+static inline uint32_t EE_PortReadWord(uint32_t addr) {
+  return *(__IO uint32_t*)addr;
+}
+
+static inline const void* EE_PortMap(uint32_t addr) {
+  return (const void*)addr;
+}
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+/*!
+    \brief      GD32E10x FMC 后端
+*/
+#include "eeprom_port.h"
+
+#if EE_PROGRAM_WIDTH != 4
+#error "GD32E10x FMC programs 32-bit words: EE_PROGRAM_WIDTH must be 4"
+#endif
+
+/* fmc_state_enum 中 FMC_READY 为 0，与 FLASH_COMPLETE 一致 */
+uint16_t EE_PortProgram(uint32_t addr, const uint32_t* data) {
+  return (uint16_t)fmc_word_program(addr, data[0]);
+}
+
+/* 编程结束后 FMC 置 ENDF，可打开 FMC_INT_END 中断，在中断中通知调用
+   EE_AsyncService 的任务 */
+uint16_t EE_PortProgramStart(uint32_t addr, const uint32_t* data) {
+  if (FMC_STAT & FMC_STAT_BUSY) {
+    return EE_PORT_BUSY;
+  }
+  /* 清除上次的结束和错误标志（写 1 清除） */
+  FMC_STAT = FMC_STAT_ENDF | FMC_STAT_PGERR | FMC_STAT_WPERR;
+  FMC_CTL |= FMC_CTL_PG;
+  REG32(addr) = data[0];
+  return FMC_READY;
+}
+
+uint16_t EE_PortProgramPoll(void) {
+  uint32_t stat = FMC_STAT;
+
+  if (stat & FMC_STAT_BUSY) {
+    return EE_PORT_BUSY;
+  }
+  FMC_CTL &= ~FMC_CTL_PG;
+  if (stat & FMC_STAT_PGERR) {
+    return FMC_PGERR;
+  }
+  if (stat & FMC_STAT_WPERR) {
+    return FMC_WPERR;
+  }
+  return FMC_READY;
+}
+
+uint16_t EE_PortErasePage(uint32_t addr) {
+  return (uint16_t)fmc_page_erase(addr);
+}
+
+/* DWT 周期计数器，第一次调用时打开 */
+uint32_t EE_PortCycles(void) {
+  if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  }
+  return DWT->CYCCNT;
+}
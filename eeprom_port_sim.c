@@ -0,0 +1,191 @@
+/*!
+    \brief      主机端 Flash 仿真后端，见 eeprom_sim.h
+*/
+#include "eeprom_sim.h"
+
+#include <string.h>
+#if EE_CONCURRENT
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static uint8_t sim_flash[EE_SIM_FLASH_SIZE];
+static ee_sim_config_t sim_cfg;
+static ee_sim_counters_t sim_cnt;
+static int32_t sim_ops_left = -1; /* <0: 不注入掉电 */
+static uint64_t sim_prog_done;    /* 非阻塞编程结束的虚拟时间 */
+static uint16_t sim_prog_status;
+
+/* 默认时延只作量级参考，按实际芯片手册修改 */
+static const ee_sim_config_t sim_default_cfg = {
+    40000,    /* 编程一个单元 40us */
+    20000000, /* 页擦除 20ms */
+    25,       /* 读访问 25ns */
+    120,      /* GD32E10x 最高主频 120MHz */
+};
+
+/*!
+    \brief      检查地址是否落在仿真区域，并在需要时消耗一次掉电计数
+    \param[in]  addr: 绝对地址
+    \param[in]  size: 访问字节数
+    \param[in]  consume: 1 表示这是一次编程/擦除操作
+    \retval     FLASH_COMPLETE 或错误码
+*/
+static uint16_t SimCheck(uint32_t addr, uint32_t size, uint8_t consume) {
+  if (addr < EE_SIM_FLASH_BASE ||
+      addr + size > EE_SIM_FLASH_BASE + EE_SIM_FLASH_SIZE) {
+    return ADDR_INVALID;
+  }
+  if (consume && sim_ops_left >= 0) {
+    if (sim_ops_left == 0) {
+      return EE_SIM_POWER_LOST;
+    }
+    sim_ops_left--;
+  }
+  return FLASH_COMPLETE;
+}
+
+void EE_SimInit(const ee_sim_config_t* cfg) {
+  sim_cfg = cfg != (void*)0 ? *cfg : sim_default_cfg;
+  memset(sim_flash, 0xFF, sizeof(sim_flash));
+  memset(&sim_cnt, 0, sizeof(sim_cnt));
+  sim_ops_left = -1;
+  sim_prog_done = 0;
+}
+
+void EE_SimResetCounters(void) { memset(&sim_cnt, 0, sizeof(sim_cnt)); }
+
+void EE_SimGetCounters(ee_sim_counters_t* cnt) { *cnt = sim_cnt; }
+
+uint64_t EE_SimNow(void) { return sim_cnt.elapsed_ns; }
+
+/* 不访问 Flash 的等待，只推进虚拟时钟（例如测试写回缓存的超时） */
+void EE_SimSleep(uint64_t ns) { sim_cnt.elapsed_ns += ns; }
+
+uint32_t EE_PortCycles(void) {
+  return (uint32_t)(sim_cnt.elapsed_ns * sim_cfg.cpu_mhz / 1000);
+}
+
+/*!
+    \brief      注入掉电：再允许 ops 次编程/擦除，之后全部失败
+    \param[in]  ops: 剩余操作次数，<0 取消注入
+*/
+void EE_SimPowerCutAfter(int32_t ops) { sim_ops_left = ops; }
+
+#if EE_CONCURRENT
+/* 主机上用 pthread 互斥量模拟 RTOS 互斥量（链接时加 -pthread）；
+   多线程访问时统计计数器只作参考 */
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void EE_PortLock(void) { pthread_mutex_lock(&sim_lock); }
+
+void EE_PortUnlock(void) { pthread_mutex_unlock(&sim_lock); }
+#endif
+
+/* 页头编程和擦除改变页状态：让出 CPU，让读取线程在写入方的这些步骤之间运行
+   （目标板上编程、擦除期间其他任务同样可能运行），单核主机上也能覆盖这些时序 */
+static void SimYield(void) {
+#if EE_CONCURRENT
+  sched_yield();
+#endif
+}
+
+/* 直接访问仿真存储，用于构造损坏场景或检查内容 */
+uint8_t* EE_SimFlash(void) { return sim_flash; }
+
+/* 等待进行中的非阻塞编程结束 */
+static void SimWaitIdle(void) {
+  if (sim_cnt.elapsed_ns < sim_prog_done) {
+    sim_cnt.elapsed_ns = sim_prog_done;
+  }
+}
+
+/* 按 NOR 规则编程一个单元，不计时间 */
+static uint16_t SimProgram(uint32_t addr, const uint32_t* data) {
+  uint16_t status = SimCheck(addr, EE_PROGRAM_WIDTH, 1);
+  uint32_t cur;
+  uint16_t i;
+  if (status != FLASH_COMPLETE) {
+    return status;
+  }
+  if (addr % EE_PROGRAM_WIDTH != 0) {
+    return EE_SIM_PGERR;
+  }
+  for (i = 0; i < EE_PROGRAM_WIDTH / 4; i++) {
+    memcpy(&cur, &sim_flash[addr - EE_SIM_FLASH_BASE + i * 4], 4);
+    /* NOR：只能把 1 写成 0 */
+    if ((data[i] & ~cur) != 0) {
+      return EE_SIM_PGERR;
+    }
+  }
+  /* 一个编程单元作为一次操作写入，掉电时不会只写入一部分 */
+  memcpy(&sim_flash[addr - EE_SIM_FLASH_BASE], data, EE_PROGRAM_WIDTH);
+  sim_cnt.words_programmed++;
+  return FLASH_COMPLETE;
+}
+
+uint16_t EE_PortProgram(uint32_t addr, const uint32_t* data) {
+  uint16_t status;
+
+  SimWaitIdle();
+  status = SimProgram(addr, data);
+  if (status == FLASH_COMPLETE) {
+    sim_cnt.elapsed_ns += sim_cfg.program_ns;
+  }
+  if ((addr - EE_SIM_FLASH_BASE) % EE_SIM_PAGE_SIZE < 2 * EE_PROGRAM_WIDTH) {
+    SimYield();
+  }
+  return status;
+}
+
+/* 立即按结果修改存储，EE_PortProgramPoll 到 program_ns 之后才报告结束 */
+uint16_t EE_PortProgramStart(uint32_t addr, const uint32_t* data) {
+  if (sim_cnt.elapsed_ns < sim_prog_done) {
+    return EE_PORT_BUSY;
+  }
+  sim_prog_status = SimProgram(addr, data);
+  sim_prog_done = sim_cnt.elapsed_ns + sim_cfg.program_ns;
+  return FLASH_COMPLETE;
+}
+
+/* 每次查询按一次读访问计时 */
+uint16_t EE_PortProgramPoll(void) {
+  sim_cnt.elapsed_ns += sim_cfg.read_ns;
+  if (sim_cnt.elapsed_ns < sim_prog_done) {
+    return EE_PORT_BUSY;
+  }
+  return sim_prog_status;
+}
+
+uint16_t EE_PortErasePage(uint32_t addr) {
+  uint16_t status;
+
+  SimWaitIdle();
+  status = SimCheck(addr, 1, 1);
+  if (status != FLASH_COMPLETE) {
+    return status;
+  }
+  addr -= (addr - EE_SIM_FLASH_BASE) % EE_SIM_PAGE_SIZE;
+  memset(&sim_flash[addr - EE_SIM_FLASH_BASE], 0xFF, EE_SIM_PAGE_SIZE);
+  sim_cnt.pages_erased++;
+  sim_cnt.elapsed_ns += sim_cfg.erase_ns;
+  SimYield();
+  return FLASH_COMPLETE;
+}
+
+uint32_t EE_PortReadWord(uint32_t addr) {
+  uint32_t data = 0xFFFFFFFF;
+  if (SimCheck(addr, 4, 0) == FLASH_COMPLETE) {
+    memcpy(&data, &sim_flash[addr - EE_SIM_FLASH_BASE], 4);
+  }
+  sim_cnt.read_accesses++;
+  sim_cnt.elapsed_ns += sim_cfg.read_ns;
+  return data;
+}
+
+const void* EE_PortMap(uint32_t addr) {
+  if (SimCheck(addr, 1, 0) != FLASH_COMPLETE) {
+    return (void*)0;
+  }
+  return &sim_flash[addr - EE_SIM_FLASH_BASE];
+}
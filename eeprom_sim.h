@@ -0,0 +1,49 @@
+/*!
+    \brief      主机端 Flash 仿真（EE_PORT_SIM）
+                用 RAM 模拟 NOR Flash：编程只能把位从 1 写成 0，擦除以页为单位。
+                每次编程/擦除/读取按配置的时延累加到虚拟时钟，并统计访问的字数，
+                便于在 PC 上评估各项优化的代价。
+*/
+#ifndef EEPROM_SIM_H
+#define EEPROM_SIM_H
+
+#include "eeprom.h"
+
+/* 仿真 Flash 区域，默认覆盖 EEPROM 使用的所有页 */
+#ifndef EE_SIM_FLASH_BASE
+#define EE_SIM_FLASH_BASE EEPROM_START_ADDRESS
+#endif
+#ifndef EE_SIM_FLASH_SIZE
+#define EE_SIM_FLASH_SIZE (EE_PAGE_COUNT * PAGE_SIZE)
+#endif
+#ifndef EE_SIM_PAGE_SIZE
+#define EE_SIM_PAGE_SIZE PAGE_SIZE
+#endif
+
+/* 仿真错误码 */
+#define EE_SIM_PGERR      ((uint16_t)0x0002) /* 与 FMC_PGERR 对应：0->1 或未对齐 */
+#define EE_SIM_POWER_LOST ((uint16_t)0x00B0) /* 注入的掉电，之后所有操作失败 */
+
+typedef struct {
+  uint32_t program_ns; /* 编程一个单元（EE_PROGRAM_WIDTH 字节）的时间 */
+  uint32_t erase_ns;   /* 擦除一页的时间 */
+  uint32_t read_ns;    /* 一次读访问的时间 */
+  uint32_t cpu_mhz;    /* EE_PortCycles 按此主频把虚拟时间换算为周期 */
+} ee_sim_config_t;
+
+typedef struct {
+  uint32_t read_accesses; /* 读访问（字）次数 */
+  uint32_t words_programmed; /* 编程操作次数，每次 EE_PROGRAM_WIDTH 字节 */
+  uint32_t pages_erased;
+  uint64_t elapsed_ns; /* 按上述时延累加的虚拟时间 */
+} ee_sim_counters_t;
+
+void EE_SimInit(const ee_sim_config_t* cfg);
+void EE_SimResetCounters(void);
+void EE_SimGetCounters(ee_sim_counters_t* cnt);
+uint64_t EE_SimNow(void);
+void EE_SimSleep(uint64_t ns);
+void EE_SimPowerCutAfter(int32_t ops);
+uint8_t* EE_SimFlash(void);
+
+#endif
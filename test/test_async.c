@@ -0,0 +1,245 @@
+/*!
+    \brief      异步写入队列（EE_ASYNC_QUEUE）：提交后立即读出新值，队列满时拒绝，
+                反复调用 EE_InstAsyncService 直到完成，检查完成回调和写入结果，
+                重新 EE_InstInit 后值仍在。
+                大变量流式写入打开后提交的异步写入先于下一块写完，流返回 STREAM_ABORTED。
+                EE_CONCURRENT 时另有读取线程不加锁读取正在出队的变量，
+                读到的值必须完整且不回退
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+#if !EE_ASYNC_QUEUE
+#error "build with -DEE_ASYNC_QUEUE=4"
+#endif
+#if EE_CONCURRENT
+#include <pthread.h>
+#endif
+
+#define AS_TABLE(X)     \
+  X(AS_COUNT, 8, 0)     \
+  X(AS_NAME, 0, 0)      \
+  X(AS_PAN, 4, 0)       \
+  X(AS_MODE, 1, 0)       \
+  X(AS_BIG, 2 * VARIABLE_MAX_SIZE, 0)
+
+enum { AS_BASE = 0x5000, AS_TABLE(EE_VAR_ENUM) AS_END };
+EE_INSTANCE_DEFINE(as, AS_TABLE, AS_BASE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+#define AS_COUNT_OF (AS_END - AS_BASE - 1)
+#define AS_SMALL 4 /* 随机异步写入的变量，不含大变量 */
+#define ROUNDS 5000
+
+static const uint16_t as_size[AS_SMALL] = {8, 0, 4, 1};
+
+#define FAIL(...)                               \
+  do {                                          \
+    printf(__VA_ARGS__);                        \
+    printf(" (line %d)\n", __LINE__);           \
+    return 1;                                   \
+  } while (0)
+
+static uint8_t model[AS_COUNT_OF][VARIABLE_MAX_SIZE];
+static uint16_t model_len[AS_COUNT_OF];
+static ee_async_t reqs[EE_ASYNC_QUEUE];
+static uint32_t callbacks;
+static uint32_t count;
+
+static void on_done(ee_async_t* req) {
+  (void)req;
+  callbacks++;
+}
+
+/* 编程要过一段虚拟时间才结束，期间应用做自己的事 */
+static void service_all(void) {
+  while (EE_InstAsyncService(&as) == EE_ASYNC_PENDING) {
+    EE_SimSleep(5000);
+  }
+}
+
+static int check_all(const char* tag) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint16_t slot, br;
+
+  for (slot = 0; slot < AS_COUNT_OF; slot++) {
+    if (model_len[slot] == 0) {
+      continue;
+    }
+    if (EE_InstRead(&as, (uint16_t)(AS_BASE + 1 + slot), buf, sizeof(buf),
+                    &br) != 0 ||
+        br != model_len[slot] || memcmp(buf, model[slot], br) != 0) {
+      printf("%s: slot %u mismatch\n", tag, slot);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* 流式写入大变量期间有异步写入：异步写入照常完成，流放弃，大变量保持原值 */
+static uint8_t big_model[2 * VARIABLE_MAX_SIZE];
+
+static int check_big(uint32_t round) {
+  static uint8_t buf[2 * VARIABLE_MAX_SIZE];
+  uint16_t br;
+
+  if (EE_InstRead(&as, AS_BIG, buf, sizeof(buf), &br) > 1 ||
+      memcmp(buf, big_model, sizeof(buf)) != 0) {
+    printf("round %u: big mismatch\n", round);
+    return 1;
+  }
+  return 0;
+}
+
+static int stream_vs_async(uint32_t round) {
+  static uint8_t big[2 * VARIABLE_MAX_SIZE];
+  ee_stream_t stream;
+  ee_async_t req = {0};
+  uint8_t mode = (uint8_t)round;
+  uint16_t status;
+
+  memset(big, (int)round, sizeof(big));
+  if (EE_InstStreamOpenWrite(&as, &stream, AS_BIG) != FLASH_COMPLETE) {
+    printf("round %u: stream open failed\n", round);
+    return 1;
+  }
+  if (EE_InstWriteAsync(&as, AS_MODE, &mode, 1, &req) != EE_ASYNC_PENDING) {
+    printf("round %u: submit failed\n", round);
+    return 1;
+  }
+  /* 异步写入已开始编程，写入位置正是流的下一块 */
+  EE_InstAsyncService(&as);
+  status = EE_StreamWrite(&stream, big, sizeof(big));
+  if (status == FLASH_COMPLETE) {
+    status = EE_StreamCommit(&stream);
+  }
+  if (status != STREAM_ABORTED || req.status != FLASH_COMPLETE) {
+    printf("round %u: stream 0x%x async 0x%x\n", round, status, req.status);
+    return 1;
+  }
+  model[AS_MODE - AS_BASE - 1][0] = mode;
+  model_len[AS_MODE - AS_BASE - 1] = 1;
+  if (check_big(round)) {
+    return 1;
+  }
+  /* 重新打开后写入成功 */
+  if (EE_InstStreamOpenWrite(&as, &stream, AS_BIG) != FLASH_COMPLETE ||
+      EE_StreamWrite(&stream, big, sizeof(big)) != FLASH_COMPLETE ||
+      EE_StreamCommit(&stream) != FLASH_COMPLETE) {
+    printf("round %u: stream rewrite failed\n", round);
+    return 1;
+  }
+  memcpy(big_model, big, sizeof(big));
+  return check_big(round);
+}
+
+#if EE_CONCURRENT
+static volatile int stop;
+static unsigned long reads, bad;
+
+/* AS_COUNT 的前后 4 字节都是计数，读到一半的值两者不同 */
+static void* reader(void* arg) {
+  uint32_t value[2], last = 0;
+  uint16_t br, status;
+
+  (void)arg;
+  while (!stop) {
+    status = EE_InstRead(&as, AS_COUNT, value, sizeof(value), &br);
+    if (status == 1) {
+      continue;
+    }
+    if (status != 0 || br != sizeof(value) || value[0] != value[1] ||
+        value[0] < last) {
+      bad++;
+    }
+    last = value[0];
+    reads++;
+  }
+  return NULL;
+}
+#endif
+
+int main(void) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint32_t round, submitted = 0, rejected = 0;
+  uint16_t slot, len, i, q, n, status;
+  ee_async_t extra = {0};
+#if EE_CONCURRENT
+  pthread_t th;
+#endif
+
+  srand(5);
+  EE_SimInit(NULL);
+  if (EE_InstInit(&as) != FLASH_COMPLETE) FAIL("init");
+#if EE_CONCURRENT
+  pthread_create(&th, NULL, reader, NULL);
+#endif
+  for (round = 1; round <= ROUNDS; round++) {
+    n = (uint16_t)(1 + rand() % EE_ASYNC_QUEUE);
+    for (q = 0; q < n; q++) {
+      slot = (uint16_t)(rand() % AS_SMALL);
+      if (slot == AS_COUNT - AS_BASE - 1) {
+        count++;
+        memcpy(buf, &count, 4);
+        memcpy(buf + 4, &count, 4);
+        len = 8;
+      } else {
+        len = slot == AS_NAME - AS_BASE - 1 ? (uint16_t)(1 + rand() % 40)
+                                            : as_size[slot];
+        for (i = 0; i < len; i++) {
+          buf[i] = (uint8_t)rand();
+        }
+      }
+      reqs[q].done = on_done;
+      status = EE_InstWriteAsync(&as, (uint16_t)(AS_BASE + 1 + slot), buf, len,
+                                 &reqs[q]);
+      if (status != EE_ASYNC_PENDING || reqs[q].status != EE_ASYNC_PENDING) {
+        FAIL("round %u: submit 0x%x", round, status);
+      }
+      submitted++;
+      /* 数据已复制，缓冲区可以重用；写完之前读出的也是新值 */
+      memcpy(model[slot], buf, len);
+      model_len[slot] = len;
+      memset(buf, 0, sizeof(buf));
+      if (check_all("pending")) FAIL("round %u", round);
+      /* 每提交一条推进一步，编程一般还没结束 */
+      EE_InstAsyncService(&as);
+    }
+    /* 队首还在写入时队列是满的，拒绝提交，控制块不动 */
+    if (n == EE_ASYNC_QUEUE && reqs[0].status == EE_ASYNC_PENDING) {
+      extra.status = 0;
+      status = EE_InstWriteAsync(&as, AS_MODE, buf, 1, &extra);
+      if (status != ASYNC_QUEUE_FULL || extra.status != 0) {
+        FAIL("round %u: full queue 0x%x", round, status);
+      }
+      rejected++;
+    }
+    service_all();
+    for (q = 0; q < n; q++) {
+      if (reqs[q].status != FLASH_COMPLETE) {
+        FAIL("round %u: request %u 0x%x", round, q, reqs[q].status);
+      }
+    }
+    if (check_all("done")) FAIL("round %u", round);
+    if (round % 7 == 0) {
+      EE_InstMaintenance(&as, 4);
+    }
+    if (round % 50 == 0 && (stream_vs_async(round) || check_all("stream"))) {
+      FAIL("round %u", round);
+    }
+  }
+#if EE_CONCURRENT
+  stop = 1;
+  pthread_join(th, NULL);
+  if (bad != 0) FAIL("reader: %lu bad of %lu", bad, reads);
+#endif
+  if (callbacks != submitted) FAIL("callbacks %u", callbacks);
+  if (EE_InstInit(&as) != FLASH_COMPLETE) FAIL("reinit");
+  if (check_all("reinit") || check_big(0)) FAIL("after reinit");
+  if (rejected == 0) FAIL("queue never full");
+  printf("ok rounds=%u writes=%u callbacks=%u full=%u\n", ROUNDS, submitted,
+         callbacks, rejected);
+  return 0;
+}
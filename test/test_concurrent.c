@@ -0,0 +1,178 @@
+/*!
+    \brief      EE_CONCURRENT 下不加锁读取的压力测试（pthread）：主线程不断写入、
+                批量写入和维护（回收、换页、擦除），读取线程同时读取并检查：
+                - EE_InstRead 读到的值完整且不回退
+                - EE_InstReadAll 不会读到一次批量写入的一半
+                - EE_InstReadRef 的指针在 EE_InstRefValid 确认有效时内容完整
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+#if !EE_CONCURRENT
+#error "build with -DEE_CONCURRENT=1 -pthread"
+#endif
+
+#define CC_TABLE(X)        \
+  X(CC_VALUE, 64, 0)       \
+  X(CC_PAN, 4, 0)          \
+  X(CC_TILT, 4, 0)         \
+  X(CC_REF, 16, 0)         \
+  X(CC_BYTE, 1, 0)
+
+enum { CC_BASE = 0x4000, CC_TABLE(EE_VAR_ENUM) CC_END };
+EE_INSTANCE_DEFINE(cc, CC_TABLE, CC_BASE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+#define ROUNDS 20000
+#define READERS 4
+
+static volatile int stop;
+static unsigned long reads[READERS], bad[READERS];
+
+/* 值的首尾各放一份计数，中间为固定字节，读到一半的值首尾不一致 */
+static void make_value(uint8_t* buf, uint16_t size, uint32_t count) {
+  memset(buf, 0x5A, size);
+  memcpy(buf, &count, 4);
+  memcpy(buf + size - 4, &count, 4);
+}
+
+static int check_value(const uint8_t* buf, uint16_t size, uint32_t* last) {
+  uint32_t a, b;
+  uint16_t i;
+
+  memcpy(&a, buf, 4);
+  memcpy(&b, buf + size - 4, 4);
+  for (i = 4; i < size - 4; i++) {
+    if (buf[i] != 0x5A) {
+      return 1;
+    }
+  }
+  if (a != b || a < *last) {
+    return 1;
+  }
+  *last = a;
+  return 0;
+}
+
+static void* read_value(void* arg) {
+  int id = (int)(long)arg;
+  uint8_t buf[64];
+  uint32_t last = 0;
+  uint16_t br, status;
+
+  while (!stop) {
+    status = EE_InstRead(&cc, CC_VALUE, buf, sizeof(buf), &br);
+    if (status == 1) {
+      continue;
+    }
+    if (status != 0 || br != sizeof(buf) ||
+        check_value(buf, sizeof(buf), &last)) {
+      bad[id]++;
+    }
+    reads[id]++;
+  }
+  return NULL;
+}
+
+static void* read_batch(void* arg) {
+  int id = (int)(long)arg;
+  uint32_t pan, tilt;
+  ee_batch_item_t items[] = {{CC_PAN, 4, &pan}, {CC_TILT, 4, &tilt}};
+  uint16_t status;
+
+  while (!stop) {
+    pan = tilt = 0;
+    status = EE_InstReadAll(&cc, items, 2, NULL, NULL);
+    if (status > 1 || pan != tilt) {
+      bad[id]++;
+    }
+    reads[id]++;
+  }
+  return NULL;
+}
+
+static void* read_ref(void* arg) {
+  int id = (int)(long)arg;
+  uint8_t buf[16];
+  uint32_t last = 0, gen;
+  const void* ptr;
+  uint16_t len, status;
+
+  while (!stop) {
+    status = EE_InstReadRef(&cc, CC_REF, &ptr, &len, &gen);
+    if (status != 0) {
+      if (status != 1 && status != REF_UNAVAILABLE) {
+        bad[id]++;
+      }
+      continue;
+    }
+    memcpy(buf, ptr, sizeof(buf));
+    /* 复制期间页被擦除时内容无意义，重新获取 */
+    if (!EE_InstRefValid(&cc, gen)) {
+      continue;
+    }
+    if (len != sizeof(buf) || check_value(buf, sizeof(buf), &last)) {
+      bad[id]++;
+    }
+    reads[id]++;
+  }
+  return NULL;
+}
+
+int main(void) {
+  void* (*readers[READERS])(void*) = {read_value, read_value, read_batch,
+                                      read_ref};
+  pthread_t th[READERS];
+  uint8_t value[64], ref[16], byte;
+  uint32_t round;
+  unsigned long total_reads = 0, total_bad = 0;
+  ee_sim_counters_t cnt;
+  uint16_t status;
+  int t;
+
+  EE_SimInit(NULL);
+  if (EE_InstInit(&cc) != FLASH_COMPLETE) {
+    printf("init failed\n");
+    return 1;
+  }
+  for (t = 0; t < READERS; t++) {
+    pthread_create(&th[t], NULL, readers[t], (void*)(long)t);
+  }
+  for (round = 1; round <= ROUNDS; round++) {
+    make_value(value, sizeof(value), round);
+    status = EE_InstWrite(&cc, CC_VALUE, value, sizeof(value));
+    if (status == FLASH_COMPLETE && round % 4 == 0) {
+      ee_batch_item_t items[] = {{CC_PAN, 4, &round}, {CC_TILT, 4, &round}};
+      status = EE_InstWriteBatch(&cc, items, 2);
+    }
+    if (status == FLASH_COMPLETE && round % 8 == 0) {
+      make_value(ref, sizeof(ref), round);
+      status = EE_InstWrite(&cc, CC_REF, ref, sizeof(ref));
+    }
+    if (status == FLASH_COMPLETE) {
+      byte = (uint8_t)round;
+      status = EE_InstWrite(&cc, CC_BYTE, &byte, 1);
+    }
+    if (status != FLASH_COMPLETE) {
+      printf("round %u: write 0x%x\n", round, status);
+      stop = 1;
+      total_bad++;
+      break;
+    }
+    if (round % 16 == 0) {
+      EE_InstMaintenance(&cc, 4);
+    }
+  }
+  stop = 1;
+  for (t = 0; t < READERS; t++) {
+    pthread_join(th[t], NULL);
+    total_reads += reads[t];
+    total_bad += bad[t];
+  }
+  EE_SimGetCounters(&cnt);
+  printf("%s reads=%lu bad=%lu erases=%u\n", total_bad ? "FAIL" : "ok",
+         total_reads, total_bad, cnt.pages_erased);
+  return total_bad != 0;
+}
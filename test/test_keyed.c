@@ -0,0 +1,155 @@
+/*!
+    \brief      散列目录（EE_INSTANCE_DEFINE_KEYED）：虚拟地址不连续的变量表，随机写入
+                后各变量都能由虚拟地址查到并读出最近写入的值，不在表中的地址（包括
+                表中地址的相邻值和取反值）读不到、不能写入；回收和重新 EE_InstInit
+                后值仍在。地址重复、为保留值或取反后落在表中的表由 EE_InstInit 拒绝
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+/* 按场景、镜头分段编号，另有允许范围两端的地址 */
+enum {
+  KY_MIN = 3,
+  SCENE1_SPEED = 0x1040, SCENE1_DEAD, SCENE1_NAME,
+  SCENE2_SPEED = 0x1080, SCENE2_DEAD, SCENE2_NAME,
+  SCENE3_SPEED = 0x10C0, SCENE3_DEAD, SCENE3_NAME,
+  SCENE4_SPEED = 0x1100, SCENE4_DEAD, SCENE4_NAME,
+  LENS1_FOCUS = 0x6100, LENS1_CURVE,
+  LENS2_FOCUS = 0x6200, LENS2_CURVE,
+  LENS3_FOCUS = 0x6300, LENS3_CURVE,
+  KY_HIGH = 0x8000,
+  KY_MAX = 0xFFFB
+};
+
+#define KY_TABLE(X)                                                    \
+  X(KY_MIN, 4, 0)                                                      \
+  X(SCENE1_SPEED, 2, 0) X(SCENE1_DEAD, 1, 0) X(SCENE1_NAME, 0, 0)      \
+  X(SCENE2_SPEED, 2, 0) X(SCENE2_DEAD, 1, 0) X(SCENE2_NAME, 0, 0)      \
+  X(SCENE3_SPEED, 2, 0) X(SCENE3_DEAD, 1, 0) X(SCENE3_NAME, 0, 0)      \
+  X(SCENE4_SPEED, 2, 0) X(SCENE4_DEAD, 1, 0) X(SCENE4_NAME, 0, 0)      \
+  X(LENS1_FOCUS, 4, 0) X(LENS1_CURVE, 24, 0)                           \
+  X(LENS2_FOCUS, 4, 0) X(LENS2_CURVE, 24, 0)                           \
+  X(LENS3_FOCUS, 4, 0) X(LENS3_CURVE, 24, 0)                           \
+  X(KY_HIGH, 8, 0)                                                     \
+  X(KY_MAX, 2, 0)
+
+EE_INSTANCE_DEFINE_KEYED(ky, KY_TABLE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+/* 无效的表 */
+#define DUP_TABLE(X) X(0x1040, 2, 0) X(0x2000, 4, 0) X(0x1040, 1, 0)
+#define LOW_TABLE(X) X(0x1040, 2, 0) X(2, 4, 0)
+#define HIGH_TABLE(X) X(0xFFFD, 2, 0) X(0x1040, 4, 0)
+#define NOT_TABLE(X) X(0x1234, 2, 0) X(0x2000, 4, 0) X(0xEDCB, 1, 0)
+EE_INSTANCE_DEFINE_KEYED(dup, DUP_TABLE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+EE_INSTANCE_DEFINE_KEYED(low, LOW_TABLE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+EE_INSTANCE_DEFINE_KEYED(high, HIGH_TABLE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+EE_INSTANCE_DEFINE_KEYED(inv, NOT_TABLE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+#define KY_KEY(name, size, def) (name),
+#define KY_SIZE(name, size, def) (size),
+static const uint16_t ky_key[] = {KY_TABLE(KY_KEY)};
+static const uint16_t ky_size[] = {KY_TABLE(KY_SIZE)};
+#define KY_COUNT (sizeof(ky_key) / sizeof(ky_key[0]))
+#define ROUNDS 10000
+
+#define FAIL(...)                               \
+  do {                                          \
+    printf(__VA_ARGS__);                        \
+    printf(" (line %d)\n", __LINE__);           \
+    return 1;                                   \
+  } while (0)
+
+static uint8_t model[KY_COUNT][VARIABLE_MAX_SIZE];
+static uint16_t model_len[KY_COUNT];
+
+static int in_table(uint16_t key) {
+  uint16_t i;
+  for (i = 0; i < KY_COUNT; i++) {
+    if (ky_key[i] == key) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int check(const char* tag, uint32_t round) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint16_t i, br, status;
+
+  for (i = 0; i < KY_COUNT; i++) {
+    status = EE_InstRead(&ky, ky_key[i], buf, sizeof(buf), &br);
+    if (model_len[i] == 0 ? status != 1
+                          : status != 0 || br != model_len[i] ||
+                                memcmp(buf, model[i], br) != 0) {
+      printf("round %u: %s key 0x%x mismatch (status %u)\n", round, tag,
+             ky_key[i], status);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(void) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint32_t round;
+  uint16_t i, k, len, key, br, status, absent = 0;
+  uint16_t near[5];
+
+  srand(19);
+  EE_SimInit(NULL);
+  if (EE_InstInit(&dup) != INSTANCE_INVALID) FAIL("duplicate key accepted");
+  if (EE_InstInit(&low) != INSTANCE_INVALID) FAIL("key 2 accepted");
+  if (EE_InstInit(&high) != INSTANCE_INVALID) FAIL("key 0xFFFD accepted");
+  if (EE_InstInit(&inv) != INSTANCE_INVALID) FAIL("inverted key accepted");
+  if (EE_InstInit(&ky) != FLASH_COMPLETE) FAIL("init");
+  if (check("empty", 0)) return 1;
+
+  /* 不在表中的地址：表中地址的相邻值和取反值 */
+  for (i = 0; i < KY_COUNT; i++) {
+    near[0] = (uint16_t)(ky_key[i] - 1);
+    near[1] = (uint16_t)(ky_key[i] + 1);
+    near[2] = (uint16_t)(ky_key[i] + 0x40);
+    near[3] = (uint16_t)~ky_key[i];
+    near[4] = (uint16_t)(ky_key[i] ^ 0x8000);
+    for (k = 0; k < 5; k++) {
+      key = near[k];
+      if (in_table(key)) {
+        continue;
+      }
+      memset(buf, 0, sizeof(buf));
+      if (EE_InstRead(&ky, key, buf, sizeof(buf), &br) != 1 || br != 0 ||
+          EE_InstWrite(&ky, key, buf, 1) != ADDR_INVALID) {
+        FAIL("key 0x%x not in table", key);
+      }
+      absent++;
+    }
+  }
+
+  for (round = 1; round <= ROUNDS; round++) {
+    i = (uint16_t)(rand() % KY_COUNT);
+    len = ky_size[i] != 0 ? ky_size[i] : (uint16_t)(1 + rand() % 40);
+    for (k = 0; k < len; k++) {
+      buf[k] = (uint8_t)rand();
+    }
+    status = EE_InstWrite(&ky, ky_key[i], buf, len);
+    if (status != FLASH_COMPLETE) {
+      FAIL("round %u: write 0x%x 0x%x", round, ky_key[i], status);
+    }
+    memcpy(model[i], buf, len);
+    model_len[i] = len;
+    if (round % 7 == 0) {
+      EE_InstMaintenance(&ky, 2);
+    }
+    if (round % 50 == 0 && check("random", round)) {
+      return 1;
+    }
+  }
+  if (EE_InstInit(&ky) != FLASH_COMPLETE) FAIL("reinit");
+  if (check("reinit", round)) return 1;
+  printf("ok rounds=%u vars=%u absent=%u\n", ROUNDS, (unsigned)KY_COUNT,
+         absent);
+  return 0;
+}
@@ -0,0 +1,77 @@
+/*!
+    \brief      大变量按上限字节数反复改写：默认两页实例中每次写入都要成功，
+                读出最近一次写入的值，重新 EE_InstInit 后仍能读出
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+#define LG_TABLE(X)                 \
+  X(LG_BIG, EE_LARGE_MAX_SIZE, 0)   \
+  X(LG_SMALL, 4, 0)                 \
+  X(LG_NAME, 16, 0)
+
+enum { LG_BASE = 0x3000, LG_TABLE(EE_VAR_ENUM) LG_END };
+EE_INSTANCE_DEFINE(lg, LG_TABLE, LG_BASE, EEPROM_START_ADDRESS, 2);
+
+#define ROUNDS 2000
+
+#define FAIL(...)                               \
+  do {                                          \
+    printf(__VA_ARGS__);                        \
+    printf(" (line %d)\n", __LINE__);           \
+    return 1;                                   \
+  } while (0)
+
+static uint8_t big[EE_LARGE_MAX_SIZE];
+static uint8_t buf[EE_LARGE_MAX_SIZE];
+
+static void fill(uint32_t round) {
+  uint32_t i;
+  for (i = 0; i < sizeof(big); i++) {
+    big[i] = (uint8_t)(round * 31 + i * 7);
+  }
+}
+
+static int check(const char* tag) {
+  uint16_t br;
+  if (EE_InstRead(&lg, LG_BIG, buf, sizeof(buf), &br) != 0 ||
+      br != sizeof(buf) || memcmp(buf, big, sizeof(big)) != 0) {
+    printf("%s: big mismatch\n", tag);
+    return 1;
+  }
+  return 0;
+}
+
+int main(void) {
+  uint32_t round, small;
+  uint16_t status;
+
+  EE_SimInit(NULL);
+  if (EE_InstInit(&lg) != FLASH_COMPLETE) FAIL("init");
+  for (round = 1; round <= ROUNDS; round++) {
+    fill(round);
+    status = EE_InstWrite(&lg, LG_BIG, big, sizeof(big));
+    if (status != FLASH_COMPLETE) FAIL("round %u: write 0x%x", round, status);
+    /* 其他变量的记录也占用写入页，回收时和大变量一起复制 */
+    if (round % 3 == 0) {
+      small = round;
+      status = EE_InstWrite(&lg, LG_SMALL, &small, sizeof(small));
+      if (status != FLASH_COMPLETE) FAIL("round %u: small 0x%x", round, status);
+    }
+    if (round % 5 == 0) {
+      memset(buf, (int)round, 16);
+      status = EE_InstWrite(&lg, LG_NAME, buf, 16);
+      if (status != FLASH_COMPLETE) FAIL("round %u: name 0x%x", round, status);
+    }
+    if (round % 7 == 0) {
+      EE_InstMaintenance(&lg, 2);
+    }
+    if (check("rewrite")) FAIL("round %u", round);
+  }
+  if (EE_InstInit(&lg) != FLASH_COMPLETE) FAIL("reinit");
+  if (check("reinit")) FAIL("after reinit");
+  printf("ok rounds=%u size=%u\n", ROUNDS, (unsigned)sizeof(big));
+  return 0;
+}
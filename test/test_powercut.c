@@ -0,0 +1,260 @@
+/*!
+    \brief      掉电测试：随机写入（包括批量写入、差分更新）和维护期间在任意一次
+                编程或擦除处注入掉电，重新 EE_InstInit 后检查每个变量：
+                - 没在写入的变量保持掉电前的值
+                - 正在写入的变量为旧值或新值，不会是其他内容
+                - 批量写入的各项要么都是新值，要么都是旧值
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+/* 变长变量、定长变量、能写成紧凑记录的小变量和写成差分记录的长变量 */
+#define PC_TABLE(X)      \
+  X(PC_NAME, 0, 0)       \
+  X(PC_TABLE_A, 48, 0)   \
+  X(PC_TABLE_B, 64, 0)   \
+  X(PC_MODE, 1, 0)       \
+  X(PC_PAN, 4, 0)        \
+  X(PC_TILT, 4, 0)       \
+  X(PC_SHORT, 0, 0)      \
+  X(PC_FLAGS, 2, 0)      \
+  X(PC_V0, 0, 0)         \
+  X(PC_V1, 0, 0)         \
+  X(PC_V2, 0, 0)         \
+  X(PC_V3, 0, 0)         \
+  X(PC_V4, 0, 0)         \
+  X(PC_V5, 0, 0)         \
+  X(PC_V6, 0, 0)         \
+  X(PC_V7, 0, 0)
+
+enum { PC_BASE = 2, PC_TABLE(EE_VAR_ENUM) PC_END };
+EE_INSTANCE_DEFINE(pc, PC_TABLE, PC_BASE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+#define PC_COUNT (PC_END - PC_BASE - 1)
+#define SEEDS 20
+#define ROUNDS 20000
+
+static const uint16_t pc_size[PC_COUNT] = {0, 48, 64, 1, 4, 4, 0, 2};  /* 其余为 0 */
+
+/* 最近一次确认写入的值 */
+static uint8_t model[PC_COUNT][VARIABLE_MAX_SIZE];
+static uint16_t model_len[PC_COUNT];
+static uint8_t present[PC_COUNT];
+
+/* 正在写入、掉电后可以是新值的变量 */
+static uint8_t pending[PC_COUNT][VARIABLE_MAX_SIZE];
+static uint16_t pending_len[PC_COUNT];
+static uint8_t is_pending[PC_COUNT];
+
+static uint16_t make_len(uint16_t slot) {
+  if (pc_size[slot] != 0) {
+    return pc_size[slot];
+  }
+  if (slot == PC_NAME - PC_BASE - 1) {
+    return (uint16_t)(EE_DELTA_MIN_SIZE + 8 + rand() % (64 - EE_DELTA_MIN_SIZE - 8));
+  }
+  return (uint16_t)(1 + rand() % 4);
+}
+
+/* 长变量的写入一半只改动几个字节，写成差分记录：差分记录的数据是任意字节，
+   掉电留下的半条记录中可能有形似记录尾字的数据 */
+static void make_value(uint16_t slot, uint8_t* buf, uint16_t* len) {
+  uint16_t i, n;
+
+  if (model_len[slot] >= EE_DELTA_MIN_SIZE && present[slot] && rand() % 2) {
+    *len = model_len[slot];
+    memcpy(buf, model[slot], *len);
+    for (n = (uint16_t)(1 + rand() % 3); n > 0; n--) {
+      buf[rand() % *len] = (uint8_t)rand();
+    }
+    return;
+  }
+  *len = make_len(slot);
+  for (i = 0; i < *len; i++) {
+    buf[i] = (uint8_t)rand();
+  }
+}
+
+static void set_pending(uint16_t slot, const uint8_t* buf, uint16_t len) {
+  memcpy(pending[slot], buf, len);
+  pending_len[slot] = len;
+  is_pending[slot] = 1;
+}
+
+static void commit_pending(void) {
+  uint16_t slot;
+
+  for (slot = 0; slot < PC_COUNT; slot++) {
+    if (is_pending[slot]) {
+      memcpy(model[slot], pending[slot], pending_len[slot]);
+      model_len[slot] = pending_len[slot];
+      present[slot] = 1;
+      is_pending[slot] = 0;
+    }
+  }
+}
+
+static int matches(uint16_t status, const uint8_t* got, uint16_t br,
+                   const uint8_t* want, uint16_t want_len) {
+  return status == 0 && br == want_len && memcmp(got, want, br) == 0;
+}
+
+/* 正在写入的变量新值与旧值相同时，读出的值分不出新旧 */
+static int same_as_old(uint16_t slot) {
+  return present[slot] && model_len[slot] == pending_len[slot] &&
+         memcmp(model[slot], pending[slot], model_len[slot]) == 0;
+}
+
+/* 掉电后检查所有变量，正在写入的变量读出新值时计入 model。返回错误数 */
+static int check(uint32_t seed, uint32_t round) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint8_t is_new[PC_COUNT];
+  uint16_t slot, br, status;
+  uint16_t pan = PC_PAN - PC_BASE - 1, tilt = PC_TILT - PC_BASE - 1;
+  int fails = 0;
+
+  for (slot = 0; slot < PC_COUNT; slot++) {
+    br = 0;
+    status = EE_InstRead(&pc, (uint16_t)(PC_BASE + 1 + slot), buf, sizeof(buf),
+                         &br);
+    is_new[slot] = is_pending[slot] &&
+                   matches(status, buf, br, pending[slot], pending_len[slot]);
+    if (!is_new[slot] &&
+        !(present[slot] ? matches(status, buf, br, model[slot], model_len[slot])
+                        : status == 1)) {
+      printf("seed %u round %u: slot %u corrupt (status %u, len %u)\n", seed,
+             round, slot, status, br);
+      fails++;
+    }
+  }
+  /* 批量写入的两项要么都生效，要么都不生效 */
+  if (is_pending[pan] && is_pending[tilt] && !same_as_old(pan) &&
+      !same_as_old(tilt) && is_new[pan] != is_new[tilt]) {
+    printf("seed %u round %u: half of a batch\n", seed, round);
+    fails++;
+  }
+  for (slot = 0; slot < PC_COUNT; slot++) {
+    is_pending[slot] = is_new[slot];
+  }
+  commit_pending();
+  return fails;
+}
+
+static int run(uint32_t seed) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint32_t round, pan;
+  uint16_t slot, len, status, maint;
+  int fails = 0, cut;
+
+  srand(seed);
+  memset(present, 0, sizeof(present));
+  memset(is_pending, 0, sizeof(is_pending));
+  EE_SimInit(NULL);
+  if (EE_InstInit(&pc) != FLASH_COMPLETE) {
+    printf("seed %u: init failed\n", seed);
+    return 1;
+  }
+  for (round = 0; round < ROUNDS && fails == 0; round++) {
+    cut = rand() % 4 == 0;
+    if (rand() % 8 == 0) {
+      pan = (uint32_t)rand();
+      ee_batch_item_t items[] = {{PC_PAN, 4, &pan}, {PC_TILT, 4, &pan}};
+      set_pending(PC_PAN - PC_BASE - 1, (uint8_t*)&pan, 4);
+      set_pending(PC_TILT - PC_BASE - 1, (uint8_t*)&pan, 4);
+      if (cut) {
+        EE_SimPowerCutAfter(rand() % 12);
+      }
+      status = EE_InstWriteBatch(&pc, items, 2);
+    } else {
+      /* 一半的写入落在 PC_NAME 上 */
+      slot = rand() % 2 ? (uint16_t)(PC_NAME - PC_BASE - 1)
+                        : (uint16_t)(rand() % PC_COUNT);
+      make_value(slot, buf, &len);
+      set_pending(slot, buf, len);
+      if (cut) {
+        EE_SimPowerCutAfter(rand() % 12);
+      }
+      status = EE_InstWrite(&pc, (uint16_t)(PC_BASE + 1 + slot), buf, len);
+    }
+    maint = status == FLASH_COMPLETE && round % 3 == 0
+                ? EE_InstMaintenance(&pc, 4)
+                : FLASH_COMPLETE;
+    EE_SimPowerCutAfter(-1);
+    if (status == FLASH_COMPLETE &&
+        (maint == FLASH_COMPLETE || maint == MAINTENANCE_PENDING)) {
+      commit_pending();
+      continue;
+    }
+    if (!cut) {
+      printf("seed %u round %u: write 0x%x maintenance 0x%x\n", seed, round,
+             status, maint);
+      return 1;
+    }
+    /* 掉电后重新上电 */
+    if (EE_InstInit(&pc) != FLASH_COMPLETE) {
+      printf("seed %u round %u: reinit failed\n", seed, round);
+      return 1;
+    }
+    fails += check(seed, round);
+  }
+  if (EE_InstInit(&pc) != FLASH_COMPLETE) {
+    printf("seed %u: final init failed\n", seed);
+    return 1;
+  }
+  return fails + check(seed, round);
+}
+
+/* 一条 64 字节的记录写到一半掉电：已写入的数据中有一个形似尾字的字，
+   它所说的记录恰好从这条记录的起始处开始，记录链由此也能回到页头 */
+static int torn_fake_trailer(void) {
+  uint8_t buf[64];
+  uint32_t fake;
+  uint16_t slot, units = EE_RECORD_SIZE(sizeof(buf)) / EE_PROGRAM_WIDTH;
+
+  memset(present, 0, sizeof(present));
+  memset(is_pending, 0, sizeof(is_pending));
+  EE_SimInit(NULL);
+  if (EE_InstInit(&pc) != FLASH_COMPLETE) {
+    printf("torn: init failed\n");
+    return 1;
+  }
+  for (slot = 0; slot < 4; slot++) {
+    make_value(slot, buf, &model_len[slot]);
+    memcpy(model[slot], buf, model_len[slot]);
+    present[slot] = 1;
+    EE_InstWrite(&pc, (uint16_t)(PC_BASE + 1 + slot), buf, model_len[slot]);
+  }
+  /* 偏移 28 处的字：PC_SHORT 的 28 字节记录（各编程宽度下都占 32 字节，
+     没有 EE_REC_HEAD，第一个单元可以是空白） */
+  memset(buf, 0x33, sizeof(buf));
+  fake = (uint32_t)PC_SHORT << 16 | 28;
+  memcpy(buf + 28, &fake, 4);
+  set_pending(PC_NAME - PC_BASE - 1, buf, sizeof(buf));
+  /* 写完前一半编程单元（第一个单元最后写）后掉电 */
+  EE_SimPowerCutAfter(units / 2);
+  if (EE_InstWrite(&pc, PC_NAME, buf, sizeof(buf)) == FLASH_COMPLETE) {
+    printf("torn: power cut not injected\n");
+    return 1;
+  }
+  EE_SimPowerCutAfter(-1);
+  if (EE_InstInit(&pc) != FLASH_COMPLETE) {
+    printf("torn: reinit failed\n");
+    return 1;
+  }
+  /* PC_SHORT 没有写入过，读出伪造的记录即为错误 */
+  return check(0, 0);
+}
+
+int main(void) {
+  uint32_t seed;
+  int fails = torn_fake_trailer();
+
+  for (seed = 1; seed <= SEEDS; seed++) {
+    fails += run(seed);
+  }
+  printf("%s seeds=%u rounds=%u\n", fails ? "FAIL" : "ok", SEEDS, ROUNDS);
+  return fails != 0;
+}
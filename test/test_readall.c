@@ -0,0 +1,204 @@
+/*!
+    \brief      一次读取多个变量（EE_InstReadAll）：各项的值和 br、未查找到的项的位图
+                与模型一致；声明了默认值的定长变量未写入时填入默认值，其余不改动缓冲区；
+                缓冲区小于值时截断；不在变量表中的项记为未查找到。
+                随机写入后与逐项 EE_InstRead 比较，重新 EE_InstInit 后仍一致
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+#define RA_TABLE(X)        \
+  X(RA_NAME, 0, 0)         \
+  X(RA_SPEED, 1, 5)        \
+  X(RA_PAN, 4, 0x01020304) \
+  X(RA_TILT, 4, 0)         \
+  X(RA_FLAG, 2, 0)         \
+  X(RA_CURVE, 24, 0)       \
+  X(RA_DEAD, 1, 0)         \
+  X(RA_SENS, 1, 3)         \
+  X(RA_NOTE, 0, 0)         \
+  X(RA_CAL, 16, 0)
+
+enum { RA_BASE = 0xA000, RA_TABLE(EE_VAR_ENUM) RA_END };
+EE_INSTANCE_DEFINE(ra, RA_TABLE, RA_BASE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+#define RA_COUNT (RA_END - RA_BASE - 1)
+#define ITEMS (RA_COUNT + 2) /* 另有一项不在变量表中，一项缓冲区较小 */
+#define SHORT 3              /* 较小的缓冲区的字节数 */
+#define WRITTEN 7 /* 随机写入前几个变量，RA_SENS（有默认值）及之后的不写入 */
+#define ROUNDS 5000
+#define FILL 0xCC
+
+static const uint16_t ra_size[RA_COUNT] = {0, 1, 4, 4, 2, 24, 1, 1, 0, 16};
+static const uint32_t ra_default[RA_COUNT] = {0, 5, 0x01020304, 0, 0,
+                                              0, 0, 3, 0, 0};
+
+#define FAIL(...)                               \
+  do {                                          \
+    printf(__VA_ARGS__);                        \
+    printf(" (line %d)\n", __LINE__);           \
+    return 1;                                   \
+  } while (0)
+
+static uint8_t model[RA_COUNT][VARIABLE_MAX_SIZE];
+static uint16_t model_len[RA_COUNT];
+static uint8_t data[ITEMS][VARIABLE_MAX_SIZE];
+static ee_batch_item_t items[ITEMS];
+
+static void setup_items(void) {
+  uint16_t i;
+
+  for (i = 0; i < RA_COUNT; i++) {
+    items[i].virt_addr = (uint16_t)(RA_BASE + 1 + i);
+    items[i].size = VARIABLE_MAX_SIZE;
+    items[i].data = data[i];
+  }
+  items[RA_COUNT].virt_addr = RA_END; /* 不在变量表中 */
+  items[RA_COUNT].size = VARIABLE_MAX_SIZE;
+  items[RA_COUNT].data = data[RA_COUNT];
+  items[RA_COUNT + 1].virt_addr = RA_CURVE; /* 同一变量，缓冲区较小 */
+  items[RA_COUNT + 1].size = SHORT;
+  items[RA_COUNT + 1].data = data[RA_COUNT + 1];
+}
+
+/* 第 i 项应读出的内容，返回应读出的字节数，*found 为是否查找到 */
+static uint16_t expect(uint16_t i, uint8_t* buf, uint8_t* found) {
+  uint16_t slot, len;
+
+  memset(buf, FILL, VARIABLE_MAX_SIZE);
+  *found = 0;
+  if (i == RA_COUNT) {
+    return 0;
+  }
+  slot = (uint16_t)(items[i].virt_addr - RA_BASE - 1);
+  if (model_len[slot] != 0) {
+    len = model_len[slot] < items[i].size ? model_len[slot] : items[i].size;
+    memcpy(buf, model[slot], len);
+    *found = 1;
+    return len;
+  }
+  if (ra_default[slot] == 0) {
+    return 0;
+  }
+  len = ra_size[slot] < items[i].size ? ra_size[slot] : items[i].size;
+  memset(buf, 0, len);
+  memcpy(buf, &ra_default[slot], len < 4 ? len : 4);
+  return len;
+}
+
+static int check(const char* tag, uint32_t round) {
+  uint8_t want[VARIABLE_MAX_SIZE], buf[VARIABLE_MAX_SIZE];
+  uint8_t missing[(ITEMS + 7) / 8 + 1], found;
+  uint16_t br[ITEMS], i, len, one_br, status, want_status = 0;
+
+  memset(data, FILL, sizeof(data));
+  memset(br, 0xFF, sizeof(br));
+  memset(missing, 0xFF, sizeof(missing));
+  status = EE_InstReadAll(&ra, items, ITEMS, br, missing);
+  for (i = 0; i < ITEMS; i++) {
+    len = expect(i, want, &found);
+    want_status |= (uint16_t)!found;
+    if (br[i] != len || memcmp(data[i], want, VARIABLE_MAX_SIZE) != 0 ||
+        ((missing[i / 8] >> (i % 8)) & 1) != !found) {
+      printf("round %u: %s item %u br %u want %u\n", round, tag, i, br[i],
+             len);
+      return 1;
+    }
+    /* 与逐项读取一致 */
+    memset(buf, FILL, sizeof(buf));
+    if (EE_InstRead(&ra, items[i].virt_addr, buf, items[i].size, &one_br) !=
+            (found ? 0 : 1) ||
+        one_br != len || memcmp(buf, want, VARIABLE_MAX_SIZE) != 0) {
+      printf("round %u: %s item %u differs from EE_InstRead\n", round, tag, i);
+      return 1;
+    }
+  }
+  /* 位图只写 (count + 7) / 8 字节，多余的位为 0 */
+  for (i = ITEMS; i < (ITEMS + 7) / 8 * 8; i++) {
+    if ((missing[i / 8] >> (i % 8)) & 1) {
+      printf("round %u: %s padding bit %u set\n", round, tag, i);
+      return 1;
+    }
+  }
+  if (missing[(ITEMS + 7) / 8] != 0xFF) {
+    printf("round %u: %s bitmap overrun\n", round, tag);
+    return 1;
+  }
+  if (status != want_status) {
+    printf("round %u: %s status %u\n", round, tag, status);
+    return 1;
+  }
+  return 0;
+}
+
+static uint16_t put(uint16_t slot) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint16_t len =
+      ra_size[slot] != 0 ? ra_size[slot] : (uint16_t)(1 + rand() % 40);
+  uint16_t i, status;
+
+  memcpy(buf, model[slot], sizeof(buf));
+  /* 较长的定长变量常只改几个字节（差分记录） */
+  for (i = 0; i < len; i++) {
+    if (model_len[slot] == 0 || len < 16 || rand() % 8 == 0) {
+      buf[i] = (uint8_t)rand();
+    }
+  }
+  status = EE_InstWrite(&ra, (uint16_t)(RA_BASE + 1 + slot), buf, len);
+  if (status == FLASH_COMPLETE) {
+    memcpy(model[slot], buf, len);
+    model_len[slot] = len;
+  }
+  return status;
+}
+
+int main(void) {
+  uint8_t missing[2];
+  uint32_t round;
+  uint16_t i;
+
+  srand(17);
+  EE_SimInit(NULL);
+  if (EE_InstInit(&ra) != FLASH_COMPLETE) FAIL("init");
+  setup_items();
+
+  /* 都未写入过：有默认值的填入默认值，其余不改动 */
+  if (check("empty", 0)) return 1;
+  /* br、missing 为 NULL；0 项 */
+  if (EE_InstReadAll(&ra, items, ITEMS, NULL, NULL) != 1) FAIL("null");
+  missing[0] = 0xFF;
+  if (EE_InstReadAll(&ra, items, 0, NULL, missing) != 0 || missing[0] != 0xFF) {
+    FAIL("no items");
+  }
+  /* 全部写入后，除不在变量表中的一项外都查找到 */
+  for (i = 0; i < RA_COUNT; i++) {
+    if (put(i) != FLASH_COMPLETE) FAIL("write %u", i);
+  }
+  if (check("all", 0)) return 1;
+  if (EE_InstReadAll(&ra, items, RA_COUNT, NULL, missing) != 0 ||
+      missing[0] != 0 || missing[1] != 0) {
+    FAIL("all found");
+  }
+
+  /* 重新开始，随机写入 */
+  EE_SimInit(NULL);
+  memset(model_len, 0, sizeof(model_len));
+  if (EE_InstInit(&ra) != FLASH_COMPLETE) FAIL("init");
+  for (round = 1; round <= ROUNDS; round++) {
+    if (rand() % 4 != 0 &&
+        put((uint16_t)(rand() % WRITTEN)) != FLASH_COMPLETE) {
+      FAIL("round %u: write", round);
+    }
+    if (round % 7 == 0) {
+      EE_InstMaintenance(&ra, 2);
+    }
+    if (check("random", round)) return 1;
+  }
+  if (EE_InstInit(&ra) != FLASH_COMPLETE) FAIL("reinit");
+  if (check("reinit", round)) return 1;
+  printf("ok rounds=%u items=%u\n", ROUNDS, ITEMS);
+  return 0;
+}
@@ -0,0 +1,155 @@
+/*!
+    \brief      直接读取（EE_InstReadRef）：返回的指针指向最新值，之后写入新值、回收
+                搬移都不改变它指向的内容，直到所在页被擦除；擦除后 EE_InstRefValid
+                返回 0。差分记录、大变量返回 REF_UNAVAILABLE，未写入过的返回 1
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+#define RF_TABLE(X)                   \
+  X(RF_NAME, 0, 0)                    \
+  X(RF_PAN, 4, 0)                     \
+  X(RF_FLAG, 2, 0)                    \
+  X(RF_CURVE, 24, 0)                  \
+  X(RF_BIG, 2 * VARIABLE_MAX_SIZE, 0)
+
+enum { RF_BASE = 0x9000, RF_TABLE(EE_VAR_ENUM) RF_END };
+EE_INSTANCE_DEFINE(rf, RF_TABLE, RF_BASE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+#define RF_SMALL 3 /* 随机写入并直接读取的变量 */
+#define HELD 8     /* 同时持有的指针数 */
+#define ROUNDS 20000
+
+static const uint16_t rf_size[RF_SMALL] = {0, 4, 2};
+
+#define FAIL(...)                               \
+  do {                                          \
+    printf(__VA_ARGS__);                        \
+    printf(" (line %d)\n", __LINE__);           \
+    return 1;                                   \
+  } while (0)
+
+/* 持有的指针及获取时的内容 */
+typedef struct {
+  const uint8_t* ptr;
+  uint16_t len;
+  uint32_t gen;
+  uint8_t copy[VARIABLE_MAX_SIZE];
+} held_t;
+
+static held_t held[HELD];
+static uint8_t model[RF_SMALL][VARIABLE_MAX_SIZE];
+static uint16_t model_len[RF_SMALL];
+
+static uint16_t put(uint16_t slot) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint16_t len =
+      rf_size[slot] != 0 ? rf_size[slot] : (uint16_t)(1 + rand() % 40);
+  uint16_t i, status;
+
+  for (i = 0; i < len; i++) {
+    buf[i] = (uint8_t)rand();
+  }
+  status = EE_InstWrite(&rf, (uint16_t)(RF_BASE + 1 + slot), buf, len);
+  if (status == FLASH_COMPLETE) {
+    memcpy(model[slot], buf, len);
+    model_len[slot] = len;
+  }
+  return status;
+}
+
+int main(void) {
+  uint8_t curve[24], big[2 * VARIABLE_MAX_SIZE];
+  const void* ptr;
+  uint32_t round, gen, refs = 0, dropped = 0;
+  uint16_t slot, len, h, status;
+
+  srand(13);
+  EE_SimInit(NULL);
+  if (EE_InstInit(&rf) != FLASH_COMPLETE) FAIL("init");
+
+  /* 未写入过、不在变量表中、参数为 NULL */
+  ptr = curve;
+  if (EE_InstReadRef(&rf, RF_NAME, &ptr, &len, &gen) != 1 || ptr != NULL ||
+      len != 0) {
+    FAIL("unwritten");
+  }
+  if (EE_InstReadRef(&rf, RF_END, &ptr, &len, &gen) != 1) FAIL("unknown");
+  if (EE_InstReadRef(&rf, RF_NAME, NULL, &len, &gen) != POINT_INVALID ||
+      EE_InstReadRef(&rf, RF_NAME, &ptr, NULL, &gen) != POINT_INVALID) {
+    FAIL("null");
+  }
+
+  /* 大变量的各块不连续，差分记录要套用后才是当前值 */
+  memset(big, 0x5A, sizeof(big));
+  if (EE_InstWrite(&rf, RF_BIG, big, sizeof(big)) != FLASH_COMPLETE ||
+      EE_InstReadRef(&rf, RF_BIG, &ptr, &len, &gen) != REF_UNAVAILABLE ||
+      ptr != NULL) {
+    FAIL("large variable");
+  }
+  memset(curve, 0x11, sizeof(curve));
+  if (EE_InstWrite(&rf, RF_CURVE, curve, sizeof(curve)) != FLASH_COMPLETE ||
+      EE_InstReadRef(&rf, RF_CURVE, &ptr, &len, NULL) != 0 ||
+      len != sizeof(curve) || memcmp(ptr, curve, sizeof(curve)) != 0) {
+    FAIL("full record");
+  }
+#if EE_DELTA_MIN_SIZE
+  curve[3] = 0x22;
+  if (EE_InstWrite(&rf, RF_CURVE, curve, sizeof(curve)) != FLASH_COMPLETE ||
+      EE_InstReadRef(&rf, RF_CURVE, &ptr, &len, NULL) != REF_UNAVAILABLE) {
+    FAIL("delta record");
+  }
+#endif
+
+  /* 随机写入：持有的指针在擦除前内容不变，擦除后 EE_InstRefValid 返回 0 */
+  for (round = 1; round <= ROUNDS; round++) {
+    slot = (uint16_t)(rand() % RF_SMALL);
+    if (put(slot) != FLASH_COMPLETE) FAIL("round %u: write", round);
+    if (round % 5 == 0) {
+      EE_InstMaintenance(&rf, 2);
+    }
+    for (h = 0; h < HELD; h++) {
+      if (held[h].ptr == NULL) {
+        continue;
+      }
+      if (!EE_InstRefValid(&rf, held[h].gen)) {
+        held[h].ptr = NULL;
+        dropped++;
+      } else if (memcmp(held[h].ptr, held[h].copy, held[h].len) != 0) {
+        FAIL("round %u: held pointer %u changed before erase", round, h);
+      }
+    }
+    /* 取一个新指针，内容为最近写入的值 */
+    slot = (uint16_t)(rand() % RF_SMALL);
+    h = (uint16_t)(round % HELD);
+    status = EE_InstReadRef(&rf, (uint16_t)(RF_BASE + 1 + slot), &ptr, &len,
+                            &gen);
+    if (model_len[slot] == 0) {
+      if (status != 1) FAIL("round %u: unwritten 0x%x", round, status);
+      continue;
+    }
+    if (status != 0 || len != model_len[slot] ||
+        memcmp(ptr, model[slot], len) != 0 || gen != rf.generation) {
+      FAIL("round %u: ref slot %u 0x%x", round, slot, status);
+    }
+    held[h].ptr = (const uint8_t*)ptr;
+    held[h].len = len;
+    held[h].gen = gen;
+    memcpy(held[h].copy, ptr, len);
+    refs++;
+  }
+  if (dropped == 0) FAIL("no page erased while holding pointers");
+  if (EE_InstInit(&rf) != FLASH_COMPLETE) FAIL("reinit");
+  for (slot = 0; slot < RF_SMALL; slot++) {
+    if (EE_InstReadRef(&rf, (uint16_t)(RF_BASE + 1 + slot), &ptr, &len,
+                       &gen) != 0 ||
+        len != model_len[slot] || memcmp(ptr, model[slot], len) != 0) {
+      FAIL("after reinit slot %u", slot);
+    }
+  }
+  printf("ok rounds=%u refs=%u invalidated=%u\n", ROUNDS, refs, dropped);
+  return 0;
+}
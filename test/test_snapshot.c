@@ -0,0 +1,164 @@
+/*!
+    \brief      索引快照（EE_BOOT_SNAPSHOT）：反复写入，换页和回收之后重新 EE_InstInit，
+                检查各变量的值，并与破坏快照后逐页扫描的读取次数比较，
+                确认启动时用上了快照
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+#if !EE_BOOT_SNAPSHOT
+#error "build with -DEE_BOOT_SNAPSHOT=1"
+#endif
+
+#define SN_TABLE(X)     \
+  X(SN_NAME, 0, 0)      \
+  X(SN_CURVE, 24, 0)    \
+  X(SN_PAN, 4, 0)       \
+  X(SN_TILT, 4, 0)      \
+  X(SN_MODE, 1, 0)      \
+  X(SN_A, 0, 0)         \
+  X(SN_B, 0, 0)         \
+  X(SN_C, 0, 0)         \
+  X(SN_D, 8, 0)         \
+  X(SN_E, 8, 0)         \
+  X(SN_F, 2, 0)         \
+  X(SN_G, 16, 0)
+
+enum { SN_BASE = 0x2000, SN_TABLE(EE_VAR_ENUM) SN_END };
+EE_INSTANCE_DEFINE(sn, SN_TABLE, SN_BASE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+#define SN_COUNT (SN_END - SN_BASE - 1)
+#define ROUNDS 6000
+#define CHECK_EVERY 97
+#define COLD 4 /* 前几个变量只写一次，之后靠回收复制，快照常指向即将回收的页 */
+
+static const uint16_t sn_size[SN_COUNT] = {0, 24, 4, 4, 1, 0, 0, 0, 8, 8, 2, 16};
+static uint8_t model[SN_COUNT][VARIABLE_MAX_SIZE];
+static uint16_t model_len[SN_COUNT];
+static uint8_t present[SN_COUNT];
+static uint8_t backup[EE_SIM_FLASH_SIZE];
+
+/* 写入页（序号最大的已启用页）开头的快照第一个字的位置，没有快照时为 NULL；
+   live 返回已启用的页数 */
+static uint8_t* find_snapshot(uint16_t* live) {
+  uint8_t* flash = EE_SimFlash();
+  uint32_t seq, retired, best = 0, trailer;
+  uint32_t rec_size = EE_RECORD_SIZE(4 + 4 * SN_COUNT);
+  uint8_t* page = NULL;
+  uint16_t i;
+
+  *live = 0;
+  for (i = 0; i < EE_PAGE_COUNT; i++) {
+    memcpy(&seq, flash + i * PAGE_SIZE, 4);
+    memcpy(&retired, flash + i * PAGE_SIZE + EE_PROGRAM_WIDTH, 4);
+    if (seq == 0xFFFFFFFF || retired == 0) {
+      continue;
+    }
+    (*live)++;
+    if (page == NULL || seq >= best) {
+      best = seq;
+      page = flash + i * PAGE_SIZE;
+    }
+  }
+  if (page == NULL) {
+    return NULL;
+  }
+  page += 2 * EE_PROGRAM_WIDTH;
+  memcpy(&trailer, page + rec_size - 4, 4);
+  return trailer >> 16 == 0x0001 ? page : NULL;
+}
+
+/* 重新上电，返回 EE_InstInit 的读访问次数，并检查各变量的值 */
+static long boot(const char* tag, uint32_t round) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  ee_sim_counters_t cnt;
+  uint16_t slot, br, status;
+
+  EE_SimResetCounters();
+  if (EE_InstInit(&sn) != FLASH_COMPLETE) {
+    printf("round %u: %s init failed\n", round, tag);
+    return -1;
+  }
+  EE_SimGetCounters(&cnt);
+  for (slot = 0; slot < SN_COUNT; slot++) {
+    br = 0;
+    status = EE_InstRead(&sn, (uint16_t)(SN_BASE + 1 + slot), buf, sizeof(buf),
+                         &br);
+    if (present[slot] ? status != 0 || br != model_len[slot] ||
+                            memcmp(buf, model[slot], br) != 0
+                      : status != 1) {
+      printf("round %u: %s slot %u mismatch (status %u)\n", round, tag, slot,
+             status);
+      return -1;
+    }
+  }
+  return (long)cnt.read_accesses;
+}
+
+int main(void) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint8_t* snap;
+  uint32_t round, zero = 0;
+  uint16_t slot, len, i, live;
+  long fast, full, fast_sum = 0, full_sum = 0, boots = 0;
+
+  srand(3);
+  EE_SimInit(NULL);
+  if (EE_InstInit(&sn) != FLASH_COMPLETE) {
+    printf("init failed\n");
+    return 1;
+  }
+  for (round = 1; round <= ROUNDS; round++) {
+    slot = round <= SN_COUNT ? (uint16_t)(round - 1)
+                             : (uint16_t)(COLD + rand() % (SN_COUNT - COLD));
+    len = sn_size[slot] != 0 ? sn_size[slot] : (uint16_t)(1 + rand() % 40);
+    for (i = 0; i < len; i++) {
+      buf[i] = (uint8_t)rand();
+    }
+    if (EE_InstWrite(&sn, (uint16_t)(SN_BASE + 1 + slot), buf, len) !=
+        FLASH_COMPLETE) {
+      printf("round %u: write failed\n", round);
+      return 1;
+    }
+    memcpy(model[slot], buf, len);
+    model_len[slot] = len;
+    present[slot] = 1;
+    if (round % 5 == 0) {
+      EE_InstMaintenance(&sn, 2);
+    }
+    if (round % CHECK_EVERY != 0 || (snap = find_snapshot(&live)) == NULL) {
+      continue;
+    }
+    /* 先破坏快照的第一个字（只把位写成 0）逐页扫描，再恢复存储用快照启动 */
+    memcpy(backup, EE_SimFlash(), sizeof(backup));
+    memcpy(snap, &zero, 4);
+    full = boot("full scan", round);
+    memcpy(EE_SimFlash(), backup, sizeof(backup));
+    fast = boot("snapshot", round);
+    if (full < 0 || fast < 0) {
+      return 1;
+    }
+    /* 只有写入页时两种方式都只扫描这一页，快照反而多读了自身 */
+    if (live < 2) {
+      continue;
+    }
+    if (fast >= full) {
+      printf("round %u: snapshot not used (%ld reads, full scan %ld)\n", round,
+             fast, full);
+      return 1;
+    }
+    fast_sum += fast;
+    full_sum += full;
+    boots++;
+  }
+  if (boots == 0) {
+    printf("no snapshot written\n");
+    return 1;
+  }
+  printf("ok boots=%ld reads: snapshot %ld full scan %ld (%ld%%)\n", boots,
+         fast_sum / boots, full_sum / boots, fast_sum * 100 / full_sum);
+  return 0;
+}
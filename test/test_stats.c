@@ -0,0 +1,180 @@
+/*!
+    \brief      运行统计（EE_STATS）：随机读写后，读写次数与调用次数一致，编程、擦除
+                次数与仿真器的计数一致；读写耗时的次数、最小值、最大值和直方图各格
+                与测试在调用前后用 EE_PortCycles 量得的耗时逐一相符；
+                EE_InstResetStats 后全部清零
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+#if !EE_STATS
+#error "build with -DEE_STATS=1"
+#endif
+
+#define SS_TABLE(X)   \
+  X(SS_NAME, 0, 0)    \
+  X(SS_PAN, 4, 0)     \
+  X(SS_FLAG, 2, 0)    \
+  X(SS_CURVE, 24, 0)  \
+  X(SS_MODE, 1, 0)    \
+  X(SS_CAL, 16, 0)
+
+enum { SS_BASE = 0xB000, SS_TABLE(EE_VAR_ENUM) SS_END };
+EE_INSTANCE_DEFINE(ss, SS_TABLE, SS_BASE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+#define SS_COUNT (SS_END - SS_BASE - 1)
+#define ROUNDS 20000
+
+static const uint16_t ss_size[SS_COUNT] = {0, 4, 2, 24, 1, 16};
+
+#define FAIL(...)                               \
+  do {                                          \
+    printf(__VA_ARGS__);                        \
+    printf(" (line %d)\n", __LINE__);           \
+    return 1;                                   \
+  } while (0)
+
+/* 测试自己按 EE_StatsLatency 的规则记录的耗时 */
+static ee_latency_t my_read, my_write;
+
+static void record(ee_latency_t* lat, uint32_t cycles) {
+  uint16_t bucket = 0;
+
+  /* 第 0 格为少于 2^EE_STATS_SHIFT 周期，之后每格上限加倍 */
+  while (bucket < EE_STATS_BUCKETS - 1 &&
+         cycles >= (uint32_t)1 << (EE_STATS_SHIFT + bucket)) {
+    bucket++;
+  }
+  if (lat->count == 0 || cycles < lat->min) {
+    lat->min = cycles;
+  }
+  if (cycles > lat->max) {
+    lat->max = cycles;
+  }
+  lat->count++;
+  lat->hist[bucket]++;
+}
+
+static int same_latency(const char* tag, const ee_latency_t* got,
+                        const ee_latency_t* want) {
+  uint32_t sum = 0;
+  uint16_t i;
+
+  for (i = 0; i < EE_STATS_BUCKETS; i++) {
+    sum += got->hist[i];
+    if (got->hist[i] != want->hist[i]) {
+      printf("%s: bucket %u %u want %u\n", tag, i, got->hist[i],
+             want->hist[i]);
+      return 1;
+    }
+  }
+  if (got->count != want->count || sum != got->count ||
+      got->min != want->min || got->max != want->max) {
+    printf("%s: count %u min %u max %u want %u %u %u\n", tag, got->count,
+           got->min, got->max, want->count, want->min, want->max);
+    return 1;
+  }
+  return 0;
+}
+
+int main(void) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  ee_batch_item_t items[SS_COUNT];
+  ee_stats_t st, zero;
+  ee_sim_counters_t cnt;
+  uint32_t round, start, reads = 0, writes = 0, lookups = 0, used = 0;
+  uint16_t slot, len, i, br[SS_COUNT];
+
+  srand(23);
+  EE_SimInit(NULL);
+  if (EE_InstInit(&ss) != FLASH_COMPLETE) FAIL("init");
+  EE_InstResetStats(&ss);
+  EE_SimResetCounters();
+  for (i = 0; i < SS_COUNT; i++) {
+    items[i].virt_addr = (uint16_t)(SS_BASE + 1 + i);
+    items[i].size = VARIABLE_MAX_SIZE;
+    items[i].data = buf;
+  }
+
+  for (round = 1; round <= ROUNDS; round++) {
+    slot = (uint16_t)(rand() % SS_COUNT);
+    len = ss_size[slot] != 0 ? ss_size[slot] : (uint16_t)(1 + rand() % 40);
+    for (i = 0; i < len; i++) {
+      buf[i] = (uint8_t)rand();
+    }
+    start = EE_PortCycles();
+    if (EE_InstWrite(&ss, (uint16_t)(SS_BASE + 1 + slot), buf, len) !=
+        FLASH_COMPLETE) {
+      FAIL("round %u: write", round);
+    }
+    record(&my_write, EE_PortCycles() - start);
+    writes++;
+    lookups++;
+    /* 单项读取和一次读取全部变量各计一次读取 */
+    start = EE_PortCycles();
+    EE_InstRead(&ss, (uint16_t)(SS_BASE + 1 + rand() % SS_COUNT), buf,
+                sizeof(buf), &br[0]);
+    record(&my_read, EE_PortCycles() - start);
+    reads++;
+    lookups++;
+    if (round % 10 == 0) {
+      start = EE_PortCycles();
+      EE_InstReadAll(&ss, items, SS_COUNT, br, NULL);
+      record(&my_read, EE_PortCycles() - start);
+      reads++;
+      lookups += SS_COUNT;
+    }
+    /* 维护不计入读写次数 */
+    if (round % 7 == 0) {
+      EE_InstMaintenance(&ss, 2);
+    }
+  }
+
+  EE_InstGetStats(&ss, &st);
+  EE_SimGetCounters(&cnt);
+  if (st.reads != reads || st.writes != writes) {
+    FAIL("reads %u writes %u, want %u %u", st.reads, st.writes, reads,
+         writes);
+  }
+  /* 回收复制记录时也按虚拟地址查找；按顺序分配地址的实例不查散列目录 */
+  if (st.lookups < lookups || st.probes != 0) {
+    FAIL("lookups %u probes %u, want >= %u and 0", st.lookups, st.probes,
+         lookups);
+  }
+  if (st.programs != cnt.words_programmed || st.erases != cnt.pages_erased) {
+    FAIL("programs %u erases %u, simulator %u %u", st.programs, st.erases,
+         cnt.words_programmed, cnt.pages_erased);
+  }
+  if (st.transfers == 0 || st.reclaims == 0 || st.copies == 0 ||
+      st.copies_max == 0 || st.copies_max > st.copies) {
+    FAIL("transfers %u reclaims %u copies %u max %u", st.transfers,
+         st.reclaims, st.copies, st.copies_max);
+  }
+  if (same_latency("write", &st.write, &my_write) ||
+      same_latency("read", &st.read, &my_read)) {
+    return 1;
+  }
+  for (i = 0; i < EE_STATS_BUCKETS; i++) {
+    used += st.transfer.hist[i];
+  }
+  if (st.transfer.count != st.transfers || used != st.transfers ||
+      st.transfer.min > st.transfer.max) {
+    FAIL("transfer latency count %u", st.transfer.count);
+  }
+  /* 耗时不是都落在同一格 */
+  for (i = 0, used = 0; i < EE_STATS_BUCKETS; i++) {
+    used += st.write.hist[i] != 0;
+  }
+  if (used < 2) FAIL("write latencies in %u bucket", used);
+
+  EE_InstResetStats(&ss);
+  EE_InstGetStats(&ss, &st);
+  memset(&zero, 0, sizeof(zero));
+  if (memcmp(&st, &zero, sizeof(st)) != 0) FAIL("reset");
+  printf("ok writes=%u reads=%u programs=%u erases=%u buckets=%u\n", writes,
+         reads, cnt.words_programmed, cnt.pages_erased, used);
+  return 0;
+}
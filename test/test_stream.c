@@ -0,0 +1,156 @@
+/*!
+    \brief      大变量的流式读写：分段写入、提交后分段读出；读取句柄读出打开时的值，
+                值所在页被擦除后返回 STREAM_ABORTED；打开失败的句柄、
+                读写用错的句柄都返回 STREAM_ABORTED，不越界
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+#define ST_TABLE(X)                       \
+  X(ST_BIG, 2 * VARIABLE_MAX_SIZE + 5, 0) \
+  X(ST_SMALL, 4, 0)
+
+enum { ST_BASE = 0x7000, ST_TABLE(EE_VAR_ENUM) ST_END };
+EE_INSTANCE_DEFINE(st, ST_TABLE, ST_BASE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+#define BIG_SIZE (2 * VARIABLE_MAX_SIZE + 5)
+#define STEP 23 /* 每段的字节数，不与块对齐 */
+
+#define FAIL(...)                               \
+  do {                                          \
+    printf(__VA_ARGS__);                        \
+    printf(" (line %d)\n", __LINE__);           \
+    return 1;                                   \
+  } while (0)
+
+static uint8_t big[BIG_SIZE];
+static uint8_t buf[BIG_SIZE];
+
+static uint16_t write_big(uint8_t seed) {
+  ee_stream_t stream;
+  uint16_t pos, n, status, i;
+
+  for (i = 0; i < BIG_SIZE; i++) {
+    big[i] = (uint8_t)(seed + i * 3);
+  }
+  status = EE_InstStreamOpenWrite(&st, &stream, ST_BIG);
+  for (pos = 0; status == FLASH_COMPLETE && pos < BIG_SIZE; pos += n) {
+    n = BIG_SIZE - pos > STEP ? STEP : BIG_SIZE - pos;
+    status = EE_StreamWrite(&stream, big + pos, n);
+  }
+  return status == FLASH_COMPLETE ? EE_StreamCommit(&stream) : status;
+}
+
+/* 分段读出整个值到 buf */
+static uint16_t read_all(ee_stream_t* stream) {
+  uint16_t pos, br, status;
+
+  for (pos = 0; pos < BIG_SIZE; pos += br) {
+    status = EE_StreamRead(stream, buf + pos, STEP, &br);
+    if (status != FLASH_COMPLETE) {
+      return status;
+    }
+    if (br == 0) {
+      break;
+    }
+  }
+  return pos == BIG_SIZE ? FLASH_COMPLETE : VAR_SIZE_OVERFLOW;
+}
+
+int main(void) {
+  ee_stream_t rd, wr, old;
+  uint8_t old_big[BIG_SIZE];
+  uint32_t small, rounds = 0;
+  uint16_t br, status;
+
+  EE_SimInit(NULL);
+  if (EE_InstInit(&st) != FLASH_COMPLETE) FAIL("init");
+
+  /* 未写入过：读出默认值 0 */
+  if (EE_InstStreamOpenRead(&st, &rd, ST_BIG) != 1) FAIL("open unwritten");
+  memset(buf, 0xAA, sizeof(buf));
+  if (read_all(&rd) != FLASH_COMPLETE) FAIL("read unwritten");
+  for (br = 0; br < BIG_SIZE; br++) {
+    if (buf[br] != 0) FAIL("default byte %u", br);
+  }
+
+  /* 打开失败的句柄不能读写 */
+  if (EE_InstStreamOpenRead(&st, &rd, ST_SMALL) != ADDR_INVALID ||
+      EE_InstStreamOpenRead(&st, &rd, ST_END) != ADDR_INVALID) {
+    FAIL("open read of non-large variable");
+  }
+  br = 1;
+  if (EE_StreamRead(&rd, buf, STEP, &br) != STREAM_ABORTED || br != 0) {
+    FAIL("read of failed handle");
+  }
+  if (EE_InstStreamOpenWrite(&st, &wr, ST_SMALL) != ADDR_INVALID ||
+      EE_StreamWrite(&wr, big, STEP) != STREAM_ABORTED ||
+      EE_StreamCommit(&wr) != STREAM_ABORTED) {
+    FAIL("write of failed handle");
+  }
+
+  status = write_big(1);
+  if (status != FLASH_COMPLETE) FAIL("write 0x%x", status);
+
+  /* 写入句柄不能读，读取句柄不能写、提交 */
+  if (EE_InstStreamOpenWrite(&st, &wr, ST_BIG) != FLASH_COMPLETE) {
+    FAIL("open write");
+  }
+  br = 1;
+  if (EE_StreamRead(&wr, buf, STEP, &br) != STREAM_ABORTED || br != 0) {
+    FAIL("read of write handle");
+  }
+  if (EE_InstStreamOpenRead(&st, &rd, ST_BIG) != 0) FAIL("open read");
+  if (EE_StreamWrite(&rd, big, STEP) != STREAM_ABORTED ||
+      EE_StreamCommit(&rd) != STREAM_ABORTED) {
+    FAIL("write of read handle");
+  }
+  if (read_all(&rd) != FLASH_COMPLETE || memcmp(buf, big, BIG_SIZE) != 0) {
+    FAIL("read back");
+  }
+
+  /* 打开后写入新值，已打开的读取仍读出旧值 */
+  memcpy(old_big, big, BIG_SIZE);
+  if (EE_InstStreamOpenRead(&st, &old, ST_BIG) != 0) FAIL("open old");
+  status = write_big(2);
+  if (status != FLASH_COMPLETE) FAIL("rewrite 0x%x", status);
+  if (EE_StreamRead(&old, buf, STEP, &br) != FLASH_COMPLETE || br != STEP ||
+      memcmp(buf, old_big, STEP) != 0) {
+    FAIL("old value after rewrite");
+  }
+  if (EE_InstStreamOpenRead(&st, &rd, ST_BIG) != 0 ||
+      read_all(&rd) != FLASH_COMPLETE || memcmp(buf, big, BIG_SIZE) != 0) {
+    FAIL("new value");
+  }
+
+  /* 旧值所在页擦除后，继续读取返回 STREAM_ABORTED */
+  if (EE_InstStreamOpenRead(&st, &rd, ST_BIG) != 0) FAIL("open before erase");
+  while (st.generation == old.gen) {
+    small = ++rounds;
+    if (EE_InstWrite(&st, ST_SMALL, &small, sizeof(small)) != FLASH_COMPLETE) {
+      FAIL("small write %u", rounds);
+    }
+    EE_InstMaintenance(&st, 2);
+    if (rounds > 100000) FAIL("no page erased");
+  }
+  if (EE_StreamRead(&old, buf, STEP, &br) != STREAM_ABORTED) {
+    FAIL("read after erase");
+  }
+  if (EE_StreamRead(&rd, buf, STEP, &br) != STREAM_ABORTED) {
+    FAIL("second reader after erase");
+  }
+  /* 重新打开后读出当前值 */
+  if (EE_InstStreamOpenRead(&st, &rd, ST_BIG) != 0 ||
+      read_all(&rd) != FLASH_COMPLETE || memcmp(buf, big, BIG_SIZE) != 0) {
+    FAIL("reopen after erase");
+  }
+  if (EE_InstInit(&st) != FLASH_COMPLETE) FAIL("reinit");
+  if (EE_InstStreamOpenRead(&st, &rd, ST_BIG) != 0 ||
+      read_all(&rd) != FLASH_COMPLETE || memcmp(buf, big, BIG_SIZE) != 0) {
+    FAIL("after reinit");
+  }
+  printf("ok size=%u writes before erase=%u\n", BIG_SIZE, rounds);
+  return 0;
+}
@@ -0,0 +1,166 @@
+/*!
+    \brief      从变量表尾删去变量后升级：用旧表写入（写入页最后几条记录属于被删除的
+                变量，包括紧凑记录和批量记录），换成新表 EE_InstInit 后其余变量的值
+                不丢，被删除变量的记录按长度越过、读不到；之后照常写入、回收，
+                重新 EE_InstInit 后值仍在。另外检查空批次不写入
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+/* TC_FLAG 能写成紧凑记录（EE_PACKED_RECORDS），TC_CAL 为普通记录 */
+#define TC_OLD_TABLE(X) \
+  X(TC_NAME, 0, 0)      \
+  X(TC_PAN, 4, 0)       \
+  X(TC_CURVE, 24, 0)    \
+  X(TC_FLAG, 2, 0)      \
+  X(TC_CAL, 16, 0)
+#define TC_NEW_TABLE(X) \
+  X(TC_NAME, 0, 0)      \
+  X(TC_PAN, 4, 0)       \
+  X(TC_CURVE, 24, 0)
+
+enum { TC_BASE = 0x6000, TC_OLD_TABLE(EE_VAR_ENUM) TC_END };
+EE_INSTANCE_DEFINE(tc_old, TC_OLD_TABLE, TC_BASE, EEPROM_START_ADDRESS,
+                   EE_PAGE_COUNT);
+EE_INSTANCE_DEFINE(tc_new, TC_NEW_TABLE, TC_BASE, EEPROM_START_ADDRESS,
+                   EE_PAGE_COUNT);
+
+#define VARS (TC_END - TC_BASE - 1)
+#define KEPT 3 /* 新表中的变量个数 */
+#define ROUNDS 3000
+
+static const uint16_t tc_size[VARS] = {0, 4, 24, 2, 16};
+static uint8_t model[VARS][VARIABLE_MAX_SIZE];
+static uint16_t model_len[VARS];
+
+static uint16_t make_value(uint16_t v, uint8_t* buf) {
+  uint16_t len = tc_size[v] != 0 ? tc_size[v] : (uint16_t)(1 + rand() % 40);
+  uint16_t i;
+
+  for (i = 0; i < len; i++) {
+    buf[i] = (uint8_t)rand();
+  }
+  return len;
+}
+
+static int write_var(ee_instance_t* inst, uint16_t v) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint16_t len = make_value(v, buf);
+  uint16_t status = EE_InstWrite(inst, (uint16_t)(TC_BASE + 1 + v), buf, len);
+
+  if (status != FLASH_COMPLETE) {
+    printf("write slot %u failed 0x%x\n", v, status);
+    return 1;
+  }
+  memcpy(model[v], buf, len);
+  model_len[v] = len;
+  return 0;
+}
+
+/* 用新表检查：保留的变量为最近写入的值，被删除的变量读不到 */
+static int check(const char* tag) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint16_t v, br, status;
+
+  for (v = 0; v < VARS; v++) {
+    status = EE_InstRead(&tc_new, (uint16_t)(TC_BASE + 1 + v), buf,
+                         sizeof(buf), &br);
+    if (v >= KEPT ? status == 0
+                  : status != 0 || br != model_len[v] ||
+                        memcmp(buf, model[v], br) != 0) {
+      printf("%s: slot %u mismatch (status 0x%x)\n", tag, v, status);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(void) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint32_t round;
+  uint16_t v, len;
+
+  srand(9);
+  EE_SimInit(NULL);
+  if (EE_InstInit(&tc_old) != FLASH_COMPLETE) {
+    printf("init failed\n");
+    return 1;
+  }
+  for (round = 0; round < ROUNDS; round++) {
+    if (write_var(&tc_old, (uint16_t)(rand() % VARS))) {
+      return 1;
+    }
+    if (round % 11 == 0) {
+      EE_InstMaintenance(&tc_old, 2);
+    }
+  }
+  for (v = 0; v < KEPT; v++) {
+    if (write_var(&tc_old, v)) {
+      return 1;
+    }
+  }
+  /* 写入页最后是被删除变量的记录和一批含有它的批量记录 */
+  len = make_value(TC_CAL - TC_BASE - 1, buf);
+  {
+    ee_batch_item_t items[] = {{TC_CAL, len, buf},
+                               {TC_PAN, model_len[1], model[1]}};
+
+    if (write_var(&tc_old, TC_CAL - TC_BASE - 1) ||
+        write_var(&tc_old, TC_FLAG - TC_BASE - 1) ||
+        EE_InstWriteBatch(&tc_old, items, 2) != FLASH_COMPLETE ||
+        write_var(&tc_old, TC_FLAG - TC_BASE - 1)) {
+      printf("final writes failed\n");
+      return 1;
+    }
+  }
+
+  /* 换成新表 */
+  if (EE_InstInit(&tc_new) != FLASH_COMPLETE) {
+    printf("init with new table failed\n");
+    return 1;
+  }
+  if (check("upgrade")) {
+    return 1;
+  }
+  for (round = 0; round < ROUNDS; round++) {
+    if (write_var(&tc_new, (uint16_t)(rand() % KEPT))) {
+      return 1;
+    }
+    if (round % 11 == 0) {
+      EE_InstMaintenance(&tc_new, 2);
+    }
+    if (round % 500 == 0 && check("rewrite")) {
+      return 1;
+    }
+  }
+  if (EE_InstInit(&tc_new) != FLASH_COMPLETE) {
+    printf("reinit failed\n");
+    return 1;
+  }
+  if (check("reinit")) {
+    return 1;
+  }
+  /* 空批次不写入任何内容 */
+  {
+    ee_batch_item_t empty[] = {{TC_NAME, 0, buf}};
+    ee_sim_counters_t before, after;
+
+    EE_SimGetCounters(&before);
+    if (EE_InstWriteBatch(&tc_new, empty, 0) != FLASH_COMPLETE ||
+        EE_InstWriteBatch(&tc_new, empty, 1) != FLASH_COMPLETE) {
+      printf("empty batch failed\n");
+      return 1;
+    }
+    EE_SimGetCounters(&after);
+    if (after.words_programmed != before.words_programmed) {
+      printf("empty batch programmed %u units\n",
+             after.words_programmed - before.words_programmed);
+      return 1;
+    }
+  }
+  printf("ok rounds=%u removed=%u\n", ROUNDS, VARS - KEPT);
+  return 0;
+}
@@ -0,0 +1,225 @@
+/*!
+    \brief      写回缓存（EE_WRITE_BACK）：同一变量的多次写入合并，写入前不编程，
+                读出缓存中的值；EE_InstFlush、超时（EE_InstMaintenance）、缓存满时
+                写出最早的一项、EE_InstPowerFail 之后直接写入；批量写入丢弃缓存中
+                被覆盖的值；未写出的值在重新 EE_InstInit 后丢失。
+                最后随机写入，与模型比较，写出后重新 EE_InstInit 值仍在
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom_sim.h"
+
+#if EE_WRITE_BACK != 4
+#error "build with -DEE_WRITE_BACK=4"
+#endif
+
+#define WB_TABLE(X)  \
+  X(WB_SPEED, 1, 0)  \
+  X(WB_DEAD, 1, 0)   \
+  X(WB_SENS, 1, 0)   \
+  X(WB_PAN, 4, 0)    \
+  X(WB_NAME, 0, 0)   \
+  X(WB_CURVE, 8, 0)
+
+enum { WB_BASE = 0x8000, WB_TABLE(EE_VAR_ENUM) WB_END };
+EE_INSTANCE_DEFINE(wb, WB_TABLE, WB_BASE, EEPROM_START_ADDRESS, EE_PAGE_COUNT);
+
+#define WB_COUNT (WB_END - WB_BASE - 1)
+#define ROUNDS 20000
+#define MS 1000000ull /* 虚拟时间 1ms */
+
+static const uint16_t wb_size[WB_COUNT] = {1, 1, 1, 4, 0, 8};
+
+#define FAIL(...)                               \
+  do {                                          \
+    printf(__VA_ARGS__);                        \
+    printf(" (line %d)\n", __LINE__);           \
+    return 1;                                   \
+  } while (0)
+
+/* flash 为写入 Flash 的值（重新 EE_InstInit 后读出），cached 为应用看到的值 */
+static uint8_t flash[WB_COUNT][VARIABLE_MAX_SIZE];
+static uint8_t cached[WB_COUNT][VARIABLE_MAX_SIZE];
+static uint16_t flash_len[WB_COUNT], cached_len[WB_COUNT];
+
+static uint32_t programmed(void) {
+  ee_sim_counters_t cnt;
+  EE_SimGetCounters(&cnt);
+  return cnt.words_programmed;
+}
+
+/* 缓存中占用的项数；EE_InstMaintenance 还可能回收，不能用编程次数判断 */
+static uint16_t entries(void) {
+  uint16_t i, n = 0;
+  for (i = 0; i < EE_WRITE_BACK; i++) {
+    n += wb.cache[i].used;
+  }
+  return n;
+}
+
+static uint16_t put(uint16_t slot) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint16_t len =
+      wb_size[slot] != 0 ? wb_size[slot] : (uint16_t)(1 + rand() % 40);
+  uint16_t i, status;
+
+  for (i = 0; i < len; i++) {
+    buf[i] = (uint8_t)rand();
+  }
+  status = EE_InstWrite(&wb, (uint16_t)(WB_BASE + 1 + slot), buf, len);
+  if (status == FLASH_COMPLETE) {
+    memcpy(cached[slot], buf, len);
+    cached_len[slot] = len;
+  }
+  return status;
+}
+
+/* 缓存已全部写出：Flash 中的值与应用看到的一致 */
+static void flushed(void) {
+  memcpy(flash, cached, sizeof(flash));
+  memcpy(flash_len, cached_len, sizeof(flash_len));
+}
+
+/* 重新上电：缓存中的值丢失 */
+static void lost(void) {
+  memcpy(cached, flash, sizeof(cached));
+  memcpy(cached_len, flash_len, sizeof(cached_len));
+}
+
+static int check(const char* tag) {
+  uint8_t buf[VARIABLE_MAX_SIZE];
+  uint16_t slot, br, status;
+
+  for (slot = 0; slot < WB_COUNT; slot++) {
+    status = EE_InstRead(&wb, (uint16_t)(WB_BASE + 1 + slot), buf, sizeof(buf),
+                         &br);
+    if (cached_len[slot] == 0 ? status != 1
+                              : status != 0 || br != cached_len[slot] ||
+                                    memcmp(buf, cached[slot], br) != 0) {
+      printf("%s: slot %u mismatch (status %u)\n", tag, slot, status);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int reboot(const char* tag) {
+  if (EE_InstInit(&wb) != FLASH_COMPLETE) {
+    printf("%s: init failed\n", tag);
+    return 1;
+  }
+  lost();
+  return check(tag);
+}
+
+int main(void) {
+  uint32_t round, before, i;
+  uint16_t slot;
+  uint8_t value;
+
+  srand(11);
+  EE_SimInit(NULL);
+  if (EE_InstInit(&wb) != FLASH_COMPLETE) FAIL("init");
+
+  /* 连续调节同一参数：全部合并在缓存中，不编程 */
+  before = programmed();
+  for (i = 0; i < 100; i++) {
+    if (put(WB_SPEED - WB_BASE - 1) != FLASH_COMPLETE) FAIL("write %u", i);
+    if (check("coalesce")) FAIL("write %u", i);
+  }
+  if (programmed() != before) FAIL("cached writes programmed");
+  /* 未写出就重新上电，值丢失 */
+  if (reboot("lost")) FAIL("unflushed value survived");
+
+  /* EE_InstFlush 只写出最后的值，再次调用不编程 */
+  for (i = 0; i < 100; i++) {
+    if (put(WB_SPEED - WB_BASE - 1) != FLASH_COMPLETE) FAIL("write %u", i);
+  }
+  before = programmed();
+  if (EE_InstFlush(&wb) != FLASH_COMPLETE) FAIL("flush");
+  if (programmed() == before) FAIL("flush programmed nothing");
+  before = programmed();
+  if (EE_InstFlush(&wb) != FLASH_COMPLETE || programmed() != before) {
+    FAIL("second flush");
+  }
+  flushed();
+  if (reboot("flush")) FAIL("after flush");
+
+  /* 缓存满时写入新变量，写出最早进入缓存的一项 */
+  for (slot = 0; slot < EE_WRITE_BACK; slot++) {
+    if (put(slot) != FLASH_COMPLETE) FAIL("fill %u", slot);
+    EE_SimSleep(MS);
+  }
+  before = programmed();
+  if (put(EE_WRITE_BACK) != FLASH_COMPLETE) FAIL("evict");
+  if (programmed() == before) FAIL("full cache did not evict");
+  memcpy(flash[0], cached[0], sizeof(flash[0]));
+  flash_len[0] = cached_len[0];
+  if (check("evict") || reboot("evict")) FAIL("oldest entry not written");
+
+  /* 超时：EE_InstMaintenance 写出超过 EE_FLUSH_TIMEOUT_MS 的项 */
+  if (put(WB_PAN - WB_BASE - 1) != FLASH_COMPLETE) FAIL("write pan");
+  EE_SimSleep((EE_FLUSH_TIMEOUT_MS / 2) * MS);
+  EE_InstMaintenance(&wb, 4);
+  if (entries() != 1) FAIL("flushed before timeout");
+  EE_SimSleep((EE_FLUSH_TIMEOUT_MS / 2 + 1) * MS);
+  EE_InstMaintenance(&wb, 4);
+  if (entries() != 0) FAIL("not flushed after timeout");
+  flushed();
+  if (reboot("timeout")) FAIL("after timeout");
+
+  /* 批量写入丢弃缓存中被覆盖的值 */
+  if (put(WB_DEAD - WB_BASE - 1) != FLASH_COMPLETE) FAIL("write dead");
+  value = (uint8_t)(cached[1][0] + 1);
+  {
+    ee_batch_item_t item = {WB_DEAD, 1, &value};
+
+    if (EE_InstWriteBatch(&wb, &item, 1) != FLASH_COMPLETE) FAIL("batch");
+  }
+  cached[1][0] = value;
+  if (check("batch") || EE_InstFlush(&wb) != FLASH_COMPLETE) FAIL("batch");
+  flushed();
+  if (reboot("batch")) FAIL("batch value overwritten by cache");
+
+  /* 掉电预警：写出缓存，之后直接写入，直到重新 EE_InstInit */
+  if (put(WB_SENS - WB_BASE - 1) != FLASH_COMPLETE) FAIL("write sens");
+  before = programmed();
+  if (EE_InstPowerFail(&wb) != FLASH_COMPLETE || programmed() == before) {
+    FAIL("power fail flush");
+  }
+  before = programmed();
+  if (put(WB_SENS - WB_BASE - 1) != FLASH_COMPLETE || programmed() == before) {
+    FAIL("write after power fail cached");
+  }
+  flushed();
+  if (reboot("power fail")) FAIL("after power fail");
+  before = programmed();
+  if (put(WB_SENS - WB_BASE - 1) != FLASH_COMPLETE || programmed() != before) {
+    FAIL("bypass kept after init");
+  }
+
+  /* 随机写入，读出的总是最近写入的值 */
+  for (round = 1; round <= ROUNDS; round++) {
+    if (put((uint16_t)(rand() % WB_COUNT)) != FLASH_COMPLETE) {
+      FAIL("round %u: write", round);
+    }
+    EE_SimSleep((uint64_t)(rand() % 20) * MS);
+    if (round % 13 == 0) {
+      EE_InstMaintenance(&wb, 2);
+    }
+    if (round % 997 == 0) {
+      if (EE_InstFlush(&wb) != FLASH_COMPLETE) FAIL("round %u: flush", round);
+      flushed();
+      if (reboot("random")) FAIL("round %u", round);
+    } else if (check("random")) {
+      FAIL("round %u", round);
+    }
+  }
+  if (EE_InstFlush(&wb) != FLASH_COMPLETE) FAIL("final flush");
+  flushed();
+  if (reboot("final")) FAIL("after final flush");
+  printf("ok rounds=%u entries=%u\n", ROUNDS, EE_WRITE_BACK);
+  return 0;
+}